@@ -0,0 +1,57 @@
+// SPDX-FileCopyrightText: 2021 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <QElapsedTimer>
+
+#include <mtx/events/member.hpp>
+#include <mtx/responses/sync.hpp>
+
+namespace benchmarks {
+//! Counts every call of operator new, so that a benchmark can report its allocations.
+extern std::atomic<uint64_t> allocations;
+
+extern const std::string LOCAL_USER;
+extern const std::string LOCAL_DEVICE;
+
+//! Run f, which does ops operations, and print the throughput and the allocations per operation.
+template<typename F>
+void
+measure(const char *name, int ops, F &&f)
+{
+        const auto allocationsBefore = allocations.load();
+
+        QElapsedTimer timer;
+        timer.start();
+        f();
+        const auto elapsed = timer.nsecsElapsed();
+
+        const auto allocated = allocations.load() - allocationsBefore;
+
+        std::printf("%-55s %8d ops %12.0f ops/s %10.1f allocs/op\n",
+                    name,
+                    ops,
+                    ops / (static_cast<double>(elapsed) / 1e9),
+                    static_cast<double>(allocated) / ops);
+}
+
+//! The state event, that joins user_id to a room.
+mtx::events::StateEvent<mtx::events::state::Member>
+memberEvent(const std::string &user_id);
+
+void
+crypto();
+void
+roomlist();
+void
+completion();
+void
+messageSearch();
+}
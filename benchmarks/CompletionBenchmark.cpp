@@ -0,0 +1,117 @@
+// SPDX-FileCopyrightText: 2021 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Measures building and querying the search indexes of the completers.
+
+#include <cstdlib>
+#include <random>
+#include <utility>
+
+#include <QStringList>
+
+#include "Benchmark.h"
+#include "CompletionProxyModel.h"
+#include "emoji/EmojiModel.h"
+
+namespace {
+using namespace benchmarks;
+
+constexpr int EMOJI_INDEX_BUILDS = 10;
+constexpr int QUERY_ROUNDS       = 100;
+constexpr int TRIE_ENTRIES       = 100000;
+constexpr int TRIE_QUERIES       = 100;
+
+//! What users type after the colon, including some typos.
+const QStringList EMOJI_QUERIES = {
+  "smile", "thumbs", "hart", "cat", "fire", "tada", "pary", "eyes", "ok", "rocket"};
+
+void
+benchmarkEmojiIndex()
+{
+        emoji::EmojiModel model;
+
+        std::shared_ptr<const CompletionProxyModel::SearchIndex> index;
+        measure("emoji search index, build", EMOJI_INDEX_BUILDS, [&]() {
+                for (int i = 0; i < EMOJI_INDEX_BUILDS; i++)
+                        index = CompletionProxyModel::buildSearchIndex(&model);
+        });
+
+        std::vector<QVector<uint>> queries;
+        for (const auto &query : EMOJI_QUERIES)
+                queries.push_back(query.toUcs4());
+
+        // The limits of the "emoji" completer.
+        measure("emoji search index, query", QUERY_ROUNDS * EMOJI_QUERIES.size(), [&]() {
+                for (int i = 0; i < QUERY_ROUNDS; i++) {
+                        for (const auto &query : queries) {
+                                if (index->search(query, 7, 2).empty())
+                                        std::abort();
+                        }
+                }
+        });
+}
+
+//! Names like the ones of the members of a large room, made up of random words.
+std::vector<QString>
+randomNames(int count)
+{
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> letter('a', 'z'), length(3, 8), words(1, 3);
+
+        std::vector<QString> names;
+        names.reserve(count);
+        for (int i = 0; i < count; i++) {
+                QString name;
+                for (int w = words(rng); w > 0; w--) {
+                        if (!name.isEmpty())
+                                name += ' ';
+                        for (int l = length(rng); l > 0; l--)
+                                name += QChar(letter(rng));
+                }
+                names.push_back(std::move(name));
+        }
+        return names;
+}
+
+void
+benchmarkLargeTrie()
+{
+        const auto names = randomNames(TRIE_ENTRIES);
+
+        // Inserted like buildSearchIndex does: the full name and then every word of it.
+        CompletionProxyModel::SearchIndex index;
+        measure("trie, insert 100k names", TRIE_ENTRIES, [&]() {
+                for (int i = 0; i < TRIE_ENTRIES; i++)
+                        index.insert(names[i].toUcs4(), i);
+                for (int i = 0; i < TRIE_ENTRIES; i++) {
+                        for (const auto &word : names[i].splitRef(' '))
+                                index.insert(word.toUcs4(), i);
+                }
+        });
+
+        // The beginnings of some names with the first two letters swapped, so that the exact
+        // search is followed by a fuzzy one.
+        std::vector<QVector<uint>> queries;
+        for (int i = 0; i < TRIE_QUERIES; i++) {
+                auto query = names[i * (TRIE_ENTRIES / TRIE_QUERIES)].left(4).toUcs4();
+                std::swap(query[0], query[1]);
+                queries.push_back(std::move(query));
+        }
+
+        // The limits of the "user" completer.
+        measure("trie, search 100k names", TRIE_QUERIES, [&]() {
+                for (const auto &query : queries) {
+                        if (index.search(query, 7, 2).empty())
+                                std::abort();
+                }
+        });
+}
+}
+
+void
+benchmarks::completion()
+{
+        benchmarkEmojiIndex();
+        benchmarkLargeTrie();
+}
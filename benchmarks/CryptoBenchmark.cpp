@@ -0,0 +1,327 @@
+// SPDX-FileCopyrightText: 2021 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Measures the crypto code, that runs for every event: encrypting and decrypting megolm messages,
+// storing and loading megolm sessions, looking up the latest olm session of a device and the
+// verification status of a user.
+
+#include <cstdlib>
+#include <limits>
+
+#include <QDateTime>
+#include <QThread>
+
+#include <mtx/responses/crypto.hpp>
+#include <mtxclient/crypto/client.hpp>
+#include <nlohmann/json.hpp>
+
+#include "Benchmark.h"
+#include "Cache.h"
+#include "Cache_p.h"
+#include "Olm.h"
+
+using json = nlohmann::json;
+
+namespace {
+using namespace benchmarks;
+
+constexpr int MEGOLM_SESSIONS      = 1000;
+constexpr int GROUP_MESSAGES       = 1000;
+constexpr int OLM_DEVICES          = 200;
+constexpr int OLM_SESSIONS_PER_KEY = 5;
+constexpr int OLM_LOOKUPS          = 10;
+constexpr int USERS                = 100;
+constexpr int DEVICES_PER_USER     = 5;
+constexpr int VERIFICATION_ROUNDS  = 100;
+
+const std::string ENCRYPTED_ROOM("!encrypted:localhost");
+
+//! The json, which is signed for an object, i.e. the object without its signatures.
+template<typename T>
+std::string
+signedJson(const T &object)
+{
+        json j = object;
+        j.erase("signatures");
+        j.erase("unsigned");
+        return j.dump();
+}
+
+mtx::crypto::CrossSigningKeys
+crossSigningKey(const std::string &user_id, const std::string &usage, mtx::crypto::PkSigning &key)
+{
+        mtx::crypto::CrossSigningKeys keys;
+        keys.user_id = user_id;
+        keys.usage   = {usage};
+
+        keys.keys["ed25519:" + key.public_key()] = key.public_key();
+        return keys;
+}
+
+void
+benchmarkMegolmSessions()
+{
+        auto outbound          = olm::client()->init_outbound_group_session();
+        const auto session_key = mtx::crypto::session_key(outbound.get());
+
+        std::vector<MegolmSessionIndex> indices;
+        indices.reserve(MEGOLM_SESSIONS);
+        for (int i = 0; i < MEGOLM_SESSIONS; i++) {
+                MegolmSessionIndex index;
+                index.room_id    = "!room" + std::to_string(i % 20) + ":localhost";
+                index.session_id = "session" + std::to_string(i);
+                index.sender_key = "sender" + std::to_string(i % 50);
+                indices.push_back(std::move(index));
+        }
+
+        std::vector<mtx::crypto::InboundGroupSessionPtr> sessions;
+        sessions.reserve(MEGOLM_SESSIONS);
+        for (int i = 0; i < MEGOLM_SESSIONS; i++)
+                sessions.push_back(olm::client()->init_inbound_group_session(session_key));
+
+        GroupSessionData data;
+        data.sender_claimed_ed25519_key = olm::client()->identity_keys().ed25519;
+
+        measure("saveInboundMegolmSession", MEGOLM_SESSIONS, [&]() {
+                for (int i = 0; i < MEGOLM_SESSIONS; i++)
+                        cache::saveInboundMegolmSession(indices[i], std::move(sessions[i]), data);
+        });
+
+        measure("getInboundMegolmSession", MEGOLM_SESSIONS, [&]() {
+                for (const auto &index : indices) {
+                        if (!cache::getInboundMegolmSession(index))
+                                std::abort();
+                }
+        });
+}
+
+void
+benchmarkOlmSessions()
+{
+        mtx::crypto::OlmClient peer;
+        peer.create_new_account();
+        peer.generate_one_time_keys(1);
+        const auto peer_identity = peer.identity_keys().curve25519;
+        const auto one_time_key  = peer.one_time_keys().curve25519.begin()->second;
+
+        std::vector<std::string> device_keys;
+        for (int d = 0; d < OLM_DEVICES; d++) {
+                device_keys.push_back("curve25519-device" + std::to_string(d));
+                for (int s = 0; s < OLM_SESSIONS_PER_KEY; s++)
+                        cache::saveOlmSession(
+                          device_keys.back(),
+                          olm::client()->create_outbound_session(peer_identity, one_time_key),
+                          1000 * d + s);
+        }
+
+        measure("getLatestOlmSession", OLM_DEVICES * OLM_LOOKUPS, [&]() {
+                for (int i = 0; i < OLM_LOOKUPS; i++) {
+                        for (const auto &key : device_keys) {
+                                if (!cache::getLatestOlmSession(key))
+                                        std::abort();
+                        }
+                }
+        });
+}
+
+void
+benchmarkVerificationStatus()
+{
+        // our device key -> our master key -> our user signing key -> their master key -> their
+        // self signing key -> their devices
+        auto ourMaster      = mtx::crypto::PkSigning::new_key();
+        auto ourUserSigning = mtx::crypto::PkSigning::new_key();
+
+        mtx::responses::QueryKeys query;
+
+        auto master = crossSigningKey(LOCAL_USER, "master", ourMaster);
+        master.signatures[LOCAL_USER]["ed25519:" + LOCAL_DEVICE] =
+          olm::client()->sign_message(signedJson(master));
+        query.master_keys[LOCAL_USER] = master;
+
+        auto userSigning = crossSigningKey(LOCAL_USER, "user_signing", ourUserSigning);
+        userSigning.signatures[LOCAL_USER]["ed25519:" + ourMaster.public_key()] =
+          ourMaster.sign(signedJson(userSigning));
+        query.user_signing_keys[LOCAL_USER] = userSigning;
+
+        std::vector<std::string> users;
+        for (int u = 0; u < USERS; u++) {
+                const auto user_id = "@user" + std::to_string(u) + ":localhost";
+                users.push_back(user_id);
+
+                auto theirMaster      = mtx::crypto::PkSigning::new_key();
+                auto theirSelfSigning = mtx::crypto::PkSigning::new_key();
+
+                auto masterKeys = crossSigningKey(user_id, "master", theirMaster);
+                masterKeys.signatures[LOCAL_USER]["ed25519:" + ourUserSigning.public_key()] =
+                  ourUserSigning.sign(signedJson(masterKeys));
+                query.master_keys[user_id] = masterKeys;
+
+                auto selfSigning = crossSigningKey(user_id, "self_signing", theirSelfSigning);
+                selfSigning.signatures[user_id]["ed25519:" + theirMaster.public_key()] =
+                  theirMaster.sign(signedJson(selfSigning));
+                query.self_signing_keys[user_id] = selfSigning;
+
+                for (int d = 0; d < DEVICES_PER_USER; d++) {
+                        const auto device_id = "DEVICE" + std::to_string(d);
+
+                        mtx::crypto::DeviceKeys device;
+                        device.user_id    = user_id;
+                        device.device_id  = device_id;
+                        device.algorithms = {"m.olm.v1.curve25519-aes-sha2",
+                                             "m.megolm.v1.aes-sha2"};
+                        device.keys["curve25519:" + device_id] =
+                          "curve25519-" + std::to_string(u) + "-" + device_id;
+                        device.keys["ed25519:" + device_id] =
+                          "ed25519-" + std::to_string(u) + "-" + device_id;
+                        device.signatures[user_id]["ed25519:" + theirSelfSigning.public_key()] =
+                          theirSelfSigning.sign(signedJson(device));
+                        query.device_keys[user_id][device_id] = device;
+                }
+        }
+
+        // The cache verifies the new keys on its own pool and reports every user it has done.
+        std::atomic<int> recomputed{0};
+        auto connection = QObject::connect(
+          cache::client(),
+          &Cache::verificationStatusChanged,
+          [&recomputed](const std::string &) { ++recomputed; },
+          Qt::DirectConnection);
+
+        measure("verificationStatus, new keys (verifies signatures)", USERS + 1, [&]() {
+                cache::updateUserKeys("", query);
+                while (recomputed.load() < USERS + 1)
+                        QThread::yieldCurrentThread();
+        });
+
+        QObject::disconnect(connection);
+
+        if (cache::verificationStatus(users.front()).user_verified != crypto::Trust::Verified) {
+                std::fprintf(stderr, "the generated cross-signing chain does not verify\n");
+                std::abort();
+        }
+
+        for (const auto &user_id : users)
+                cache::markDeviceUnverified(user_id, "NOTADEVICE");
+
+        measure("verificationStatus, invalidated (remembered signatures)", USERS, [&]() {
+                for (const auto &user_id : users)
+                        cache::verificationStatus(user_id);
+        });
+
+        measure("verificationStatus, cached", USERS * VERIFICATION_ROUNDS, [&]() {
+                for (int i = 0; i < VERIFICATION_ROUNDS; i++) {
+                        for (const auto &user_id : users)
+                                cache::verificationStatus(user_id);
+                }
+        });
+}
+
+void
+benchmarkGroupMessages()
+{
+        using namespace mtx::events;
+
+        // An encrypted room with the users of benchmarkVerificationStatus, so that every member
+        // has devices, which are compared to the ones the session was shared with.
+        mtx::responses::Sync sync;
+        sync.next_batch = "benchmark";
+        auto &room      = sync.rooms.join[ENCRYPTED_ROOM];
+
+        // The session is never rotated, since sharing a new one needs a homeserver.
+        StateEvent<state::Encryption> encryption;
+        encryption.type                         = EventType::RoomEncryption;
+        encryption.event_id                     = "$encryption";
+        encryption.sender                       = LOCAL_USER;
+        encryption.origin_server_ts             = 0;
+        encryption.content.rotation_period_ms   = std::numeric_limits<uint64_t>::max();
+        encryption.content.rotation_period_msgs = std::numeric_limits<uint64_t>::max();
+        room.state.events.push_back(encryption);
+
+        room.state.events.push_back(memberEvent(LOCAL_USER));
+        for (int u = 0; u < USERS; u++)
+                room.state.events.push_back(
+                  memberEvent("@user" + std::to_string(u) + ":localhost"));
+
+        cache::client()->saveState(sync);
+
+        const auto members = cache::client()->getMemberDevices(ENCRYPTED_ROOM);
+        if (!members || members->size() != USERS + 1) {
+                std::fprintf(stderr, "the members of the encrypted room were not stored\n");
+                std::abort();
+        }
+
+        // Shared with every member already, so that encrypting doesn't send any keys.
+        GroupSessionData data;
+        data.timestamp                  = QDateTime::currentMSecsSinceEpoch();
+        data.sender_claimed_ed25519_key = olm::client()->identity_keys().ed25519;
+        for (const auto &[user_id, devices] : *members) {
+                auto &sharedWith = data.currently.keys[user_id];
+                for (const auto &device_id : devices)
+                        sharedWith.deviceids[device_id] = 0;
+        }
+
+        auto outbound = olm::client()->init_outbound_group_session();
+
+        MegolmSessionIndex index;
+        index.room_id    = ENCRYPTED_ROOM;
+        index.session_id = mtx::crypto::session_id(outbound.get());
+        index.sender_key = olm::client()->identity_keys().curve25519;
+        cache::saveInboundMegolmSession(
+          index,
+          olm::client()->init_inbound_group_session(mtx::crypto::session_key(outbound.get())),
+          data);
+        cache::saveOutboundMegolmSession(ENCRYPTED_ROOM, data, outbound);
+
+        std::vector<json> bodies;
+        bodies.reserve(GROUP_MESSAGES);
+        for (int i = 0; i < GROUP_MESSAGES; i++)
+                bodies.push_back(
+                  {{"type", "m.room.message"},
+                   {"content", {{"msgtype", "m.text"}, {"body", "message " + std::to_string(i)}}},
+                   {"room_id", ENCRYPTED_ROOM}});
+
+        std::vector<msg::Encrypted> encrypted;
+        encrypted.reserve(GROUP_MESSAGES);
+        measure("encrypt_group_message", GROUP_MESSAGES, [&]() {
+                for (const auto &body : bodies)
+                        encrypted.push_back(
+                          olm::encrypt_group_message(ENCRYPTED_ROOM, LOCAL_DEVICE, body));
+        });
+
+        if (encrypted.back().session_id != index.session_id) {
+                std::fprintf(stderr, "the megolm session was rotated\n");
+                std::abort();
+        }
+
+        std::vector<EncryptedEvent<msg::Encrypted>> events;
+        events.reserve(GROUP_MESSAGES);
+        for (int i = 0; i < GROUP_MESSAGES; i++) {
+                EncryptedEvent<msg::Encrypted> event;
+                event.type             = EventType::RoomEncrypted;
+                event.event_id         = "$message" + std::to_string(i);
+                event.room_id          = ENCRYPTED_ROOM;
+                event.sender           = LOCAL_USER;
+                event.origin_server_ts = i;
+                event.content          = std::move(encrypted[i]);
+                events.push_back(std::move(event));
+        }
+
+        measure("decryptEvent", GROUP_MESSAGES, [&]() {
+                for (const auto &event : events) {
+                        if (!olm::decryptEvent(index, event).event)
+                                std::abort();
+                }
+        });
+}
+}
+
+void
+benchmarks::crypto()
+{
+        benchmarkMegolmSessions();
+        benchmarkOlmSessions();
+        benchmarkVerificationStatus();
+        benchmarkGroupMessages();
+}
@@ -0,0 +1,108 @@
+// SPDX-FileCopyrightText: 2021 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Measures indexing messages for the local message search and searching them.
+
+#include <cstdlib>
+#include <random>
+
+#include "Benchmark.h"
+#include "Cache.h"
+#include "Cache_p.h"
+#include "UserSettingsPage.h"
+
+namespace {
+using namespace benchmarks;
+
+constexpr int MESSAGES      = 20000;
+constexpr int VOCABULARY    = 2000;
+constexpr int SEARCH_ROUNDS = 100;
+
+const std::string SEARCH_ROOM("!search:localhost");
+
+//! Messages of random words, all of them from a limited vocabulary like in a real chat.
+std::vector<std::string>
+randomMessages(int count)
+{
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> letter('a', 'z'), length(2, 9);
+
+        std::vector<std::string> vocabulary;
+        for (int i = 0; i < VOCABULARY; i++) {
+                std::string word;
+                for (int l = length(rng); l > 0; l--)
+                        word += static_cast<char>(letter(rng));
+                vocabulary.push_back(std::move(word));
+        }
+
+        // Some words are a lot more common than others.
+        std::geometric_distribution<int> wordIndex(0.01);
+        std::uniform_int_distribution<int> words(3, 15);
+
+        std::vector<std::string> messages;
+        messages.reserve(count);
+        for (int i = 0; i < count; i++) {
+                std::string message;
+                for (int w = words(rng); w > 0; w--) {
+                        if (!message.empty())
+                                message += ' ';
+                        message += vocabulary[wordIndex(rng) % VOCABULARY];
+                }
+                messages.push_back(std::move(message));
+        }
+        return messages;
+}
+
+void
+searchFor(const char *name, const std::string &query)
+{
+        measure(name, SEARCH_ROUNDS, [&]() {
+                for (int i = 0; i < SEARCH_ROUNDS; i++) {
+                        if (cache::client()->searchMessages(query, SEARCH_ROOM, 50).empty())
+                                std::abort();
+                }
+        });
+}
+}
+
+void
+benchmarks::messageSearch()
+{
+        using namespace mtx::events;
+
+        UserSettings::instance()->setMessageSearchIndex(true);
+
+        const auto messages = randomMessages(MESSAGES);
+
+        mtx::responses::Sync sync;
+        sync.next_batch = "search";
+        auto &room      = sync.rooms.join[SEARCH_ROOM];
+        room.state.events.push_back(memberEvent(LOCAL_USER));
+        for (int i = 0; i < MESSAGES; i++) {
+                RoomEvent<msg::Text> message;
+                message.type             = EventType::RoomMessage;
+                message.event_id         = "$search" + std::to_string(i);
+                message.sender           = LOCAL_USER;
+                message.origin_server_ts = i;
+                message.content.body     = messages[i];
+                room.timeline.events.push_back(message);
+        }
+
+        measure("saveState, indexing messages for search", MESSAGES, [&]() {
+                cache::client()->saveState(sync);
+        });
+
+        // Queries for the words of the newest and of an older message. Every message has at least
+        // three words.
+        const auto &newest  = messages.back();
+        const auto &older   = messages[MESSAGES / 2];
+        const auto twoWords = older.find(' ', older.find(' ') + 1);
+
+        searchFor("searchMessages, word", newest.substr(0, newest.find(' ')));
+        searchFor("searchMessages, prefix", older.substr(0, 2) + "*");
+        searchFor("searchMessages, phrase", "\"" + older.substr(0, twoWords) + "\"");
+
+        // Drops the index again.
+        UserSettings::instance()->setMessageSearchIndex(false);
+}
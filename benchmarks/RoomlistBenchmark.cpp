@@ -0,0 +1,125 @@
+// SPDX-FileCopyrightText: 2021 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Measures loading, filtering and sorting the room list of an account with many rooms.
+
+#include <cstdlib>
+
+#include "Benchmark.h"
+#include "Cache.h"
+#include "Cache_p.h"
+#include "timeline/RoomlistModel.h"
+
+namespace {
+using namespace benchmarks;
+
+constexpr int ROOMS         = 5000;
+constexpr int SPACES        = 10;
+constexpr int FILTER_ROUNDS = 10;
+
+QString
+roomId(int i)
+{
+        return QString("!room%1:localhost").arg(i);
+}
+
+QString
+spaceId(int i)
+{
+        return QString("!space%1:localhost").arg(i);
+}
+
+//! A sync, which joins the rooms. Every room is in a space, some of them are tagged and every
+//! room has a message from a different time.
+mtx::responses::Sync
+roomsSync()
+{
+        using namespace mtx::events;
+
+        mtx::responses::Sync sync;
+        sync.next_batch = "rooms";
+
+        for (int s = 0; s < SPACES; s++) {
+                auto &space = sync.rooms.join[spaceId(s).toStdString()];
+
+                StateEvent<state::Create> create;
+                create.type             = EventType::RoomCreate;
+                create.event_id         = "$create";
+                create.sender           = LOCAL_USER;
+                create.origin_server_ts = 0;
+                create.content.creator  = LOCAL_USER;
+                create.content.type     = state::room_type::space;
+                space.state.events.push_back(create);
+                space.state.events.push_back(memberEvent(LOCAL_USER));
+
+                for (int r = s; r < ROOMS; r += SPACES) {
+                        StateEvent<state::space::Child> child;
+                        child.type             = EventType::SpaceChild;
+                        child.event_id         = "$child" + std::to_string(r);
+                        child.sender           = LOCAL_USER;
+                        child.state_key        = roomId(r).toStdString();
+                        child.origin_server_ts = 0;
+                        child.content.via      = std::vector<std::string>{"localhost"};
+                        space.state.events.push_back(child);
+                }
+        }
+
+        for (int r = 0; r < ROOMS; r++) {
+                auto &room = sync.rooms.join[roomId(r).toStdString()];
+                room.state.events.push_back(memberEvent(LOCAL_USER));
+
+                RoomEvent<msg::Text> message;
+                message.type             = EventType::RoomMessage;
+                message.event_id         = "$message" + std::to_string(r);
+                message.sender           = LOCAL_USER;
+                message.origin_server_ts = (r * 7919) % ROOMS;
+                message.content.body     = "message " + std::to_string(r);
+                room.timeline.events.push_back(message);
+
+                if (r % 3 == 0) {
+                        AccountDataEvent<account_data::Tags> tags;
+                        tags.type                   = EventType::Tag;
+                        tags.content.tags["u.work"] = {};
+                        if (r % 2 == 0)
+                                tags.content.tags["m.favourite"] = {};
+                        room.account_data.events.push_back(tags);
+                }
+        }
+
+        return sync;
+}
+}
+
+void
+benchmarks::roomlist()
+{
+        cache::client()->saveState(roomsSync());
+
+        RoomlistModel model;
+        measure("RoomlistModel::initializeRooms", ROOMS + SPACES, [&]() {
+                model.initializeRooms();
+        });
+
+        FilteredRoomlistModel filtered(&model);
+
+        // Every filter switch forgets the sort keys and filters all rooms again.
+        auto filterBy = [&filtered](const QString &filter) {
+                for (int i = 0; i < FILTER_ROUNDS; i++) {
+                        filtered.updateFilterTag(filter);
+                        filtered.invalidate();
+                        if (filtered.rowCount() == 0)
+                                std::abort();
+                }
+        };
+
+        measure("FilteredRoomlistModel, filter and sort all rooms", FILTER_ROUNDS * ROOMS, [&]() {
+                filterBy("");
+        });
+        measure("FilteredRoomlistModel, filter and sort by tag", FILTER_ROUNDS * ROOMS, [&]() {
+                filterBy("tag:u.work");
+        });
+        measure("FilteredRoomlistModel, filter and sort by space", FILTER_ROUNDS * ROOMS, [&]() {
+                filterBy("space:" + spaceId(0));
+        });
+}
@@ -0,0 +1,106 @@
+// SPDX-FileCopyrightText: 2021 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <cstdlib>
+#include <new>
+
+#include <QApplication>
+#include <QDir>
+#include <QStandardPaths>
+
+#include "Benchmark.h"
+#include "Cache.h"
+#include "Logging.h"
+#include "MatrixClient.h"
+#include "Olm.h"
+#include "UserSettingsPage.h"
+
+namespace benchmarks {
+std::atomic<uint64_t> allocations{0};
+
+const std::string LOCAL_USER("@bench:localhost");
+const std::string LOCAL_DEVICE("BENCHDEVICE");
+
+mtx::events::StateEvent<mtx::events::state::Member>
+memberEvent(const std::string &user_id)
+{
+        mtx::events::StateEvent<mtx::events::state::Member> event;
+        event.type               = mtx::events::EventType::RoomMember;
+        event.event_id           = "$member-" + user_id;
+        event.sender             = user_id;
+        event.state_key          = user_id;
+        event.origin_server_ts   = 0;
+        event.content.membership = mtx::events::state::Membership::Join;
+        return event;
+}
+}
+
+void *
+operator new(std::size_t size)
+{
+        ++benchmarks::allocations;
+        if (void *p = std::malloc(size ? size : 1))
+                return p;
+        throw std::bad_alloc();
+}
+
+void
+operator delete(void *p) noexcept
+{
+        std::free(p);
+}
+
+void
+operator delete(void *p, std::size_t) noexcept
+{
+        std::free(p);
+}
+
+int
+main(int argc, char *argv[])
+{
+        using namespace benchmarks;
+
+        // The settings need a QApplication, but nothing is ever shown.
+        if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+                qputenv("QT_QPA_PLATFORM", "offscreen");
+
+        // Keep the settings, the database and the secrets in the keychain away from the ones of a
+        // real profile. The secrets are stored under the application name.
+        QStandardPaths::setTestModeEnabled(true);
+        QCoreApplication::setOrganizationName("nheko");
+        QCoreApplication::setApplicationName("nheko-benchmark");
+
+        QApplication app(argc, argv);
+
+        // Start from an empty profile, even if an earlier run didn't get to clean up.
+        const auto dataDir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+        QDir(dataDir).removeRecursively();
+        QDir().mkpath(dataDir);
+
+        nhlog::init(QString("%1/nheko.log").arg(dataDir).toStdString());
+        for (auto logger : {nhlog::db(), nhlog::crypto(), nhlog::net(), nhlog::ui()})
+                logger->set_level(spdlog::level::err);
+
+        UserSettings::initialize(std::nullopt);
+
+        http::client()->set_user(mtx::identifiers::parse<mtx::identifiers::User>(LOCAL_USER));
+        http::client()->set_device_id(LOCAL_DEVICE);
+        olm::client()->set_user_id(LOCAL_USER);
+        olm::client()->set_device_id(LOCAL_DEVICE);
+        olm::client()->create_new_account();
+
+        cache::init(QString::fromStdString(LOCAL_USER));
+
+        benchmarks::crypto();
+        benchmarks::roomlist();
+        benchmarks::completion();
+        benchmarks::messageSearch();
+
+        // Also deletes the secrets, that the cache stored in the keychain.
+        cache::deleteData();
+        QDir(dataDir).removeRecursively();
+
+        return 0;
+}
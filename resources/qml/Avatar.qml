@@ -11,7 +11,7 @@ import im.nheko 1.0
 Rectangle {
     id: avatar
 
-    property alias url: img.source
+    property string url
     property string userid
     property string displayName
     property alias textColor: label.color
@@ -42,6 +42,7 @@ Rectangle {
     Image {
         id: img
 
+        source: avatar.url.replace("image://MxcImage/", "image://MxcAvatar/")
         anchors.fill: parent
         asynchronous: true
         fillMode: Image.PreserveAspectCrop
@@ -0,0 +1,106 @@
+// SPDX-FileCopyrightText: 2021 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+import QtQuick 2.9
+import QtQuick.Controls 2.3
+import QtQuick.Layouts 1.3
+import im.nheko 1.0
+
+Popup {
+    id: messageSearch
+
+    property var room: Rooms.currentRoom
+    property var results: []
+    property int textHeight: Math.round(Qt.application.font.pixelSize * 2.4)
+    property int textMargin: Math.round(textHeight / 8)
+
+    background: null
+    width: Math.round(parent.width / 2)
+    x: Math.round(parent.width / 2 - width / 2)
+    y: Math.round(parent.height / 4 - textHeight / 2)
+    modal: true
+    closePolicy: Popup.CloseOnEscape | Popup.CloseOnPressOutside
+    parent: Overlay.overlay
+    palette: Nheko.colors
+    onOpened: searchTextInput.forceActiveFocus()
+
+    ColumnLayout {
+        anchors.fill: parent
+        spacing: messageSearch.textMargin
+
+        MatrixTextField {
+            id: searchTextInput
+
+            Layout.fillWidth: true
+            font.pixelSize: Math.ceil(messageSearch.textHeight * 0.6)
+            padding: textMargin
+            color: Nheko.colors.text
+            placeholderText: Settings.messageSearchIndex ? qsTr("Search messages") : qsTr("Enable the search index for messages in the settings first")
+            enabled: Settings.messageSearchIndex && messageSearch.room
+            onAccepted: messageSearch.results = messageSearch.room.searchMessages(text)
+        }
+
+        ListView {
+            id: resultList
+
+            Layout.fillWidth: true
+            Layout.preferredHeight: Math.min(contentHeight, messageSearch.parent.height / 2)
+            clip: true
+            model: messageSearch.results
+            boundsBehavior: Flickable.StopAtBounds
+
+            delegate: Rectangle {
+                width: resultList.width
+                height: resultText.implicitHeight + 2 * messageSearch.textMargin
+                color: resultArea.containsMouse ? Nheko.colors.highlight : Nheko.colors.window
+
+                Label {
+                    id: resultText
+
+                    anchors.fill: parent
+                    anchors.margins: messageSearch.textMargin
+                    color: resultArea.containsMouse ? Nheko.colors.highlightedText : Nheko.colors.text
+                    elide: Text.ElideRight
+                    maximumLineCount: 2
+                    wrapMode: Text.Wrap
+                    textFormat: Text.PlainText
+                    text: (messageSearch.room.dataById(modelData, Room.UserName, "") ?? "") + ": " + (messageSearch.room.dataById(modelData, Room.Body, "") ?? "")
+                }
+
+                MouseArea {
+                    id: resultArea
+
+                    anchors.fill: parent
+                    hoverEnabled: true
+                    onClicked: {
+                        messageSearch.room.showEvent(modelData);
+                        messageSearch.close();
+                    }
+                }
+
+            }
+
+        }
+
+        Label {
+            Layout.fillWidth: true
+            visible: searchTextInput.text != "" && messageSearch.results.length == 0
+            color: Nheko.colors.text
+            padding: messageSearch.textMargin
+            text: qsTr("No messages found. Only messages received since enabling the index can be found.")
+            wrapMode: Text.Wrap
+
+            background: Rectangle {
+                color: Nheko.colors.window
+            }
+
+        }
+
+    }
+
+    Overlay.modal: Rectangle {
+        color: "#aa1E1E1E"
+    }
+
+}
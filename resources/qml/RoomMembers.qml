@@ -60,6 +60,15 @@ ApplicationWindow {
             onClicked: TimelineManager.openInviteUsers(members.roomId)
         }
 
+        MatrixTextField {
+            id: memberSearch
+
+            backgroundColor: Nheko.colors.window
+            placeholderText: qsTr("Search members")
+            Layout.fillWidth: true
+            onTextChanged: members.filterString = text
+        }
+
         ScrollView {
             palette: Nheko.colors
             padding: Nheko.paddingMedium
@@ -71,6 +71,14 @@ Page {
 
     }
 
+    Component {
+        id: messageSearchComponent
+
+        MessageSearch {
+        }
+
+    }
+
     Component {
         id: deviceVerificationDialog
 
@@ -96,6 +104,14 @@ Page {
         }
     }
 
+    Shortcut {
+        sequence: StandardKey.Find
+        onActivated: {
+            var search = messageSearchComponent.createObject(timelineRoot);
+            search.open();
+        }
+    }
+
     Shortcut {
         sequence: "Ctrl+Down"
         onActivated: Rooms.nextRoom()
@@ -4,41 +4,149 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <QBuffer>
-#include <QPixmapCache>
+#include <QCache>
 #include <QPointer>
+#include <algorithm>
 #include <memory>
-#include <unordered_map>
+#include <mutex>
 
 #include "AvatarProvider.h"
 #include "Cache.h"
 #include "Logging.h"
 #include "MatrixClient.h"
 #include "MxcImageProvider.h"
+#include "UserSettingsPage.h"
 #include "Utils.h"
 
-static QPixmapCache avatar_cache;
+namespace {
+struct CachedAvatar
+{
+        QImage image;
+        //! The size the image was fetched for. Requests up to that size can be served from it.
+        QSize requestedSize;
+};
+
+//! Decoded avatars shared by the widgets, notifications and QML. The cost is in KiB.
+struct AvatarCache
+{
+        std::mutex mtx;
+        QCache<QString, CachedAvatar> avatars{20 * 1024};
+        quint64 hits = 0, misses = 0;
+};
+
+AvatarCache &
+avatarCache()
+{
+        static AvatarCache cache;
+        static std::once_flag budgetApplied;
+        std::call_once(budgetApplied, [] {
+                if (auto settings = UserSettings::instance())
+                        cache.avatars.setMaxCost(settings->avatarCacheBudget() * 1024);
+        });
+        return cache;
+}
+
+QString
+cacheKey(const QString &avatarUrl)
+{
+        return avatarUrl.startsWith("mxc://") ? avatarUrl.mid(6) : avatarUrl;
+}
+}
 
 namespace AvatarProvider {
+QImage
+cachedAvatar(const QString &avatarUrl, const QSize &size)
+{
+        auto &cache = avatarCache();
+
+        QImage image;
+        {
+                std::lock_guard<std::mutex> lock(cache.mtx);
+                auto avatar = cache.avatars.object(cacheKey(avatarUrl));
+                if (!avatar || size.width() > avatar->requestedSize.width() ||
+                    size.height() > avatar->requestedSize.height()) {
+                        cache.misses++;
+                } else {
+                        cache.hits++;
+                        image = avatar->image;
+                }
+
+                if ((cache.hits + cache.misses) % 1000 == 0)
+                        nhlog::ui()->debug("avatar cache: {} hits, {} misses, {}/{} KiB used",
+                                           cache.hits,
+                                           cache.misses,
+                                           cache.avatars.totalCost(),
+                                           cache.avatars.maxCost());
+        }
+
+        if (!image.isNull() && (image.width() > size.width() || image.height() > size.height()))
+                image = image.scaled(size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        return image;
+}
+
 void
-resolve(QString avatarUrl, int size, QObject *receiver, AvatarCallback callback)
+cacheAvatar(const QString &avatarUrl, const QSize &size, const QImage &image)
+{
+        if (image.isNull() || size.width() <= 0 || size.height() <= 0)
+                return;
+
+        auto &cache    = avatarCache();
+        const auto key = cacheKey(avatarUrl);
+
+        std::lock_guard<std::mutex> lock(cache.mtx);
+        if (auto existing = cache.avatars.object(key);
+            existing && existing->requestedSize.width() >= size.width() &&
+            existing->requestedSize.height() >= size.height())
+                return;
+
+        cache.avatars.insert(key,
+                             new CachedAvatar{image, size},
+                             std::max(1, static_cast<int>(image.sizeInBytes() / 1024)));
+}
+
+void
+setCacheBudget(int kibibytes)
 {
-        const auto cacheKey = QString("%1_size_%2").arg(avatarUrl).arg(size);
+        auto &cache = avatarCache();
+
+        std::lock_guard<std::mutex> lock(cache.mtx);
+        cache.avatars.setMaxCost(kibibytes);
+}
 
+CacheStatistics
+cacheStatistics()
+{
+        auto &cache = avatarCache();
+
+        std::lock_guard<std::mutex> lock(cache.mtx);
+        CacheStatistics stats;
+        stats.hits      = cache.hits;
+        stats.misses    = cache.misses;
+        stats.usedKiB   = cache.avatars.totalCost();
+        stats.budgetKiB = cache.avatars.maxCost();
+        return stats;
+}
+
+void
+resolve(QString avatarUrl, int size, QObject *receiver, AvatarCallback callback)
+{
         QPixmap pixmap;
         if (avatarUrl.isEmpty()) {
                 callback(pixmap);
                 return;
         }
 
-        if (avatar_cache.find(cacheKey, &pixmap)) {
-                callback(pixmap);
+        if (auto image = cachedAvatar(avatarUrl, QSize(size, size)); !image.isNull()) {
+                callback(QPixmap::fromImage(std::move(image)));
                 return;
         }
 
         MxcImageProvider::download(avatarUrl.remove(QStringLiteral("mxc://")),
                                    QSize(size, size),
-                                   [callback, cacheKey, recv = QPointer<QObject>(receiver)](
-                                     QString, QSize, QImage img, QString) {
+                                   [callback, size, recv = QPointer<QObject>(receiver)](
+                                     QString id, QSize, QImage img, QString) {
+                                           cacheAvatar(id, QSize(size, size), img);
+
                                            if (!recv)
                                                    return;
 
@@ -46,10 +154,7 @@ resolve(QString avatarUrl, int size, QObject *receiver, AvatarCallback callback)
                                            QObject::connect(proxy.get(),
                                                             &AvatarProxy::avatarDownloaded,
                                                             recv,
-                                                            [callback, cacheKey](QPixmap pm) {
-                                                                    if (!pm.isNull())
-                                                                            avatar_cache.insert(
-                                                                              cacheKey, pm);
+                                                            [callback](QPixmap pm) {
                                                                     callback(pm);
                                                             });
 
@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <QImage>
 #include <QPixmap>
 #include <functional>
 
@@ -27,4 +28,26 @@ resolve(const QString &room_id,
         int size,
         QObject *receiver,
         AvatarCallback cb);
+
+//! Returns the avatar scaled down to the requested size or a null image, if no avatar large
+//! enough is cached. Safe to call from any thread.
+QImage
+cachedAvatar(const QString &avatarUrl, const QSize &size);
+//! Stores a decoded avatar, which was fetched for the given size. Only one image is kept per
+//! avatar, all smaller sizes are derived from it. Safe to call from any thread.
+void
+cacheAvatar(const QString &avatarUrl, const QSize &size, const QImage &image);
+//! Sets the memory budget of the avatar cache in KiB.
+void
+setCacheBudget(int kibibytes);
+
+struct CacheStatistics
+{
+        quint64 hits   = 0;
+        quint64 misses = 0;
+        int usedKiB    = 0;
+        int budgetKiB  = 0;
+};
+CacheStatistics
+cacheStatistics();
 }
@@ -3,6 +3,8 @@
 //
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#include <algorithm>
+#include <cstring>
 #include <limits>
 #include <stdexcept>
 #include <variant>
@@ -13,7 +15,10 @@
 #include <QFile>
 #include <QHash>
 #include <QMap>
+#include <QMessageAuthenticationCode>
 #include <QStandardPaths>
+#include <QTimer>
+#include <QtConcurrent>
 
 #if __has_include(<keychain.h>)
 #include <keychain.h>
@@ -35,15 +40,25 @@
 
 //! Should be changed when a breaking change occurs in the cache format.
 //! This will reset client's data.
-static const std::string CURRENT_CACHE_FORMAT_VERSION("2020.10.20");
+static const std::string CURRENT_CACHE_FORMAT_VERSION("2021.10.18");
 static const std::string SECRET("secret");
+//! Name of the local secret used to encrypt cached variants of encrypted media.
+static const std::string MEDIA_CACHE_KEY_SECRET("nheko.media_cache_key");
+constexpr std::size_t MEDIA_CACHE_KEY_SIZE = 32;
+//! Name of the local secret used to hash the terms and encrypt the entries of the message search
+//! index.
+static const std::string SEARCH_INDEX_KEY_SECRET("nheko.search_index_key");
+constexpr std::size_t SEARCH_INDEX_KEY_SIZE = 32;
 
 //! Keys used for the DB
 static const std::string_view NEXT_BATCH_KEY("next_batch");
 static const std::string_view OLM_ACCOUNT_KEY("olm_account");
 static const std::string_view CACHE_FORMAT_VERSION_KEY("cache_format_version");
 
-constexpr size_t MAX_RESTORED_MESSAGES = 30'000;
+constexpr size_t MAX_RESTORED_MESSAGES      = 30'000;
+constexpr size_t MAX_MEDIA_ENCRYPTION_INFOS = 100'000;
+//! How often the last use of media encryption info is updated (a day).
+constexpr uint64_t MEDIA_ENCRYPTION_INFO_TOUCH_INTERVAL_MS = 24ULL * 60 * 60 * 1000;
 
 constexpr auto DB_SIZE    = 32ULL * 1024ULL * 1024ULL * 1024ULL; // 32 GB
 constexpr auto MAX_DBS    = 32384UL;
@@ -54,6 +69,8 @@ constexpr auto BATCH_SIZE = 100;
 //! Contains UI information for the joined rooms. (i.e name, topic, avatar url etc).
 //! Format: room_id -> RoomInfo
 constexpr auto ROOMS_DB("rooms");
+//! room_id -> name, canonical alias and avatar url of a joined room
+constexpr auto ROOM_DIRECTORY_DB("room_directory");
 constexpr auto INVITES_DB("invites");
 //! maps each room to its parent space (id->id)
 constexpr auto SPACES_PARENTS_DB("space_parents");
@@ -80,6 +97,30 @@ constexpr auto INBOUND_MEGOLM_SESSIONS_DB("inbound_megolm_sessions");
 constexpr auto OUTBOUND_MEGOLM_SESSIONS_DB("outbound_megolm_sessions");
 //! MegolmSessionIndex -> session data about which devices have access to this
 constexpr auto MEGOLM_SESSIONS_DATA_DB("megolm_sessions_data_db");
+//! curve25519 key -> id of the olm session with the newest message
+constexpr auto OLM_LATEST_SESSIONS_DB("olm_latest_sessions");
+//! Number of megolm sessions imported per transaction and between progress updates.
+constexpr std::size_t SESSION_KEYS_BATCH_SIZE = 1000;
+
+//! mxc url -> encryption info needed to decrypt the media
+constexpr auto MEDIA_ENCRYPTION_INFO_DB("media_encryption_info");
+
+//! megolm session id -> key request we sent for it, that wasn't answered yet
+constexpr auto OUTGOING_KEY_REQUESTS_DB("outgoing_key_requests");
+//! Unanswered key requests are forgotten after this time (30 days).
+constexpr uint64_t MAX_KEY_REQUEST_AGE_MS = 30ULL * 24 * 60 * 60 * 1000;
+
+//! hash of a term prefix -> inverted timestamp + "room_id event_id" of the messages containing it,
+//! newest first
+constexpr auto MESSAGE_SEARCH_DB("message_search");
+//! "room_id event_id" -> encrypted timestamp, term hashes and prefix hashes of an indexed message
+constexpr auto MESSAGE_SEARCH_EVENTS_DB("message_search_events");
+//! Messages are indexed under every prefix of their terms in this range of lengths.
+constexpr int MIN_SEARCH_PREFIX           = 2;
+constexpr int MAX_SEARCH_PREFIX           = 16;
+constexpr int SEARCH_TERM_HASH_SIZE       = 8;
+constexpr int SEARCH_ENTRY_IV_SIZE        = 16;
+constexpr int SEARCH_INDEX_FLUSH_DELAY_MS = 1000;
 
 using CachedReceipts = std::multimap<uint64_t, std::string, std::greater<uint64_t>>;
 using Receipts       = std::map<std::string, std::map<std::string, uint64_t>>;
@@ -192,8 +233,14 @@ Cache::Cache(const QString &userId, QObject *parent)
   , env_{nullptr}
   , localUserId_{userId}
 {
+        verificationPool_.setMaxThreadCount(1);
+
         setup();
         connect(this, &Cache::userKeysUpdate, this, &Cache::updateUserKeys, Qt::QueuedConnection);
+        connect(UserSettings::instance().data(),
+                &UserSettings::messageSearchIndexChanged,
+                this,
+                &Cache::setMessageSearchIndexEnabled);
 }
 
 void
@@ -273,6 +320,7 @@ Cache::setup()
         auto txn          = lmdb::txn::begin(env_);
         syncStateDb_      = lmdb::dbi::open(txn, SYNC_STATE_DB, MDB_CREATE);
         roomsDb_          = lmdb::dbi::open(txn, ROOMS_DB, MDB_CREATE);
+        roomDirectoryDb_  = lmdb::dbi::open(txn, ROOM_DIRECTORY_DB, MDB_CREATE);
         spacesChildrenDb_ = lmdb::dbi::open(txn, SPACES_CHILDREN_DB, MDB_CREATE | MDB_DUPSORT);
         spacesParentsDb_  = lmdb::dbi::open(txn, SPACES_PARENTS_DB, MDB_CREATE | MDB_DUPSORT);
         invitesDb_        = lmdb::dbi::open(txn, INVITES_DB, MDB_CREATE);
@@ -287,12 +335,56 @@ Cache::setup()
         inboundMegolmSessionDb_  = lmdb::dbi::open(txn, INBOUND_MEGOLM_SESSIONS_DB, MDB_CREATE);
         outboundMegolmSessionDb_ = lmdb::dbi::open(txn, OUTBOUND_MEGOLM_SESSIONS_DB, MDB_CREATE);
         megolmSessionDataDb_     = lmdb::dbi::open(txn, MEGOLM_SESSIONS_DATA_DB, MDB_CREATE);
+        olmLatestSessionsDb_     = lmdb::dbi::open(txn, OLM_LATEST_SESSIONS_DB, MDB_CREATE);
+        outgoingKeyRequestsDb_   = lmdb::dbi::open(txn, OUTGOING_KEY_REQUESTS_DB, MDB_CREATE);
+
+        // Media
+        mediaEncryptionInfoDb_ = lmdb::dbi::open(txn, MEDIA_ENCRYPTION_INFO_DB, MDB_CREATE);
+
+        // Search
+        messageSearchDb_ = lmdb::dbi::open(txn, MESSAGE_SEARCH_DB, MDB_CREATE | MDB_DUPSORT);
+        messageSearchEventsDb_ = lmdb::dbi::open(txn, MESSAGE_SEARCH_EVENTS_DB, MDB_CREATE);
 
         txn.commit();
 
+        loadMediaCacheKey();
+        if (UserSettings::instance()->messageSearchIndex())
+                loadSearchIndexKey();
+
         databaseReady_ = true;
 }
 
+void
+Cache::loadMediaCacheKey()
+{
+        if (auto key = secret(MEDIA_CACHE_KEY_SECRET)) {
+                auto decoded = QByteArray::fromBase64(QByteArray::fromStdString(*key));
+                if (static_cast<std::size_t>(decoded.size()) == MEDIA_CACHE_KEY_SIZE) {
+                        std::atomic_store(&mediaCacheKey_,
+                                          std::make_shared<const mtx::crypto::BinaryBuf>(
+                                            decoded.begin(), decoded.end()));
+                        return;
+                }
+        }
+
+        nhlog::db()->info("generating new media cache key");
+
+        auto key = mtx::crypto::create_buffer(MEDIA_CACHE_KEY_SIZE);
+        storeSecret(MEDIA_CACHE_KEY_SECRET,
+                    QByteArray(reinterpret_cast<const char *>(key.data()), (int)key.size())
+                      .toBase64()
+                      .toStdString());
+
+        // Only use the key, if we can read it back after a restart. Otherwise the cached media
+        // would just be garbage.
+        if (secret(MEDIA_CACHE_KEY_SECRET))
+                std::atomic_store(&mediaCacheKey_,
+                                  std::make_shared<const mtx::crypto::BinaryBuf>(std::move(key)));
+        else
+                nhlog::db()->warn("media cache key could not be stored, not caching decrypted "
+                                  "variants of encrypted media");
+}
+
 void
 Cache::setEncryptedRoom(lmdb::txn &txn, const std::string &room_id)
 {
@@ -345,7 +437,7 @@ Cache::roomEncryptionSettings(const std::string &room_id)
 }
 
 mtx::crypto::ExportedSessionKeys
-Cache::exportSessionKeys()
+Cache::exportSessionKeys(const std::function<void(std::size_t, std::size_t)> &progress)
 {
         using namespace mtx::crypto;
 
@@ -354,6 +446,9 @@ Cache::exportSessionKeys()
         auto txn    = ro_txn(env_);
         auto cursor = lmdb::cursor::open(txn, inboundMegolmSessionDb_);
 
+        const auto total = inboundMegolmSessionDb_.size(txn);
+        keys.sessions.reserve(total);
+
         std::string_view key, value;
         while (cursor.get(key, value, MDB_NEXT)) {
                 ExportedSession exported;
@@ -373,33 +468,124 @@ Cache::exportSessionKeys()
                 exported.session_id  = index.session_id;
                 exported.session_key = export_session(saved_session.get(), -1);
 
-                keys.sessions.push_back(exported);
+                keys.sessions.push_back(std::move(exported));
+
+                if (progress && keys.sessions.size() % SESSION_KEYS_BATCH_SIZE == 0)
+                        progress(keys.sessions.size(), total);
         }
 
         cursor.close();
 
+        if (progress)
+                progress(total, total);
+
         return keys;
 }
 
+namespace {
+//! An imported megolm session, ready to be stored.
+struct ImportedSession
+{
+        MegolmSessionIndex index;
+        std::string pickled;
+        uint32_t first_known_index = 0;
+        GroupSessionData data;
+};
+
+ImportedSession
+importSession(const mtx::crypto::ExportedSession &s)
+{
+        ImportedSession imported;
+        imported.index.room_id    = s.room_id;
+        imported.index.session_id = s.session_id;
+        imported.index.sender_key = s.sender_key;
+
+        imported.data.forwarding_curve25519_key_chain = s.forwarding_curve25519_key_chain;
+        if (s.sender_claimed_keys.count("ed25519"))
+                imported.data.sender_claimed_ed25519_key = s.sender_claimed_keys.at("ed25519");
+
+        try {
+                auto session = mtx::crypto::import_session(s.session_key);
+                imported.first_known_index =
+                  olm_inbound_group_session_first_known_index(session.get());
+                imported.pickled =
+                  mtx::crypto::pickle<mtx::crypto::InboundSessionObject>(session.get(), SECRET);
+        } catch (const mtx::crypto::olm_exception &e) {
+                nhlog::crypto()->warn(
+                  "failed to import megolm session {}: {}", s.session_id, e.what());
+        }
+
+        return imported;
+}
+}
+
 void
-Cache::importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys)
+Cache::importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys,
+                         const std::function<void(std::size_t, std::size_t)> &progress)
 {
-        for (const auto &s : keys.sessions) {
-                MegolmSessionIndex index;
-                index.room_id    = s.room_id;
-                index.session_id = s.session_id;
-                index.sender_key = s.sender_key;
+        using namespace mtx::crypto;
+
+        const auto &sessions = keys.sessions;
+
+        // room_id -> imported session_ids
+        std::map<std::string, std::vector<std::string>> imported;
+        std::size_t storedCount = 0;
+
+        for (std::size_t start = 0; start < sessions.size(); start += SESSION_KEYS_BATCH_SIZE) {
+                const auto end = std::min(start + SESSION_KEYS_BATCH_SIZE, sessions.size());
+
+                // Importing and pickling the sessions is the expensive part, so do that in
+                // parallel and only write them sequentially.
+                auto batch = QtConcurrent::blockingMapped<std::vector<ImportedSession>>(
+                  sessions.begin() + start, sessions.begin() + end, importSession);
 
-                GroupSessionData data{};
-                data.forwarding_curve25519_key_chain = s.forwarding_curve25519_key_chain;
-                if (s.sender_claimed_keys.count("ed25519"))
-                        data.sender_claimed_ed25519_key = s.sender_claimed_keys.at("ed25519");
+                auto txn = lmdb::txn::begin(env_);
+                for (const auto &session : batch) {
+                        if (session.pickled.empty())
+                                continue;
+
+                        const auto key = json(session.index).dump();
+
+                        std::string_view value;
+                        if (inboundMegolmSessionDb_.get(txn, key, value)) {
+                                auto oldSession =
+                                  unpickle<InboundSessionObject>(std::string(value), SECRET);
+                                if (session.first_known_index >
+                                    olm_inbound_group_session_first_known_index(
+                                      oldSession.get())) {
+                                        nhlog::crypto()->warn(
+                                          "Not storing inbound session with newer first known "
+                                          "index");
+                                        continue;
+                                }
+                        }
 
-                auto exported_session = mtx::crypto::import_session(s.session_key);
+                        inboundMegolmSessionDb_.put(txn, key, session.pickled);
+                        megolmSessionDataDb_.put(txn, key, json(session.data).dump());
 
-                saveInboundMegolmSession(index, std::move(exported_session), data);
-                ChatPage::instance()->receivedSessionKey(index.room_id, index.session_id);
+                        imported[session.index.room_id].push_back(session.index.session_id);
+                        storedCount++;
+                }
+                txn.commit();
+
+                if (progress)
+                        progress(end, sessions.size());
         }
+
+        nhlog::crypto()->info("imported {} of {} megolm sessions for {} rooms",
+                              storedCount,
+                              sessions.size(),
+                              imported.size());
+
+        // Notify every room only once. We may be called from a worker thread, while the rooms
+        // live on the main thread.
+        QMetaObject::invokeMethod(
+          ChatPage::instance(),
+          [imported = std::move(imported)]() {
+                  for (const auto &[room_id, session_ids] : imported)
+                          ChatPage::instance()->receivedSessionKeys(room_id, session_ids);
+          },
+          Qt::QueuedConnection);
 }
 
 //
@@ -605,6 +791,15 @@ Cache::getMegolmSessionData(const MegolmSessionIndex &index)
 // OLM sessions.
 //
 
+namespace {
+QString
+hotOlmSessionKey(const std::string &curve25519, std::string_view session_id)
+{
+        return QString::fromStdString(curve25519) + "|" +
+               QString::fromUtf8(session_id.data(), static_cast<int>(session_id.size()));
+}
+}
+
 void
 Cache::saveOlmSession(const std::string &curve25519,
                       mtx::crypto::OlmSessionPtr session,
@@ -624,7 +819,17 @@ Cache::saveOlmSession(const std::string &curve25519,
 
         db.put(txn, session_id, json(stored_session).dump());
 
+        std::string_view latest_id, latest;
+        if (!olmLatestSessionsDb_.get(txn, curve25519, latest_id) || latest_id == session_id ||
+            !db.get(txn, latest_id, latest) ||
+            json::parse(latest).get<StoredOlmSession>().last_message_ts <= timestamp)
+                olmLatestSessionsDb_.put(txn, curve25519, session_id);
+
+        // Commit under the lock, so that the cached session always matches the stored one.
+        std::lock_guard<std::mutex> lock(hotOlmSessionsMtx_);
         txn.commit();
+        hotOlmSessions_.insert(hotOlmSessionKey(curve25519, session_id),
+                               new OlmSessionPtr(std::move(session)));
 }
 
 std::optional<mtx::crypto::OlmSessionPtr>
@@ -632,17 +837,25 @@ Cache::getOlmSession(const std::string &curve25519, const std::string &session_i
 {
         using namespace mtx::crypto;
 
-        auto txn = lmdb::txn::begin(env_);
-        auto db  = getOlmSessionsDb(txn, curve25519);
-
-        std::string_view pickled;
-        bool found = db.get(txn, session_id, pickled);
+        {
+                std::lock_guard<std::mutex> lock(hotOlmSessionsMtx_);
+                std::unique_ptr<OlmSessionPtr> hot(
+                  hotOlmSessions_.take(hotOlmSessionKey(curve25519, session_id)));
+                if (hot)
+                        return std::move(*hot);
+        }
 
-        txn.commit();
+        try {
+                auto txn = ro_txn(env_);
+                auto db  = getOlmSessionsDb(txn, curve25519);
 
-        if (found) {
-                auto data = json::parse(pickled).get<StoredOlmSession>();
-                return unpickle<SessionObject>(data.pickled_session, SECRET);
+                std::string_view pickled;
+                if (db.get(txn, session_id, pickled)) {
+                        auto data = json::parse(pickled).get<StoredOlmSession>();
+                        return unpickle<SessionObject>(data.pickled_session, SECRET);
+                }
+        } catch (const lmdb::error &) {
+                // we never stored a session for this key, so the db doesn't exist yet
         }
 
         return std::nullopt;
@@ -651,49 +864,747 @@ Cache::getOlmSession(const std::string &curve25519, const std::string &session_i
 std::optional<mtx::crypto::OlmSessionPtr>
 Cache::getLatestOlmSession(const std::string &curve25519)
 {
-        using namespace mtx::crypto;
+        std::string session_id;
+        {
+                auto txn = ro_txn(env_);
 
-        auto txn = lmdb::txn::begin(env_);
-        auto db  = getOlmSessionsDb(txn, curve25519);
+                std::string_view latest_id;
+                if (olmLatestSessionsDb_.get(txn, curve25519, latest_id))
+                        session_id = std::string(latest_id);
+        }
 
-        std::string_view session_id, pickled_session;
+        if (session_id.empty())
+                session_id = indexLatestOlmSession(curve25519);
+        if (session_id.empty())
+                return std::nullopt;
 
-        std::optional<StoredOlmSession> currentNewest;
+        return getOlmSession(curve25519, session_id);
+}
 
-        auto cursor = lmdb::cursor::open(txn, db);
-        while (cursor.get(session_id, pickled_session, MDB_NEXT)) {
-                auto data = json::parse(pickled_session).get<StoredOlmSession>();
-                if (!currentNewest || currentNewest->last_message_ts < data.last_message_ts)
-                        currentNewest = data;
+std::string
+Cache::indexLatestOlmSession(const std::string &curve25519)
+{
+        std::string newestId;
+        std::optional<uint64_t> newestTs;
+
+        try {
+                auto txn = ro_txn(env_);
+                auto db  = getOlmSessionsDb(txn, curve25519);
+
+                std::string_view session_id, pickled_session;
+
+                auto cursor = lmdb::cursor::open(txn, db);
+                while (cursor.get(session_id, pickled_session, MDB_NEXT)) {
+                        try {
+                                auto data = json::parse(pickled_session).get<StoredOlmSession>();
+                                if (!newestTs || *newestTs < data.last_message_ts) {
+                                        newestTs = data.last_message_ts;
+                                        newestId = std::string(session_id);
+                                }
+                        } catch (const json::exception &e) {
+                                nhlog::db()->warn("failed to parse olm session {}: {}",
+                                                  session_id,
+                                                  e.what());
+                        }
+                }
+                cursor.close();
+        } catch (const lmdb::error &) {
+                // we never stored a session for this key, so the db doesn't exist yet
         }
-        cursor.close();
 
+        // Only take the write lock, if there is something to remember.
+        if (newestId.empty())
+                return newestId;
+
+        // A session saved in the meantime has already updated the index.
+        auto txn = lmdb::txn::begin(env_);
+        std::string_view latest_id;
+        if (!olmLatestSessionsDb_.put(txn, curve25519, newestId, MDB_NOOVERWRITE) &&
+            olmLatestSessionsDb_.get(txn, curve25519, latest_id))
+                newestId = std::string(latest_id);
         txn.commit();
 
-        return currentNewest
-                 ? std::optional(unpickle<SessionObject>(currentNewest->pickled_session, SECRET))
-                 : std::nullopt;
+        return newestId;
 }
 
 std::vector<std::string>
 Cache::getOlmSessions(const std::string &curve25519)
 {
-        using namespace mtx::crypto;
+        std::vector<std::pair<uint64_t, std::string>> sessions;
+
+        try {
+                auto txn = ro_txn(env_);
+                auto db  = getOlmSessionsDb(txn, curve25519);
+
+                std::string_view session_id, pickled_session;
+
+                auto cursor = lmdb::cursor::open(txn, db);
+                while (cursor.get(session_id, pickled_session, MDB_NEXT))
+                        sessions.emplace_back(
+                          json::parse(pickled_session).get<StoredOlmSession>().last_message_ts,
+                          session_id);
+                cursor.close();
+        } catch (const lmdb::error &) {
+                // we never stored a session for this key, so the db doesn't exist yet
+        }
+
+        // The sender most likely used the session it last used again.
+        std::sort(sessions.begin(), sessions.end(), std::greater<>());
+
+        std::vector<std::string> res;
+        res.reserve(sessions.size());
+        for (auto &session : sessions)
+                res.push_back(std::move(session.second));
+        return res;
+}
+
+//
+// Outgoing key requests
+//
+
+std::optional<OutgoingKeyRequest>
+Cache::outgoingKeyRequest(const std::string &session_id)
+{
+        try {
+                auto txn = ro_txn(env_);
+                std::string_view value;
+                if (outgoingKeyRequestsDb_.get(txn, session_id, value))
+                        return json::parse(value).get<OutgoingKeyRequest>();
+        } catch (std::exception &e) {
+                nhlog::db()->warn(
+                  "failed to retrieve key request for {}: {}", session_id, e.what());
+        }
+
+        return std::nullopt;
+}
+
+void
+Cache::storeOutgoingKeyRequest(const OutgoingKeyRequest &request)
+{
+        auto txn = lmdb::txn::begin(env_);
+        outgoingKeyRequestsDb_.put(txn, request.session_id, json(request).dump());
+        txn.commit();
+}
+
+void
+Cache::removeOutgoingKeyRequest(const std::string &session_id)
+{
+        auto txn = lmdb::txn::begin(env_);
+        outgoingKeyRequestsDb_.del(txn, session_id);
+        txn.commit();
+}
+
+void
+Cache::deleteOldKeyRequests()
+{
+        const uint64_t now = QDateTime::currentMSecsSinceEpoch();
+
+        auto txn = lmdb::txn::begin(env_);
+
+        std::string_view session_id, value;
+        auto cursor = lmdb::cursor::open(txn, outgoingKeyRequestsDb_);
+        while (cursor.get(session_id, value, MDB_NEXT)) {
+                auto request = json::parse(value).get<OutgoingKeyRequest>();
+                if (request.last_request_ts + MAX_KEY_REQUEST_AGE_MS < now)
+                        cursor.del();
+        }
+        cursor.close();
+
+        txn.commit();
+}
+
+//
+// Encrypted media
+//
+
+namespace {
+std::string
+storedMediaEncryptionInfo(const mtx::crypto::EncryptedFile &info, uint64_t lastUsed)
+{
+        json j;
+        j["file"]      = info;
+        j["last_used"] = lastUsed;
+        return j.dump();
+}
+
+//! When the media was last looked up. Entries without one are the oldest.
+uint64_t
+mediaEncryptionInfoLastUsed(const json &j)
+{
+        return j.is_object() ? j.value("last_used", uint64_t{0}) : 0;
+}
+}
+
+void
+Cache::saveMediaEncryptionInfo(const mtx::crypto::EncryptedFile &info)
+{
+        // Infos are offered again every time they drop out of the in memory cache, but they never
+        // change for the same url, so don't open a write transaction for those.
+        {
+                auto txn = ro_txn(env_);
+                std::string_view unused;
+                if (mediaEncryptionInfoDb_.get(txn, info.url, unused))
+                        return;
+        }
+
+        auto txn = lmdb::txn::begin(env_);
+        mediaEncryptionInfoDb_.put(
+          txn, info.url, storedMediaEncryptionInfo(info, QDateTime::currentMSecsSinceEpoch()));
+        txn.commit();
+}
+
+std::optional<mtx::crypto::EncryptedFile>
+Cache::mediaEncryptionInfo(const std::string &mxc_url)
+{
+        try {
+                std::optional<mtx::crypto::EncryptedFile> info;
+                uint64_t lastUsed = 0;
+                {
+                        auto txn = ro_txn(env_);
+                        std::string_view value;
+                        if (!mediaEncryptionInfoDb_.get(txn, mxc_url, value))
+                                return std::nullopt;
+
+                        auto j = json::parse(value);
+                        // older entries stored only the file
+                        info = j.contains("file") ? j.at("file").get<mtx::crypto::EncryptedFile>()
+                                                  : j.get<mtx::crypto::EncryptedFile>();
+                        lastUsed = mediaEncryptionInfoLastUsed(j);
+                }
+
+                // Remember when the media was last shown, so that trimming keeps what is still in
+                // use. Only update that once a day, so that reads don't turn into writes.
+                uint64_t now = QDateTime::currentMSecsSinceEpoch();
+                if (now - lastUsed > MEDIA_ENCRYPTION_INFO_TOUCH_INTERVAL_MS) {
+                        auto txn = lmdb::txn::begin(env_);
+                        mediaEncryptionInfoDb_.put(
+                          txn, mxc_url, storedMediaEncryptionInfo(*info, now));
+                        txn.commit();
+                }
+
+                return info;
+        } catch (std::exception &e) {
+                nhlog::db()->warn(
+                  "failed to retrieve encryption info for {}: {}", mxc_url, e.what());
+        }
+
+        return std::nullopt;
+}
+
+void
+Cache::deleteOldMediaEncryptionInfo()
+{
+        auto txn     = lmdb::txn::begin(env_);
+        auto entries = mediaEncryptionInfoDb_.size(txn);
+
+        if (entries > MAX_MEDIA_ENCRYPTION_INFOS) {
+                std::vector<std::pair<uint64_t, std::string>> byLastUse;
+                byLastUse.reserve(entries);
+
+                std::string_view url, value;
+                auto cursor = lmdb::cursor::open(txn, mediaEncryptionInfoDb_);
+                while (cursor.get(url, value, MDB_NEXT)) {
+                        uint64_t lastUsed = 0;
+                        try {
+                                lastUsed = mediaEncryptionInfoLastUsed(json::parse(value));
+                        } catch (const json::exception &) {
+                        }
+                        byLastUse.emplace_back(lastUsed, url);
+                }
+                cursor.close();
+
+                // Drop the infos of the media that wasn't shown for the longest time.
+                auto excess = byLastUse.begin() + (entries - MAX_MEDIA_ENCRYPTION_INFOS);
+                std::nth_element(byLastUse.begin(), excess, byLastUse.end());
+                for (auto it = byLastUse.begin(); it != excess; ++it)
+                        mediaEncryptionInfoDb_.del(txn, it->second);
+        }
+
+        txn.commit();
+}
+
+//
+// Message search
+//
+
+namespace {
+//! The words of a message, case folded.
+std::vector<QString>
+searchTerms(const QString &text)
+{
+        std::vector<QString> terms;
+        QString term;
+        for (const auto c : text.toCaseFolded()) {
+                if (c.isLetterOrNumber()) {
+                        term.append(c);
+                } else if (!term.isEmpty()) {
+                        terms.push_back(term);
+                        term.clear();
+                }
+        }
+        if (!term.isEmpty())
+                terms.push_back(term);
+
+        return terms;
+}
+
+//! Keyed hash of a term, so that the index doesn't contain the words of the messages.
+std::string
+searchTermHash(const QByteArray &key, const QString &term)
+{
+        return QMessageAuthenticationCode::hash(term.toUtf8(), key, QCryptographicHash::Sha256)
+          .left(SEARCH_TERM_HASH_SIZE)
+          .toStdString();
+}
+
+//! The hash the messages containing a term or a term starting with it are indexed under.
+std::string
+searchPostingHash(const QByteArray &key, const QString &term)
+{
+        return searchTermHash(key, term.left(MAX_SEARCH_PREFIX));
+}
+
+std::string
+searchEntryKey(const std::string &room_id, std::string_view event_id)
+{
+        return room_id + " " + std::string(event_id);
+}
+
+//! The value of a message in the posting lists. The inverted big endian timestamp sorts newer
+//! messages first, so that a search can stop once it has enough results.
+std::string
+searchPosting(uint64_t timestamp, std::string_view entryKey)
+{
+        auto sortKey = std::numeric_limits<uint64_t>::max() - timestamp;
+
+        std::string posting(sizeof(sortKey), '\0');
+        for (int i = static_cast<int>(sizeof(sortKey)) - 1; i >= 0; i--) {
+                posting[i] = static_cast<char>(sortKey & 0xff);
+                sortKey >>= 8;
+        }
+        posting.append(entryKey);
+        return posting;
+}
+
+uint64_t
+searchPostingTimestamp(std::string_view posting)
+{
+        uint64_t sortKey = 0;
+        for (std::size_t i = 0; i < sizeof(sortKey); i++)
+                sortKey = (sortKey << 8) | static_cast<unsigned char>(posting[i]);
+        return std::numeric_limits<uint64_t>::max() - sortKey;
+}
+
+//! An indexed message: its timestamp, the hashes of its terms in order and the posting hashes
+//! it was indexed under.
+struct SearchEntry
+{
+        uint64_t timestamp = 0;
+        std::vector<std::string> terms;
+        std::vector<std::string> postings;
+};
+
+std::string
+serializeSearchEntry(const SearchEntry &entry)
+{
+        auto termCount = static_cast<uint32_t>(entry.terms.size());
+
+        std::string data;
+        data.append(reinterpret_cast<const char *>(&entry.timestamp), sizeof(entry.timestamp));
+        data.append(reinterpret_cast<const char *>(&termCount), sizeof(termCount));
+        for (const auto &term : entry.terms)
+                data.append(term);
+        for (const auto &posting : entry.postings)
+                data.append(posting);
+        return data;
+}
+
+std::optional<SearchEntry>
+parseSearchEntry(std::string_view data)
+{
+        SearchEntry entry;
+        uint32_t termCount = 0;
+        if (data.size() < sizeof(entry.timestamp) + sizeof(termCount))
+                return std::nullopt;
+
+        std::memcpy(&entry.timestamp, data.data(), sizeof(entry.timestamp));
+        data.remove_prefix(sizeof(entry.timestamp));
+        std::memcpy(&termCount, data.data(), sizeof(termCount));
+        data.remove_prefix(sizeof(termCount));
+
+        if (data.size() % SEARCH_TERM_HASH_SIZE != 0 ||
+            data.size() / SEARCH_TERM_HASH_SIZE < termCount)
+                return std::nullopt;
+
+        for (std::size_t i = 0; !data.empty(); i++) {
+                auto hash = std::string(data.substr(0, SEARCH_TERM_HASH_SIZE));
+                (i < termCount ? entry.terms : entry.postings).push_back(std::move(hash));
+                data.remove_prefix(SEARCH_TERM_HASH_SIZE);
+        }
+        return entry;
+}
+
+//! The entries are encrypted, since the order of the term hashes in a message would allow to
+//! guess the terms by their frequency.
+std::string
+encryptSearchEntry(const mtx::crypto::BinaryBuf &key, const SearchEntry &entry)
+{
+        auto iv         = mtx::crypto::create_buffer(SEARCH_ENTRY_IV_SIZE);
+        auto ciphertext = mtx::crypto::AES_CTR_256_Encrypt(serializeSearchEntry(entry), key, iv);
+
+        std::string data(iv.begin(), iv.end());
+        data.append(ciphertext.begin(), ciphertext.end());
+        return data;
+}
+
+std::optional<SearchEntry>
+decryptSearchEntry(const mtx::crypto::BinaryBuf &key, std::string_view data)
+{
+        if (data.size() < SEARCH_ENTRY_IV_SIZE)
+                return std::nullopt;
+
+        try {
+                mtx::crypto::BinaryBuf iv(data.begin(), data.begin() + SEARCH_ENTRY_IV_SIZE);
+                auto plaintext = mtx::crypto::AES_CTR_256_Decrypt(
+                  std::string(data.substr(SEARCH_ENTRY_IV_SIZE)), key, iv);
+                return parseSearchEntry(std::string_view(
+                  reinterpret_cast<const char *>(plaintext.data()), plaintext.size()));
+        } catch (const std::exception &e) {
+                nhlog::db()->warn("failed to decrypt search index entry: {}", e.what());
+                return std::nullopt;
+        }
+}
+}
+
+void
+Cache::loadSearchIndexKey()
+{
+        QByteArray key;
+        if (auto stored = secret(SEARCH_INDEX_KEY_SECRET)) {
+                auto decoded = QByteArray::fromBase64(QByteArray::fromStdString(*stored));
+                if (static_cast<std::size_t>(decoded.size()) == SEARCH_INDEX_KEY_SIZE)
+                        key = decoded;
+        }
+
+        if (key.isEmpty()) {
+                nhlog::db()->info("generating new search index key");
+
+                auto buffer  = mtx::crypto::create_buffer(SEARCH_INDEX_KEY_SIZE);
+                auto encoded = QByteArray(reinterpret_cast<const char *>(buffer.data()),
+                                          (int)buffer.size())
+                                 .toBase64();
+                storeSecret(SEARCH_INDEX_KEY_SECRET, encoded.toStdString());
+
+                // Messages indexed with a key that is lost on restart could never be found again.
+                if (!secret(SEARCH_INDEX_KEY_SECRET)) {
+                        nhlog::db()->warn(
+                          "search index key could not be stored, not indexing messages for search");
+                        return;
+                }
+                key = QByteArray::fromBase64(encoded);
+        }
+
+        // Don't use the hash key directly for the encryption.
+        auto entriesKey = QMessageAuthenticationCode::hash(
+          "nheko search index entries", key, QCryptographicHash::Sha256);
+
+        auto keys     = std::make_shared<SearchIndexKeys>();
+        keys->terms   = key;
+        keys->entries = mtx::crypto::BinaryBuf(entriesKey.begin(), entriesKey.end());
+        std::atomic_store(&searchIndexKeys_, std::shared_ptr<const SearchIndexKeys>(keys));
+}
+
+void
+Cache::setMessageSearchIndexEnabled(bool enabled)
+{
+        if (enabled) {
+                if (!std::atomic_load(&searchIndexKeys_))
+                        loadSearchIndexKey();
+                return;
+        }
+
+        // The key is kept, so that messages indexed concurrently stay consistent with it.
+        std::atomic_store(&searchIndexKeys_, std::shared_ptr<const SearchIndexKeys>());
+        {
+                std::lock_guard<std::mutex> lock(searchIndexQueueMtx_);
+                searchIndexQueue_.clear();
+        }
+
+        try {
+                auto txn = lmdb::txn::begin(env_);
+                lmdb::dbi_drop(txn, messageSearchDb_, false);
+                lmdb::dbi_drop(txn, messageSearchEventsDb_, false);
+                txn.commit();
+        } catch (const lmdb::error &e) {
+                nhlog::db()->warn("failed to clear the message search index: {}", e.what());
+        }
+}
+
+void
+Cache::indexMessage(lmdb::txn &txn,
+                    const std::string &room_id,
+                    const mtx::events::collections::TimelineEvents &event)
+{
+        auto keys = std::atomic_load(&searchIndexKeys_);
+        if (!keys)
+                return;
+
+        // Pending local echoes use their transaction id, they are indexed once the server sends
+        // them back.
+        const auto event_id = mtx::accessors::event_id(event);
+        if (event_id.empty() || event_id.front() != '$')
+                return;
+
+        auto body = mtx::accessors::body(event);
+        if (body.empty())
+                return;
+
+        auto key = searchEntryKey(room_id, event_id);
+        std::string_view existing;
+        if (messageSearchEventsDb_.get(txn, key, existing))
+                return;
+
+        SearchEntry entry;
+        entry.timestamp = mtx::accessors::origin_server_ts(event).toMSecsSinceEpoch();
+
+        std::set<QString> prefixes;
+        auto text = QString::fromStdString(utils::stripReplyFromBody(body));
+        for (const auto &term : searchTerms(text)) {
+                entry.terms.push_back(searchTermHash(keys->terms, term));
+                for (int len = MIN_SEARCH_PREFIX; len <= std::min(term.size(), MAX_SEARCH_PREFIX);
+                     len++)
+                        prefixes.insert(term.left(len));
+        }
+
+        const auto posting = searchPosting(entry.timestamp, key);
+        for (const auto &prefix : prefixes) {
+                entry.postings.push_back(searchTermHash(keys->terms, prefix));
+                messageSearchDb_.put(txn, entry.postings.back(), posting);
+        }
+
+        messageSearchEventsDb_.put(txn, key, encryptSearchEntry(keys->entries, entry));
+}
+
+void
+Cache::removeFromSearchIndex(lmdb::txn &txn,
+                             const std::string &room_id,
+                             const std::string &event_id)
+{
+        auto key = searchEntryKey(room_id, event_id);
+
+        std::string_view data;
+        if (!messageSearchEventsDb_.get(txn, key, data))
+                return;
+
+        // Without a key the index was cleared already.
+        if (auto keys = std::atomic_load(&searchIndexKeys_)) {
+                if (auto entry = decryptSearchEntry(keys->entries, data)) {
+                        const auto posting = searchPosting(entry->timestamp, key);
+                        for (const auto &hash : entry->postings)
+                                messageSearchDb_.del(txn, hash, posting);
+                }
+        }
+        messageSearchEventsDb_.del(txn, key);
+}
+
+void
+Cache::removeRoomFromSearchIndex(lmdb::txn &txn, const std::string &room_id)
+{
+        const auto prefix = room_id + " ";
+
+        std::vector<std::string> event_ids;
+        {
+                std::string_view key = prefix, unused;
+                auto cursor          = lmdb::cursor::open(txn, messageSearchEventsDb_);
+                bool found           = cursor.get(key, unused, MDB_SET_RANGE);
+                while (found && key.substr(0, prefix.size()) == prefix) {
+                        event_ids.emplace_back(key.substr(prefix.size()));
+                        found = cursor.get(key, unused, MDB_NEXT);
+                }
+        }
+
+        for (const auto &event_id : event_ids)
+                removeFromSearchIndex(txn, room_id, event_id);
+}
+
+void
+Cache::indexDecryptedMessage(const std::string &room_id,
+                             const mtx::events::collections::TimelineEvents &event)
+{
+        if (!std::atomic_load(&searchIndexKeys_) || mtx::accessors::body(event).empty())
+                return;
+
+        std::lock_guard<std::mutex> lock(searchIndexQueueMtx_);
+
+        // Decrypting a timeline decrypts many messages at once, write them in one transaction.
+        if (searchIndexQueue_.empty())
+                QTimer::singleShot(SEARCH_INDEX_FLUSH_DELAY_MS, this, [this]() {
+                        flushSearchIndexQueue();
+                });
+
+        searchIndexQueue_.emplace_back(room_id, event);
+}
+
+void
+Cache::flushSearchIndexQueue()
+{
+        std::vector<std::pair<std::string, mtx::events::collections::TimelineEvents>> queue;
+        {
+                std::lock_guard<std::mutex> lock(searchIndexQueueMtx_);
+                std::swap(queue, searchIndexQueue_);
+        }
+
+        if (queue.empty() || !env_.handle())
+                return;
+
+        try {
+                auto txn = lmdb::txn::begin(env_);
+                for (const auto &[room_id, event] : queue)
+                        indexMessage(txn, room_id, event);
+                txn.commit();
+        } catch (const lmdb::error &e) {
+                nhlog::db()->warn("failed to index decrypted messages: {}", e.what());
+        }
+}
+
+std::vector<MessageSearchResult>
+Cache::searchMessages(const std::string &query, const std::string &room_id, std::size_t limit)
+{
+        auto keys = std::atomic_load(&searchIndexKeys_);
+        if (!keys || !limit)
+                return {};
+
+        // A clause is a single term, a term prefix (ending in '*') or a phrase (quoted).
+        struct Clause
+        {
+                std::vector<std::string> terms;
+                std::string posting;
+                bool isPrefix = false;
+        };
+        std::vector<Clause> clauses;
+
+        auto addClause = [&keys, &clauses](const QString &text, bool isPrefix) {
+                auto terms = searchTerms(text);
+                if (terms.empty())
+                        return;
+
+                Clause clause;
+                clause.isPrefix = isPrefix && terms.size() == 1;
+
+                // the longest term of a phrase is the most selective one
+                const auto &longest = *std::max_element(
+                  terms.begin(), terms.end(), [](const QString &a, const QString &b) {
+                          return a.size() < b.size();
+                  });
+                if (longest.size() >= MIN_SEARCH_PREFIX)
+                        clause.posting = searchPostingHash(keys->terms, longest);
+                else if (clause.isPrefix)
+                        return; // matches nearly everything, nothing to check
+
+                if (!clause.isPrefix) {
+                        for (const auto &term : terms)
+                                clause.terms.push_back(searchTermHash(keys->terms, term));
+                }
+                clauses.push_back(std::move(clause));
+        };
+
+        const auto parts = QString::fromStdString(query).split('"');
+        for (int i = 0; i < parts.size(); i++) {
+                // every other part is inside quotes
+                if (i % 2 == 1) {
+                        addClause(parts[i], false);
+                } else {
+                        for (const auto &word : parts[i].split(' '))
+                                addClause(word, word.endsWith('*'));
+                }
+        }
+
+        auto txn = ro_txn(env_);
+
+        // Walk the shortest list of candidates and check the other clauses for each of them.
+        const Clause *candidates   = nullptr;
+        std::size_t candidateCount = std::numeric_limits<std::size_t>::max();
+        for (const auto &clause : clauses) {
+                if (clause.posting.empty())
+                        continue;
+
+                std::string_view key = clause.posting, unused;
+                auto cursor          = lmdb::cursor::open(txn, messageSearchDb_);
+                size_t count         = 0;
+                if (cursor.get(key, unused, MDB_SET))
+                        mdb_cursor_count(cursor.handle(), &count);
+
+                if (count < candidateCount) {
+                        candidates     = &clause;
+                        candidateCount = count;
+                }
+        }
+
+        if (!candidates || !candidateCount)
+                return {};
+
+        auto checkCursor = lmdb::cursor::open(txn, messageSearchDb_);
+
+        auto matches = [this, &txn, &keys, &clauses, &checkCursor, candidates](
+                         std::string_view posting, std::string_view entryKey) {
+                // The posting lists are cheaper to check than the terms of the entry.
+                for (const auto &clause : clauses) {
+                        if (&clause == candidates || clause.posting.empty())
+                                continue;
+
+                        std::string_view key = clause.posting, value = posting;
+                        if (!checkCursor.get(key, value, MDB_GET_BOTH))
+                                return false;
+                }
+
+                std::optional<SearchEntry> entry;
+                for (const auto &clause : clauses) {
+                        if (clause.isPrefix)
+                                continue;
+
+                        if (!entry) {
+                                std::string_view data;
+                                if (!messageSearchEventsDb_.get(txn, entryKey, data))
+                                        return false;
+                                entry = decryptSearchEntry(keys->entries, data);
+                                if (!entry)
+                                        return false;
+                        }
+
+                        if (std::search(entry->terms.begin(),
+                                        entry->terms.end(),
+                                        clause.terms.begin(),
+                                        clause.terms.end()) == entry->terms.end())
+                                return false;
+                }
+                return true;
+        };
 
-        auto txn = lmdb::txn::begin(env_);
-        auto db  = getOlmSessionsDb(txn, curve25519);
+        std::vector<MessageSearchResult> results;
 
-        std::string_view session_id, unused;
-        std::vector<std::string> res;
+        // The candidates are sorted newest first, so stop once there are enough results.
+        const auto roomPrefix = room_id.empty() ? std::string() : room_id + " ";
+        std::string_view key  = candidates->posting, posting;
+        auto cursor           = lmdb::cursor::open(txn, messageSearchDb_);
+        for (bool found = cursor.get(key, posting, MDB_SET); found && results.size() < limit;
+             found = cursor.get(key, posting, MDB_NEXT_DUP)) {
+                if (posting.size() <= sizeof(uint64_t))
+                        continue;
 
-        auto cursor = lmdb::cursor::open(txn, db);
-        while (cursor.get(session_id, unused, MDB_NEXT))
-                res.emplace_back(session_id);
-        cursor.close();
+                auto entryKey = posting.substr(sizeof(uint64_t));
+                if (entryKey.substr(0, roomPrefix.size()) != roomPrefix ||
+                    !matches(posting, entryKey))
+                        continue;
 
-        txn.commit();
+                auto separator = entryKey.find(' ');
+                results.push_back(MessageSearchResult{
+                  std::string(entryKey.substr(0, separator)),
+                  std::string(entryKey.substr(separator + 1)),
+                  searchPostingTimestamp(posting),
+                });
+        }
 
-        return res;
+        return results;
 }
 
 void
@@ -811,6 +1722,8 @@ Cache::removeRoom(lmdb::txn &txn, const std::string &roomid)
         getStatesDb(txn, roomid).drop(txn, true);
         getAccountDataDb(txn, roomid).drop(txn, true);
         getMembersDb(txn, roomid).drop(txn, true);
+        roomDirectoryDb_.del(txn, roomid);
+        removeRoomFromSearchIndex(txn, roomid);
 }
 
 void
@@ -818,6 +1731,7 @@ Cache::removeRoom(const std::string &roomid)
 {
         auto txn = lmdb::txn::begin(env_, nullptr, 0);
         roomsDb_.del(txn, roomid);
+        roomDirectoryDb_.del(txn, roomid);
         txn.commit();
 }
 
@@ -865,9 +1779,12 @@ void
 Cache::deleteData()
 {
         this->databaseReady_ = false;
+        // Recomputes that already started still read from the db.
+        verificationPool_.waitForDone();
         // TODO: We need to remove the env_ while not accepting new requests.
         lmdb::dbi_close(env_, syncStateDb_);
         lmdb::dbi_close(env_, roomsDb_);
+        lmdb::dbi_close(env_, roomDirectoryDb_);
         lmdb::dbi_close(env_, invitesDb_);
         lmdb::dbi_close(env_, readReceiptsDb_);
         lmdb::dbi_close(env_, notificationsDb_);
@@ -878,10 +1795,34 @@ Cache::deleteData()
         lmdb::dbi_close(env_, inboundMegolmSessionDb_);
         lmdb::dbi_close(env_, outboundMegolmSessionDb_);
         lmdb::dbi_close(env_, megolmSessionDataDb_);
+        lmdb::dbi_close(env_, olmLatestSessionsDb_);
+        lmdb::dbi_close(env_, outgoingKeyRequestsDb_);
+
+        lmdb::dbi_close(env_, mediaEncryptionInfoDb_);
+
+        lmdb::dbi_close(env_, messageSearchDb_);
+        lmdb::dbi_close(env_, messageSearchEventsDb_);
+
+        {
+                std::lock_guard<std::mutex> lock(searchIndexQueueMtx_);
+                searchIndexQueue_.clear();
+        }
 
         env_.close();
 
         verification_storage.status.clear();
+        verification_storage.signatures.clear();
+
+        {
+                std::lock_guard<std::mutex> lock(hotOlmSessionsMtx_);
+                hotOlmSessions_.clear();
+        }
+
+        {
+                std::lock_guard<std::mutex> lock(memberDevicesMtx_);
+                memberDevices_.clear();
+                ++memberDevicesGeneration_;
+        }
 
         if (!cacheDirectory_.isEmpty()) {
                 QDir(cacheDirectory_).removeRecursively();
@@ -892,6 +1833,10 @@ Cache::deleteData()
         deleteSecret(mtx::secret_storage::secrets::cross_signing_master);
         deleteSecret(mtx::secret_storage::secrets::cross_signing_user_signing);
         deleteSecret(mtx::secret_storage::secrets::cross_signing_self_signing);
+        deleteSecret(MEDIA_CACHE_KEY_SECRET);
+        std::atomic_store(&mediaCacheKey_, std::shared_ptr<const mtx::crypto::BinaryBuf>());
+        deleteSecret(SEARCH_INDEX_KEY_SECRET);
+        std::atomic_store(&searchIndexKeys_, std::shared_ptr<const SearchIndexKeys>());
 }
 
 //! migrates db to the current format
@@ -1070,6 +2015,38 @@ Cache::runMigrations()
                    nhlog::db()->info("Successfully migrated olm sessions.");
                    return true;
            }},
+          {"2021.10.18",
+           [this]() {
+                   try {
+                           auto txn = lmdb::txn::begin(env_);
+
+                           std::string_view room_id, data;
+                           auto roomsCursor = lmdb::cursor::open(txn, roomsDb_);
+                           while (roomsCursor.get(room_id, data, MDB_NEXT)) {
+                                   try {
+                                           RoomInfo info = json::parse(data);
+                                           auto statesdb =
+                                             getStatesDb(txn, std::string(room_id));
+                                           updateRoomDirectory(
+                                             txn, statesdb, std::string(room_id), info, true);
+                                   } catch (const json::exception &e) {
+                                           nhlog::db()->warn(
+                                             "failed to parse room info: room_id ({}), {}",
+                                             room_id,
+                                             e.what());
+                                   }
+                           }
+                           roomsCursor.close();
+
+                           txn.commit();
+                   } catch (const lmdb::error &) {
+                           nhlog::db()->critical("Failed to build the room directory!");
+                           return false;
+                   }
+
+                   nhlog::db()->info("Successfully built the room directory.");
+                   return true;
+           }},
         };
 
         nhlog::db()->info("Running migrations, this may take a while!");
@@ -1391,6 +2368,15 @@ Cache::saveState(const mtx::responses::Sync &res)
 
                 roomsDb_.put(txn, room.first, json(updatedInfo).dump());
 
+                bool aliasChanged = false;
+                for (const auto &e : room.second.state.events)
+                        if (std::holds_alternative<StateEvent<state::CanonicalAlias>>(e))
+                                aliasChanged = true;
+                for (const auto &e : room.second.timeline.events)
+                        if (std::holds_alternative<StateEvent<state::CanonicalAlias>>(e))
+                                aliasChanged = true;
+                updateRoomDirectory(txn, statesdb, room.first, updatedInfo, aliasChanged);
+
                 for (const auto &e : room.second.ephemeral.events) {
                         if (auto receiptsEv = std::get_if<
                               mtx::events::EphemeralEvent<mtx::events::ephemeral::Receipt>>(&e)) {
@@ -1423,6 +2409,8 @@ Cache::saveState(const mtx::responses::Sync &res)
 
         txn.commit();
 
+        updateMemberDevices(res);
+
         std::map<QString, bool> readStatus;
 
         for (const auto &room : res.rooms.join) {
@@ -2388,12 +3376,18 @@ Cache::getRoomIsSpace(lmdb::txn &txn, lmdb::dbi &statesdb)
 std::optional<mtx::events::state::CanonicalAlias>
 Cache::getRoomAliases(const std::string &roomid)
 {
-        using namespace mtx::events;
-        using namespace mtx::events::state;
-
         auto txn      = ro_txn(env_);
         auto statesdb = getStatesDb(txn, roomid);
 
+        return getRoomAliases(txn, statesdb);
+}
+
+std::optional<mtx::events::state::CanonicalAlias>
+Cache::getRoomAliases(lmdb::txn &txn, lmdb::dbi &statesdb)
+{
+        using namespace mtx::events;
+        using namespace mtx::events::state;
+
         std::string_view event;
         bool res = statesdb.get(txn, to_string(mtx::events::EventType::RoomCanonicalAlias), event);
 
@@ -2551,6 +3545,58 @@ Cache::joinedRooms()
         return room_ids;
 }
 
+std::vector<std::pair<std::string, RoomDirectoryEntry>>
+Cache::roomDirectory()
+{
+        auto txn    = ro_txn(env_);
+        auto cursor = lmdb::cursor::open(txn, roomDirectoryDb_);
+
+        std::string_view room_id, data;
+        std::vector<std::pair<std::string, RoomDirectoryEntry>> entries;
+        while (cursor.get(room_id, data, MDB_NEXT)) {
+                try {
+                        entries.emplace_back(room_id, json::parse(data).get<RoomDirectoryEntry>());
+                } catch (const json::exception &e) {
+                        nhlog::db()->warn("failed to parse room directory entry: room_id ({}), {}",
+                                          room_id,
+                                          e.what());
+                }
+        }
+
+        return entries;
+}
+
+void
+Cache::updateRoomDirectory(lmdb::txn &txn,
+                           lmdb::dbi &statesdb,
+                           const std::string &room_id,
+                           const RoomInfo &info,
+                           bool aliasChanged)
+{
+        RoomDirectoryEntry entry;
+        entry.name       = info.name;
+        entry.avatar_url = info.avatar_url;
+
+        std::string_view oldData;
+        bool hasEntry = roomDirectoryDb_.get(txn, room_id, oldData);
+        if (hasEntry && !aliasChanged) {
+                try {
+                        entry.alias = json::parse(oldData).at("alias");
+                } catch (const json::exception &) {
+                        aliasChanged = true;
+                }
+        }
+        if (!hasEntry || aliasChanged) {
+                if (auto aliases = getRoomAliases(txn, statesdb))
+                        entry.alias = aliases->alias;
+        }
+
+        // Most syncs don't change any of this, so don't rewrite the entry then.
+        auto data = json(entry).dump();
+        if (!hasEntry || oldData != data)
+                roomDirectoryDb_.put(txn, room_id, data);
+}
+
 std::optional<MemberInfo>
 Cache::getMember(const std::string &room_id, const std::string &user_id)
 {
@@ -2784,6 +3830,8 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
                         evToOrderDb.put(txn, event_id, txn_order);
                         evToOrderDb.del(txn, txn_id);
 
+                        indexMessage(txn, room_id, e);
+
                         auto relations = mtx::accessors::relations(e);
                         if (!relations.relations.empty()) {
                                 for (const auto &r : relations.relations) {
@@ -2807,6 +3855,8 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
                         if (redaction->redacts.empty())
                                 continue;
 
+                        removeFromSearchIndex(txn, room_id, redaction->redacts);
+
                         std::string_view oldEvent;
                         bool success = eventsDb.get(txn, redaction->redacts, oldEvent);
                         if (!success)
@@ -2863,6 +3913,8 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
                                         }
                                 }
                         }
+
+                        indexMessage(txn, room_id, e);
                 }
         }
 }
@@ -2941,6 +3993,8 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
                                 }
                         }
                 }
+
+                indexMessage(txn, room_id, e);
         }
 
         json orderEntry          = json::object();
@@ -3239,6 +4293,18 @@ Cache::deleteOldData() noexcept
         } catch (const lmdb::error &e) {
                 nhlog::db()->error("failed to delete old messages: {}", e.what());
         }
+
+        try {
+                deleteOldMediaEncryptionInfo();
+        } catch (const lmdb::error &e) {
+                nhlog::db()->error("failed to delete old media encryption info: {}", e.what());
+        }
+
+        try {
+                deleteOldKeyRequests();
+        } catch (const std::exception &e) {
+                nhlog::db()->error("failed to delete old key requests: {}", e.what());
+        }
 }
 
 void
@@ -3358,6 +4424,25 @@ Cache::getParentRoomIds(const std::string &room_id)
         return roomids;
 }
 
+std::map<std::string, std::vector<std::string>>
+Cache::getAllParentRoomIds()
+{
+        auto txn = ro_txn(env_);
+
+        std::map<std::string, std::vector<std::string>> parents;
+        {
+                auto cursor = lmdb::cursor::open(txn, spacesParentsDb_);
+                std::string_view room_id, space_parent;
+                while (cursor.get(room_id, space_parent, MDB_NEXT)) {
+                        if (!space_parent.empty())
+                                parents[std::string(room_id)].emplace_back(space_parent);
+                }
+                cursor.close();
+        }
+
+        return parents;
+}
+
 std::vector<std::string>
 Cache::getChildRoomIds(const std::string &room_id)
 {
@@ -3528,35 +4613,173 @@ Cache::roomMembers(const std::string &room_id)
         return members;
 }
 
-std::map<std::string, std::optional<UserKeyCache>>
-Cache::getMembersWithKeys(const std::string &room_id)
+std::vector<std::pair<std::string, MemberInfo>>
+Cache::getMemberInfos(const std::string &room_id)
+{
+        auto txn = ro_txn(env_);
+        auto db  = getMembersDb(txn, room_id);
+
+        std::vector<std::pair<std::string, MemberInfo>> members;
+        members.reserve(db.size(txn));
+
+        std::string_view user_id, user_data;
+        auto cursor = lmdb::cursor::open(txn, db);
+        while (cursor.get(user_id, user_data, MDB_NEXT)) {
+                try {
+                        members.emplace_back(std::string(user_id),
+                                             json::parse(user_data).get<MemberInfo>());
+                } catch (const json::exception &e) {
+                        nhlog::db()->warn("{}", e.what());
+                }
+        }
+        cursor.close();
+
+        return members;
+}
+
+namespace {
+//! Ids of the devices of a user, which we have keys for.
+std::set<std::string>
+knownDeviceIds(lmdb::txn &txn, lmdb::dbi &keysDb, std::string_view user_id)
 {
+        std::set<std::string> devices;
+
         std::string_view keys;
+        if (keysDb.get(txn, user_id, keys))
+                for (const auto &[device_id, device_keys] :
+                     json::parse(keys).get<UserKeyCache>().device_keys) {
+                        (void)device_keys;
+                        devices.insert(device_id);
+                }
+
+        return devices;
+}
+
+//! Entries are shared with readers, so copy them before modifying them.
+RoomMemberDevices &
+detach(std::shared_ptr<RoomMemberDevices> &devices)
+{
+        if (devices.use_count() > 1)
+                devices = std::make_shared<RoomMemberDevices>(*devices);
+        return *devices;
+}
+}
+
+std::shared_ptr<const RoomMemberDevices>
+Cache::getMemberDevices(const std::string &room_id)
+{
+        uint64_t generation = 0;
+        {
+                std::lock_guard<std::mutex> lock(memberDevicesMtx_);
+                if (auto it = memberDevices_.find(room_id); it != memberDevices_.end())
+                        return it->second;
+                generation = memberDevicesGeneration_;
+        }
+
+        auto members = std::make_shared<RoomMemberDevices>();
 
         try {
                 auto txn = ro_txn(env_);
-                std::map<std::string, std::optional<UserKeyCache>> members;
 
                 auto db     = getMembersDb(txn, room_id);
                 auto keysDb = getUserKeysDb(txn);
 
                 std::string_view user_id, unused;
                 auto cursor = lmdb::cursor::open(txn, db);
-                while (cursor.get(user_id, unused, MDB_NEXT)) {
-                        auto res = keysDb.get(txn, user_id, keys);
+                while (cursor.get(user_id, unused, MDB_NEXT))
+                        (*members)[std::string(user_id)] = knownDeviceIds(txn, keysDb, user_id);
+                cursor.close();
+        } catch (std::exception &e) {
+                nhlog::db()->warn("failed to load member devices of {}: {}", room_id, e.what());
+                return {};
+        }
 
-                        if (res) {
-                                members[std::string(user_id)] =
-                                  json::parse(keys).get<UserKeyCache>();
-                        } else {
-                                members[std::string(user_id)] = {};
+        std::lock_guard<std::mutex> lock(memberDevicesMtx_);
+        // If an update was applied while we were reading, our snapshot might miss it. Don't
+        // remember it in that case, the next call will just read it again.
+        if (generation != memberDevicesGeneration_)
+                return members;
+
+        return memberDevices_.emplace(room_id, members).first->second;
+}
+
+void
+Cache::updateMemberDevices(const mtx::responses::Sync &res)
+{
+        using namespace mtx::events;
+
+        // room id -> user id -> if they are a member now
+        std::map<std::string, std::map<std::string, bool>> changes;
+        auto collectChanges = [&changes](const std::string &room_id, const auto &events) {
+                for (const auto &event : events) {
+                        if (auto e = std::get_if<StateEvent<state::Member>>(&event))
+                                changes[room_id][e->state_key] =
+                                  e->content.membership == state::Membership::Join ||
+                                  e->content.membership == state::Membership::Invite;
+                }
+        };
+
+        for (const auto &[room_id, room] : res.rooms.join) {
+                collectChanges(room_id, room.state.events);
+                collectChanges(room_id, room.timeline.events);
+        }
+
+        if (changes.empty() && res.rooms.leave.empty())
+                return;
+
+        std::lock_guard<std::mutex> lock(memberDevicesMtx_);
+        ++memberDevicesGeneration_;
+
+        for (const auto &[room_id, room] : res.rooms.leave) {
+                (void)room;
+                memberDevices_.erase(room_id);
+        }
+
+        try {
+                auto txn    = ro_txn(env_);
+                auto keysDb = getUserKeysDb(txn);
+
+                for (const auto &[room_id, users] : changes) {
+                        auto it = memberDevices_.find(room_id);
+                        if (it == memberDevices_.end())
+                                continue;
+
+                        for (const auto &[user_id, isMember] : users) {
+                                // Display name and avatar changes are joins too, only look up
+                                // the keys for new members.
+                                if (isMember && !it->second->count(user_id))
+                                        detach(it->second)[user_id] =
+                                          knownDeviceIds(txn, keysDb, user_id);
+                                else if (!isMember && it->second->count(user_id))
+                                        detach(it->second).erase(user_id);
                         }
                 }
-                cursor.close();
+        } catch (std::exception &e) {
+                nhlog::db()->warn("failed to update member devices: {}", e.what());
+                // Rebuild from the db on next use.
+                for (const auto &[room_id, users] : changes) {
+                        (void)users;
+                        memberDevices_.erase(room_id);
+                }
+        }
+}
 
-                return members;
-        } catch (std::exception &) {
-                return {};
+void
+Cache::updateMemberDevices(const std::map<std::string, std::set<std::string>> &devices)
+{
+        if (devices.empty())
+                return;
+
+        std::lock_guard<std::mutex> lock(memberDevicesMtx_);
+        ++memberDevicesGeneration_;
+
+        for (auto &[room_id, members] : memberDevices_) {
+                (void)room_id;
+                for (const auto &[user_id, device_ids] : devices) {
+                        if (auto member = members->find(user_id);
+                            member != members->end() && member->second != device_ids)
+                                detach(members)[user_id] = device_ids;
+                }
         }
 }
 
@@ -3693,6 +4916,7 @@ Cache::updateUserKeys(const std::string &sync_token, const mtx::responses::Query
         auto db  = getUserKeysDb(txn);
 
         std::map<std::string, UserKeyCache> updates;
+        std::map<std::string, std::set<std::string>> updatedDevices;
 
         for (const auto &[user, keys] : keyQuery.device_keys)
                 updates[user].device_keys = keys;
@@ -3777,15 +5001,24 @@ Cache::updateUserKeys(const std::string &sync_token, const mtx::responses::Query
                         }
                 }
                 db.put(txn, user, json(updateToWrite).dump());
+
+                auto &devices = updatedDevices[user];
+                for (const auto &[device_id, device_keys] : updateToWrite.device_keys) {
+                        (void)device_keys;
+                        devices.insert(device_id);
+                }
         }
 
         txn.commit();
 
+        updateMemberDevices(updatedDevices);
+
         std::map<std::string, VerificationStatus> tmp;
         const auto local_user = utils::localUser().toStdString();
 
         {
                 std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+                ++verification_storage.generation;
                 for (auto &[user_id, update] : updates) {
                         (void)update;
                         if (user_id == local_user) {
@@ -3793,19 +5026,38 @@ Cache::updateUserKeys(const std::string &sync_token, const mtx::responses::Query
                         } else {
                                 verification_storage.status.erase(user_id);
                         }
+                        // Signatures are remembered by content, so the old ones would never match
+                        // again anyway.
+                        verification_storage.signatures.erase(user_id);
                 }
         }
 
+        std::vector<std::string> updatedUsers, changedUsers;
         for (auto &[user_id, update] : updates) {
                 (void)update;
                 if (user_id == local_user) {
                         for (const auto &[user, status] : tmp) {
                                 (void)status;
-                                emit verificationStatusChanged(user);
+                                changedUsers.push_back(user);
                         }
                 }
-                emit verificationStatusChanged(user_id);
+                changedUsers.push_back(user_id);
+                updatedUsers.push_back(user_id);
         }
+
+        // Verify the new signatures on the pool, so that the UI only picks up the result.
+        QtConcurrent::run(&verificationPool_, [this, changedUsers = std::move(changedUsers)]() {
+                for (const auto &user_id : changedUsers) {
+                        // the cache is being deleted
+                        if (!databaseReady_)
+                                return;
+
+                        verificationStatus(user_id);
+                        emit verificationStatusChanged(user_id);
+                }
+        });
+
+        finishKeyQueries(updatedUsers, {});
 }
 
 void
@@ -3813,6 +5065,21 @@ Cache::deleteUserKeys(lmdb::txn &txn, lmdb::dbi &db, const std::vector<std::stri
 {
         for (const auto &user_id : user_ids)
                 db.del(txn, user_id);
+
+        if (user_ids.empty())
+                return;
+
+        // We don't share an encrypted room with them anymore, so they can't be in the index either.
+        std::lock_guard<std::mutex> lock(memberDevicesMtx_);
+        ++memberDevicesGeneration_;
+
+        for (auto &[room_id, members] : memberDevices_) {
+                (void)room_id;
+                for (const auto &user_id : user_ids) {
+                        if (members->count(user_id))
+                                detach(members).erase(user_id);
+                }
+        }
 }
 
 void
@@ -3870,41 +5137,95 @@ Cache::query_keys(const std::string &user_id,
                 }
         }
 
-        mtx::requests::QueryKeys req;
-        req.device_keys[user_id] = {};
-
         std::string last_changed;
         if (cache_)
                 last_changed = cache_->last_changed;
-        req.token = last_changed;
-
-        // use context object so that we can disconnect again
-        QObject *context{new QObject(this)};
-        QObject::connect(this,
-                         &Cache::verificationStatusChanged,
-                         context,
-                         [cb, user_id, context_ = context](std::string updated_user) mutable {
-                                 if (user_id == updated_user) {
-                                         context_->deleteLater();
-                                         auto keys = cache::userKeys(user_id);
-                                         cb(keys.value_or(UserKeyCache{}), {});
-                                 }
-                         });
-
-        http::client()->query_keys(
-          req,
-          [cb, user_id, last_changed, this](const mtx::responses::QueryKeys &res,
-                                            mtx::http::RequestErr err) {
-                  if (err) {
-                          nhlog::net()->warn("failed to query device keys: {},{}",
-                                             mtx::errors::to_string(err->matrix_error.errcode),
-                                             static_cast<int>(err->status_code));
-                          cb({}, err);
-                          return;
-                  }
-
-                  emit userKeysUpdate(last_changed, res);
-          });
+
+        {
+                std::lock_guard<std::mutex> lock(keyQueriesMtx_);
+
+                auto &callbacks = keyQueryCallbacks_[user_id];
+                callbacks.push_back(std::move(cb));
+                // already queued or in flight, we get called back with that result
+                if (callbacks.size() > 1)
+                        return;
+
+                bool scheduled = !queuedKeyQueries_.empty();
+                queuedKeyQueries_[last_changed].push_back(user_id);
+                if (scheduled)
+                        return;
+        }
+
+        // Send on the next event loop iteration, so that all the queries caused by one sync end
+        // up in the same request.
+        QMetaObject::invokeMethod(
+          this, [this]() { sendQueuedKeyQueries(); }, Qt::QueuedConnection);
+}
+
+void
+Cache::sendQueuedKeyQueries()
+{
+        std::map<std::string, std::vector<std::string>> queued;
+        {
+                std::lock_guard<std::mutex> lock(keyQueriesMtx_);
+                std::swap(queued, queuedKeyQueries_);
+        }
+
+        for (auto &[last_changed, user_ids] : queued) {
+                nhlog::net()->debug("querying keys of {} users", user_ids.size());
+
+                mtx::requests::QueryKeys req;
+                req.token = last_changed;
+                for (const auto &user_id : user_ids)
+                        req.device_keys[user_id] = {};
+
+                http::client()->query_keys(
+                  req,
+                  [this, last_changed_ = last_changed, user_ids_ = std::move(user_ids)](
+                    const mtx::responses::QueryKeys &res, mtx::http::RequestErr err) {
+                          if (err) {
+                                  nhlog::net()->warn(
+                                    "failed to query device keys: {},{}",
+                                    mtx::errors::to_string(err->matrix_error.errcode),
+                                    static_cast<int>(err->status_code));
+                                  finishKeyQueries(user_ids_, err);
+                                  return;
+                          }
+
+                          // Users without any keys won't get an update, don't let them wait
+                          // forever.
+                          std::vector<std::string> withoutKeys;
+                          for (const auto &user_id : user_ids_)
+                                  if (!res.device_keys.count(user_id))
+                                          withoutKeys.push_back(user_id);
+                          finishKeyQueries(withoutKeys, {});
+
+                          emit userKeysUpdate(last_changed_, res);
+                  });
+        }
+}
+
+void
+Cache::finishKeyQueries(const std::vector<std::string> &user_ids, mtx::http::RequestErr err)
+{
+        std::vector<std::pair<std::string, decltype(keyQueryCallbacks_)::mapped_type>> finished;
+        {
+                std::lock_guard<std::mutex> lock(keyQueriesMtx_);
+                for (const auto &user_id : user_ids) {
+                        if (auto it = keyQueryCallbacks_.find(user_id);
+                            it != keyQueryCallbacks_.end()) {
+                                finished.emplace_back(user_id, std::move(it->second));
+                                keyQueryCallbacks_.erase(it);
+                        }
+                }
+        }
+
+        for (const auto &[user_id, callbacks] : finished) {
+                auto keys =
+                  err ? UserKeyCache{} : cache::userKeys(user_id).value_or(UserKeyCache{});
+                for (const auto &cb : callbacks)
+                        cb(keys, err);
+        }
 }
 
 void
@@ -3972,6 +5293,7 @@ Cache::markDeviceVerified(const std::string &user_id, const std::string &key)
         std::map<std::string, VerificationStatus> tmp;
         {
                 std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+                ++verification_storage.generation;
                 if (user_id == local_user) {
                         std::swap(tmp, verification_storage.status);
                 } else {
@@ -4018,6 +5340,7 @@ Cache::markDeviceUnverified(const std::string &user_id, const std::string &key)
         std::map<std::string, VerificationStatus> tmp;
         {
                 std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+                ++verification_storage.generation;
                 if (user_id == local_user) {
                         std::swap(tmp, verification_storage.status);
                 } else {
@@ -4034,13 +5357,57 @@ Cache::markDeviceUnverified(const std::string &user_id, const std::string &key)
         }
 }
 
+bool
+Cache::verifySignature(const std::string &owner,
+                       const std::string &signing_key,
+                       const json &signed_object,
+                       const std::string &signature)
+{
+        // Remember the result by the signed content, so that a changed key never matches an old
+        // result.
+        auto edge = QCryptographicHash::hash(QByteArray::fromStdString(signing_key + "\n" +
+                                                                         signature + "\n" +
+                                                                         signed_object.dump()),
+                                             QCryptographicHash::Sha256)
+                      .toStdString();
+
+        {
+                std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+                auto &signatures = verification_storage.signatures[owner];
+                if (auto it = signatures.find(edge); it != signatures.end())
+                        return it->second;
+        }
+
+        bool valid = mtx::crypto::ed25519_verify_signature(signing_key, signed_object, signature);
+
+        std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+        verification_storage.signatures[owner][edge] = valid;
+        return valid;
+}
+
 VerificationStatus
 Cache::verificationStatus(const std::string &user_id)
 {
+        uint64_t generation = 0;
+        {
+                std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+                if (verification_storage.status.count(user_id))
+                        return verification_storage.status.at(user_id);
+                generation = verification_storage.generation;
+        }
+
+        auto status = computeVerificationStatus(user_id);
+
+        // Don't remember a result that was computed from keys, which changed in the meantime.
         std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
-        if (verification_storage.status.count(user_id))
-                return verification_storage.status.at(user_id);
+        if (generation == verification_storage.generation)
+                verification_storage.status[user_id] = status;
+        return status;
+}
 
+VerificationStatus
+Cache::computeVerificationStatus(const std::string &user_id)
+{
         VerificationStatus status;
 
         if (auto verifCache = verificationCache(user_id)) {
@@ -4055,20 +5422,19 @@ Cache::verificationStatus(const std::string &user_id)
                 trustlevel = crypto::Trust::Verified;
         }
 
-        verification_storage.status[user_id] = status;
-
-        auto verifyAtLeastOneSig = [](const auto &toVerif,
-                                      const std::map<std::string, std::string> &keys,
-                                      const std::string &keyOwner) {
+        auto verifyAtLeastOneSig = [this](const auto &toVerif,
+                                          const std::map<std::string, std::string> &keys,
+                                          const std::string &keyOwner,
+                                          const std::string &owner) {
                 if (!toVerif.signatures.count(keyOwner))
                         return false;
 
+                const auto signedObject = json(toVerif);
                 for (const auto &[key_id, signature] : toVerif.signatures.at(keyOwner)) {
                         if (!keys.count(key_id))
                                 continue;
 
-                        if (mtx::crypto::ed25519_verify_signature(
-                              keys.at(key_id), json(toVerif), signature))
+                        if (verifySignature(owner, keys.at(key_id), signedObject, signature))
                                 return true;
                 }
                 return false;
@@ -4088,21 +5454,25 @@ Cache::verificationStatus(const std::string &user_id)
                 if (!ourKeys || !theirKeys)
                         return status;
 
-                if (!mtx::crypto::ed25519_verify_signature(
-                      olm::client()->identity_keys().ed25519,
-                      json(ourKeys->master_keys),
-                      ourKeys->master_keys.signatures.at(local_user)
-                        .at("ed25519:" + http::client()->device_id())))
+                if (!verifySignature(local_user,
+                                     olm::client()->identity_keys().ed25519,
+                                     json(ourKeys->master_keys),
+                                     ourKeys->master_keys.signatures.at(local_user)
+                                       .at("ed25519:" + http::client()->device_id())))
                         return status;
 
                 auto master_keys = ourKeys->master_keys.keys;
 
                 if (user_id != local_user) {
                         bool theirMasterKeyVerified =
-                          verifyAtLeastOneSig(
-                            ourKeys->user_signing_keys, master_keys, local_user) &&
-                          verifyAtLeastOneSig(
-                            theirKeys->master_keys, ourKeys->user_signing_keys.keys, local_user);
+                          verifyAtLeastOneSig(ourKeys->user_signing_keys,
+                                              master_keys,
+                                              local_user,
+                                              local_user) &&
+                          verifyAtLeastOneSig(theirKeys->master_keys,
+                                              ourKeys->user_signing_keys.keys,
+                                              local_user,
+                                              user_id);
 
                         if (theirMasterKeyVerified)
                                 trustlevel = crypto::Trust::Verified;
@@ -4116,7 +5486,8 @@ Cache::verificationStatus(const std::string &user_id)
 
                 status.user_verified = trustlevel;
 
-                if (!verifyAtLeastOneSig(theirKeys->self_signing_keys, master_keys, user_id))
+                if (!verifyAtLeastOneSig(
+                      theirKeys->self_signing_keys, master_keys, user_id, user_id))
                         return status;
 
                 for (const auto &[device, device_key] : theirKeys->device_keys) {
@@ -4124,8 +5495,10 @@ Cache::verificationStatus(const std::string &user_id)
                         try {
                                 auto identkey =
                                   device_key.keys.at("curve25519:" + device_key.device_id);
-                                if (verifyAtLeastOneSig(
-                                      device_key, theirKeys->self_signing_keys.keys, user_id)) {
+                                if (verifyAtLeastOneSig(device_key,
+                                                        theirKeys->self_signing_keys.keys,
+                                                        user_id,
+                                                        user_id)) {
                                         status.verified_devices.push_back(device_key.device_id);
                                         status.verified_device_keys[identkey] = trustlevel;
                                 }
@@ -4133,7 +5506,6 @@ Cache::verificationStatus(const std::string &user_id)
                         }
                 }
 
-                verification_storage.status[user_id] = status;
                 return status;
         } catch (std::exception &) {
                 return status;
@@ -4206,6 +5578,22 @@ from_json(const json &j, MemberInfo &info)
         info.avatar_url = j.at("avatar_url");
 }
 
+void
+to_json(json &j, const RoomDirectoryEntry &entry)
+{
+        j["name"]       = entry.name;
+        j["alias"]      = entry.alias;
+        j["avatar_url"] = entry.avatar_url;
+}
+
+void
+from_json(const json &j, RoomDirectoryEntry &entry)
+{
+        entry.name       = j.at("name");
+        entry.alias      = j.at("alias");
+        entry.avatar_url = j.at("avatar_url");
+}
+
 void
 to_json(nlohmann::json &obj, const DeviceKeysToMsgIndex &msg)
 {
@@ -4298,6 +5686,31 @@ from_json(const nlohmann::json &obj, StoredOlmSession &msg)
         msg.pickled_session = obj.at("s").get<std::string>();
 }
 
+void
+to_json(nlohmann::json &obj, const OutgoingKeyRequest &msg)
+{
+        obj["request_id"] = msg.request_id;
+        obj["room_id"]    = msg.room_id;
+        obj["session_id"] = msg.session_id;
+        obj["sender_key"] = msg.sender_key;
+        obj["sender"]     = msg.sender;
+        obj["device_id"]  = msg.device_id;
+        obj["attempts"]   = msg.attempts;
+        obj["ts"]         = msg.last_request_ts;
+}
+void
+from_json(const nlohmann::json &obj, OutgoingKeyRequest &msg)
+{
+        msg.request_id      = obj.at("request_id").get<std::string>();
+        msg.room_id         = obj.at("room_id").get<std::string>();
+        msg.session_id      = obj.at("session_id").get<std::string>();
+        msg.sender_key      = obj.at("sender_key").get<std::string>();
+        msg.sender          = obj.at("sender").get<std::string>();
+        msg.device_id       = obj.at("device_id").get<std::string>();
+        msg.attempts        = obj.at("attempts").get<uint64_t>();
+        msg.last_request_ts = obj.at("ts").get<uint64_t>();
+}
+
 namespace cache {
 void
 init(const QString &user_id)
@@ -4520,6 +5933,12 @@ roomMembers(const std::string &room_id)
         return instance_->roomMembers(room_id);
 }
 
+std::vector<std::pair<std::string, MemberInfo>>
+getMemberInfos(const std::string &room_id)
+{
+        return instance_->getMemberInfos(room_id);
+}
+
 //! Check if the given user has power leve greater than than
 //! lowest power level of the given events.
 bool
@@ -4680,14 +6099,15 @@ dropOutboundMegolmSession(const std::string &room_id)
 }
 
 void
-importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys)
+importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys,
+                  const std::function<void(std::size_t, std::size_t)> &progress)
 {
-        instance_->importSessionKeys(keys);
+        instance_->importSessionKeys(keys, progress);
 }
 mtx::crypto::ExportedSessionKeys
-exportSessionKeys()
+exportSessionKeys(const std::function<void(std::size_t, std::size_t)> &progress)
 {
-        return instance_->exportSessionKeys();
+        return instance_->exportSessionKeys(progress);
 }
 
 //
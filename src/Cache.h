@@ -5,6 +5,8 @@
 
 #pragma once
 
+#include <functional>
+
 #include <QDateTime>
 #include <QString>
 
@@ -122,6 +124,9 @@ getTimelineMentions();
 //! Retrieve all the user ids from a room.
 std::vector<std::string>
 roomMembers(const std::string &room_id);
+//! Retrieve all members of a room with their profile, ordered by user id.
+std::vector<std::pair<std::string, MemberInfo>>
+getMemberInfos(const std::string &room_id);
 
 //! Check if the given user has power level greater than than
 //! lowest power level of the given events.
@@ -213,10 +218,12 @@ updateOutboundMegolmSession(const std::string &room_id,
 void
 dropOutboundMegolmSession(const std::string &room_id);
 
+//! Import or export megolm sessions, progress is called with the processed and total sessions.
 void
-importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys);
+importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys,
+                  const std::function<void(std::size_t, std::size_t)> &progress = {});
 mtx::crypto::ExportedSessionKeys
-exportSessionKeys();
+exportSessionKeys(const std::function<void(std::size_t, std::size_t)> &progress = {});
 
 //
 // Inbound Megolm Sessions
@@ -239,6 +246,7 @@ void
 saveOlmSession(const std::string &curve25519,
                mtx::crypto::OlmSessionPtr session,
                uint64_t timestamp);
+//! Ids of the olm sessions with the key, the most recently used first.
 std::vector<std::string>
 getOlmSessions(const std::string &curve25519);
 std::optional<mtx::crypto::OlmSessionPtr>
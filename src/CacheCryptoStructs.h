@@ -103,6 +103,25 @@ to_json(nlohmann::json &obj, const StoredOlmSession &msg);
 void
 from_json(const nlohmann::json &obj, StoredOlmSession &msg);
 
+//! A request for the keys of a megolm session, which wasn't answered yet.
+struct OutgoingKeyRequest
+{
+        std::string request_id;
+        std::string room_id;
+        std::string session_id;
+        std::string sender_key;
+        //! Sender and device of the event, that couldn't be decrypted.
+        std::string sender;
+        std::string device_id;
+        //! How often the request was sent, used to back off.
+        std::uint64_t attempts        = 0;
+        std::uint64_t last_request_ts = 0;
+};
+void
+to_json(nlohmann::json &obj, const OutgoingKeyRequest &msg);
+void
+from_json(const nlohmann::json &obj, OutgoingKeyRequest &msg);
+
 //! Verification status of a single user
 struct VerificationStatus
 {
@@ -119,6 +138,10 @@ struct VerificationStorage
 {
         //! mapping of user to verification status
         std::map<std::string, VerificationStatus> status;
+        //! owner of the signed key -> hash of signing key, signature and signed key -> valid
+        std::map<std::string, std::map<std::string, bool>> signatures;
+        //! incremented whenever statuses are invalidated
+        uint64_t generation = 0;
         std::mutex verification_storage_mtx;
 };
 
@@ -146,6 +169,9 @@ to_json(nlohmann::json &j, const UserKeyCache &info);
 void
 from_json(const nlohmann::json &j, UserKeyCache &info);
 
+//! Member of a room to the ids of their devices, which we know keys for.
+using RoomMemberDevices = std::map<std::string, std::set<std::string>>;
+
 // the reason these are stored in a seperate cache rather than storing it in the user cache is
 // UserKeyCache stores only keys of users with which encrypted room is shared
 struct VerificationCache
@@ -105,12 +105,33 @@ to_json(nlohmann::json &j, const MemberInfo &info);
 void
 from_json(const nlohmann::json &j, MemberInfo &info);
 
+//! Name, alias and avatar of a joined room, enough to complete it.
+struct RoomDirectoryEntry
+{
+        std::string name;
+        std::string alias;
+        std::string avatar_url;
+};
+
+void
+to_json(nlohmann::json &j, const RoomDirectoryEntry &entry);
+void
+from_json(const nlohmann::json &j, RoomDirectoryEntry &entry);
+
 struct RoomSearchResult
 {
         std::string room_id;
         RoomInfo info;
 };
 
+//! A message matching a search in the local message index.
+struct MessageSearchResult
+{
+        std::string room_id;
+        std::string event_id;
+        uint64_t timestamp = 0;
+};
+
 struct ImagePackInfo
 {
         std::string packname;
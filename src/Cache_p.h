@@ -6,13 +6,18 @@
 
 #pragma once
 
+#include <atomic>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <optional>
 
+#include <QCache>
 #include <QDateTime>
 #include <QDir>
 #include <QImage>
 #include <QString>
+#include <QThreadPool>
 
 #if __has_include(<lmdbxx/lmdb++.h>)
 #include <lmdbxx/lmdb++.h>
@@ -47,8 +52,9 @@ public:
 
         // user cache stores user keys
         std::optional<UserKeyCache> userKeys(const std::string &user_id);
-        std::map<std::string, std::optional<UserKeyCache>> getMembersWithKeys(
-          const std::string &room_id);
+        //! Members of the room and their known devices. Built once per room and then kept up to
+        //! date from syncs and key queries, so the returned map must not be modified.
+        std::shared_ptr<const RoomMemberDevices> getMemberDevices(const std::string &room_id);
         void updateUserKeys(const std::string &sync_token,
                             const mtx::responses::QueryKeys &keyQuery);
         void markUserKeysOutOfDate(lmdb::txn &txn,
@@ -58,6 +64,8 @@ public:
         void deleteUserKeys(lmdb::txn &txn,
                             lmdb::dbi &db,
                             const std::vector<std::string> &user_ids);
+        //! Fetch the keys of a user, if they are outdated. Queries are batched per event loop
+        //! iteration and concurrent queries for the same user share one request.
         void query_keys(const std::string &user_id,
                         std::function<void(const UserKeyCache &, mtx::http::RequestErr)> cb);
 
@@ -67,6 +75,8 @@ public:
         void markDeviceUnverified(const std::string &user_id, const std::string &device);
 
         std::vector<std::string> joinedRooms();
+        //! Name, canonical alias and avatar of all joined rooms, ordered by room id.
+        std::vector<std::pair<std::string, RoomDirectoryEntry>> roomDirectory();
 
         QMap<QString, RoomInfo> roomInfo(bool withInvites = true);
         std::optional<mtx::events::state::CanonicalAlias> getRoomAliases(const std::string &roomid);
@@ -81,6 +91,9 @@ public:
         bool getRoomGuestAccess(lmdb::txn &txn, lmdb::dbi &statesdb);
         //! Retrieve the topic of the room if any.
         QString getRoomTopic(lmdb::txn &txn, lmdb::dbi &statesdb);
+        //! Retrieve the canonical alias and alternative aliases of the room if any.
+        std::optional<mtx::events::state::CanonicalAlias> getRoomAliases(lmdb::txn &txn,
+                                                                         lmdb::dbi &statesdb);
         //! Retrieve the room avatar's url if any.
         QString getRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb);
         //! Retrieve the version of the room if any.
@@ -126,6 +139,8 @@ public:
 
         //! Retrieve all the user ids from a room.
         std::vector<std::string> roomMembers(const std::string &room_id);
+        //! Retrieve all members of a room with their profile, ordered by user id.
+        std::vector<std::pair<std::string, MemberInfo>> getMemberInfos(const std::string &room_id);
 
         //! Check if the given user has power leve greater than than
         //! lowest power level of the given events.
@@ -219,10 +234,14 @@ public:
 
         //! Remove old unused data.
         void deleteOldMessages();
+        void deleteOldMediaEncryptionInfo();
+        void deleteOldKeyRequests();
         void deleteOldData() noexcept;
         //! Retrieve all saved room ids.
         std::vector<std::string> getRoomIds(lmdb::txn &txn);
         std::vector<std::string> getParentRoomIds(const std::string &room_id);
+        //! Parent spaces of all rooms, which have any.
+        std::map<std::string, std::vector<std::string>> getAllParentRoomIds();
         std::vector<std::string> getChildRoomIds(const std::string &room_id);
 
         std::vector<ImagePackInfo> getImagePacks(const std::string &room_id, bool stickers);
@@ -249,8 +268,12 @@ public:
                                          mtx::crypto::OutboundGroupSessionPtr &session);
         void dropOutboundMegolmSession(const std::string &room_id);
 
-        void importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys);
-        mtx::crypto::ExportedSessionKeys exportSessionKeys();
+        //! Import sessions in batches, progress is called with the number of processed and total
+        //! sessions after each batch.
+        void importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys,
+                               const std::function<void(std::size_t, std::size_t)> &progress = {});
+        mtx::crypto::ExportedSessionKeys exportSessionKeys(
+          const std::function<void(std::size_t, std::size_t)> &progress = {});
 
         //
         // Inbound Megolm Sessions
@@ -278,6 +301,40 @@ public:
         void saveOlmAccount(const std::string &pickled);
         std::string restoreOlmAccount();
 
+        //
+        // Outgoing key requests, by megolm session id
+        //
+        std::optional<OutgoingKeyRequest> outgoingKeyRequest(const std::string &session_id);
+        void storeOutgoingKeyRequest(const OutgoingKeyRequest &request);
+        void removeOutgoingKeyRequest(const std::string &session_id);
+
+        //
+        // Encrypted media
+        //
+        void saveMediaEncryptionInfo(const mtx::crypto::EncryptedFile &info);
+        std::optional<mtx::crypto::EncryptedFile> mediaEncryptionInfo(const std::string &mxc_url);
+        //! Local key used to encrypt cached variants of encrypted media. Null if there is none.
+        //! Safe to call from any thread, the key is dropped on logout.
+        std::shared_ptr<const mtx::crypto::BinaryBuf> mediaCacheKey() const
+        {
+                return std::atomic_load(&mediaCacheKey_);
+        }
+
+        //
+        // Message search
+        //
+        //! Start indexing new messages or drop the index. Messages are only indexed, while the
+        //! messageSearchIndex setting is enabled.
+        void setMessageSearchIndexEnabled(bool enabled);
+        //! Index a message, which was decrypted after it was saved.
+        void indexDecryptedMessage(const std::string &room_id,
+                                   const mtx::events::collections::TimelineEvents &event);
+        //! Search the indexed messages of a room or of all rooms, if room_id is empty. Words
+        //! ending in '*' match as prefix, quoted words match as phrase. Newest messages first.
+        std::vector<MessageSearchResult> searchMessages(const std::string &query,
+                                                        const std::string &room_id = "",
+                                                        std::size_t limit          = 50);
+
         void storeSecret(const std::string &name, const std::string &secret);
         void deleteSecret(const std::string &name);
         std::optional<std::string> secret(const std::string &name);
@@ -315,6 +372,29 @@ signals:
         void secretChanged(const std::string name);
 
 private:
+        //! Apply the membership changes of a committed sync to the member device index.
+        void updateMemberDevices(const mtx::responses::Sync &res);
+        //! Apply the device lists of users, whose keys changed, to the member device index.
+        void updateMemberDevices(const std::map<std::string, std::set<std::string>> &devices);
+
+        //! Compute the verification status of a user without looking at the cached one.
+        VerificationStatus computeVerificationStatus(const std::string &user_id);
+        //! Verify an ed25519 signature, remembering the result for the owner of the signed key.
+        bool verifySignature(const std::string &owner,
+                             const std::string &signing_key,
+                             const nlohmann::json &signed_object,
+                             const std::string &signature);
+
+        //! Send all queued key queries, one request per sync token.
+        void sendQueuedKeyQueries();
+        //! Call and remove the callbacks waiting for the keys of the given users.
+        void finishKeyQueries(const std::vector<std::string> &user_ids,
+                              mtx::http::RequestErr err);
+
+        //! Find the session with the newest message for a key and remember it in the index.
+        //! Sessions saved before the index existed are only indexed on their first lookup.
+        std::string indexLatestOlmSession(const std::string &curve25519);
+
         //! Save an invited room.
         void saveInvite(lmdb::txn &txn,
                         lmdb::dbi &statesdb,
@@ -343,6 +423,23 @@ private:
                                   const std::string &room_id,
                                   const mtx::responses::Timeline &res);
 
+        //! Update the directory entry of a joined room. The alias is only looked up again, if it
+        //! changed or the room has no entry yet.
+        void updateRoomDirectory(lmdb::txn &txn,
+                                 lmdb::dbi &statesdb,
+                                 const std::string &room_id,
+                                 const RoomInfo &info,
+                                 bool aliasChanged);
+
+        void indexMessage(lmdb::txn &txn,
+                          const std::string &room_id,
+                          const mtx::events::collections::TimelineEvents &event);
+        void removeFromSearchIndex(lmdb::txn &txn,
+                                   const std::string &room_id,
+                                   const std::string &event_id);
+        void removeRoomFromSearchIndex(lmdb::txn &txn, const std::string &room_id);
+        void flushSearchIndexQueue();
+
         //! retrieve a specific event from account data
         //! pass empty room_id for global account data
         std::optional<mtx::events::collections::RoomAccountDataEvents>
@@ -667,9 +764,13 @@ private:
         void setNextBatchToken(lmdb::txn &txn, const std::string &token);
         void setNextBatchToken(lmdb::txn &txn, const QString &token);
 
+        void loadMediaCacheKey();
+        void loadSearchIndexKey();
+
         lmdb::env env_;
         lmdb::dbi syncStateDb_;
         lmdb::dbi roomsDb_;
+        lmdb::dbi roomDirectoryDb_;
         lmdb::dbi spacesChildrenDb_, spacesParentsDb_;
         lmdb::dbi invitesDb_;
         lmdb::dbi readReceiptsDb_;
@@ -681,13 +782,59 @@ private:
         lmdb::dbi inboundMegolmSessionDb_;
         lmdb::dbi outboundMegolmSessionDb_;
         lmdb::dbi megolmSessionDataDb_;
+        lmdb::dbi olmLatestSessionsDb_;
+        lmdb::dbi outgoingKeyRequestsDb_;
+
+        std::mutex hotOlmSessionsMtx_;
+        //! Recently saved olm sessions, so that we don't need to unpickle them again. A session is
+        //! moved out when it is handed to a caller and moved back in once it is saved again.
+        QCache<QString, mtx::crypto::OlmSessionPtr> hotOlmSessions_{1000};
+
+        lmdb::dbi mediaEncryptionInfoDb_;
+        std::shared_ptr<const mtx::crypto::BinaryBuf> mediaCacheKey_;
+
+        struct SearchIndexKeys
+        {
+                //! Key of the term hashes.
+                QByteArray terms;
+                //! Key the entries are encrypted with.
+                mtx::crypto::BinaryBuf entries;
+        };
+
+        lmdb::dbi messageSearchDb_;
+        lmdb::dbi messageSearchEventsDb_;
+        //! Null if messages aren't indexed.
+        std::shared_ptr<const SearchIndexKeys> searchIndexKeys_;
+        std::mutex searchIndexQueueMtx_;
+        //! Decrypted messages waiting to be indexed.
+        std::vector<std::pair<std::string, mtx::events::collections::TimelineEvents>>
+          searchIndexQueue_;
 
         QString localUserId_;
         QString cacheDirectory_;
 
         VerificationStorage verification_storage;
 
-        bool databaseReady_ = false;
+        std::mutex memberDevicesMtx_;
+        //! Room id to the devices of its members. Entries are shared with callers of
+        //! getMemberDevices, so they are copied before being modified.
+        std::map<std::string, std::shared_ptr<RoomMemberDevices>> memberDevices_;
+        //! Incremented on every update, to detect updates racing with building an entry.
+        uint64_t memberDevicesGeneration_ = 0;
+
+        std::mutex keyQueriesMtx_;
+        //! Callbacks waiting for the keys of a user, which is queued or being queried.
+        std::map<std::string,
+                 std::vector<std::function<void(const UserKeyCache &, mtx::http::RequestErr)>>>
+          keyQueryCallbacks_;
+        //! Users to query in the next batch, by the sync token their keys last changed in.
+        std::map<std::string, std::vector<std::string>> queuedKeyQueries_;
+
+        std::atomic<bool> databaseReady_{false};
+
+        //! Runs the verification recomputes after key updates. Owned by the cache, so that they
+        //! are waited for before the db is closed or the cache is destroyed.
+        QThreadPool verificationPool_;
 };
 
 namespace cache {
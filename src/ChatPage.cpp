@@ -622,6 +622,8 @@ ChatPage::handleSyncResponse(const mtx::responses::Sync &res, const std::string
 
                 auto updates = cache::getRoomInfo(cache::client()->roomsWithStateUpdates(res));
 
+                // Room keys of this sync are still decrypted on the pool. Messages using them are
+                // decrypted again, once the keys are stored.
                 emit syncUI(res.rooms);
 
                 // if we process a lot of syncs (1 every 200ms), this means we clean the
@@ -890,9 +892,19 @@ ChatPage::unbanUser(QString userid, QString reason)
 void
 ChatPage::receivedSessionKey(const std::string &room_id, const std::string &session_id)
 {
+        olm::cancel_session_key_request(session_id);
         view_manager_->receivedSessionKey(room_id, session_id);
 }
 
+void
+ChatPage::receivedSessionKeys(const std::string &room_id,
+                              const std::vector<std::string> &session_ids)
+{
+        for (const auto &session_id : session_ids)
+                olm::cancel_session_key_request(session_id);
+        view_manager_->receivedSessionKeys(room_id, session_ids);
+}
+
 QString
 ChatPage::status() const
 {
@@ -934,10 +946,15 @@ ChatPage::ensureOneTimeKeyCount(const std::map<std::string, uint16_t> &counts)
                         const int nkeys = MAX_ONETIME_KEYS - entry.second;
 
                         nhlog::crypto()->info("uploading {} {} keys", nkeys, entry.first);
-                        olm::client()->generate_one_time_keys(nkeys);
+                        mtx::requests::UploadKeys request;
+                        {
+                                auto lock = olm::lock_account();
+                                olm::client()->generate_one_time_keys(nkeys);
+                                request = olm::client()->create_upload_keys_request();
+                        }
 
                         http::client()->upload_keys(
-                          olm::client()->create_upload_keys_request(),
+                          request,
                           [](const mtx::responses::UploadKeys &, mtx::http::RequestErr err) {
                                   if (err) {
                                           nhlog::crypto()->warn(
@@ -97,6 +97,8 @@ public slots:
         void unbanUser(QString userid, QString reason);
 
         void receivedSessionKey(const std::string &room_id, const std::string &session_id);
+        void receivedSessionKeys(const std::string &room_id,
+                                 const std::vector<std::string> &session_ids);
         void decryptDownloadedSecrets(mtx::secret_storage::AesHmacSha2KeyDescription keyDesc,
                                       const SecretsToDecrypt &secrets);
 signals:
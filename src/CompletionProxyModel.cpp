@@ -4,68 +4,175 @@
 
 #include "CompletionProxyModel.h"
 
+#include <QFutureWatcher>
 #include <QRegularExpression>
+#include <QThreadPool>
+#include <QTimer>
+#include <QtConcurrent>
+
+#include <unordered_set>
 
 #include "CompletionModelRoles.h"
 #include "Logging.h"
 #include "Utils.h"
 
-CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
-                                           int max_mistakes,
-                                           size_t max_completions,
-                                           QObject *parent)
-  : QAbstractProxyModel(parent)
-  , maxMistakes_(max_mistakes)
-  , max_completions_(max_completions)
+namespace {
+//! Completions get their own thread, so that a search doesn't queue up behind the crypto work on
+//! the global pool while the user is typing. Stale searches cancel themselves, so one is enough.
+QThreadPool *
+completionPool()
 {
-        setSourceModel(model);
+        static QThreadPool *pool = []() {
+                auto p = new QThreadPool(QCoreApplication::instance());
+                p->setMaxThreadCount(1);
+                p->setExpiryTimeout(-1);
+                return p;
+        }();
+        return pool;
+}
+}
+
+std::shared_ptr<const CompletionProxyModel::SearchIndex>
+CompletionProxyModel::buildSearchIndex(QAbstractItemModel *model)
+{
+        auto searchIndex = std::make_shared<SearchIndex>();
         QChar splitPoints(' ');
 
         // insert all the full texts
-        for (int i = 0; i < sourceModel()->rowCount(); i++) {
-                if (static_cast<size_t>(i) < max_completions_)
-                        mapping.push_back(i);
-
-                auto string1 = sourceModel()
-                                 ->data(sourceModel()->index(i, 0), CompletionModel::SearchRole)
+        for (int i = 0; i < model->rowCount(); i++) {
+                auto string1 = model->data(model->index(i, 0), CompletionModel::SearchRole)
                                  .toString()
                                  .toLower();
                 if (!string1.isEmpty())
-                        trie_.insert(string1.toUcs4(), i);
+                        searchIndex->insert(string1.toUcs4(), i);
 
-                auto string2 = sourceModel()
-                                 ->data(sourceModel()->index(i, 0), CompletionModel::SearchRole2)
+                auto string2 = model->data(model->index(i, 0), CompletionModel::SearchRole2)
                                  .toString()
                                  .toLower();
                 if (!string2.isEmpty())
-                        trie_.insert(string2.toUcs4(), i);
+                        searchIndex->insert(string2.toUcs4(), i);
         }
 
         // insert the partial matches
-        for (int i = 0; i < sourceModel()->rowCount(); i++) {
-                auto string1 = sourceModel()
-                                 ->data(sourceModel()->index(i, 0), CompletionModel::SearchRole)
+        for (int i = 0; i < model->rowCount(); i++) {
+                auto string1 = model->data(model->index(i, 0), CompletionModel::SearchRole)
                                  .toString()
                                  .toLower();
 
                 for (const auto &e : string1.splitRef(splitPoints)) {
                         if (!e.isEmpty()) // NOTE(Nico): Use Qt::SkipEmptyParts in Qt 5.14
-                                trie_.insert(e.toUcs4(), i);
+                                searchIndex->insert(e.toUcs4(), i);
                 }
 
-                auto string2 = sourceModel()
-                                 ->data(sourceModel()->index(i, 0), CompletionModel::SearchRole2)
+                auto string2 = model->data(model->index(i, 0), CompletionModel::SearchRole2)
                                  .toString()
                                  .toLower();
 
                 if (!string2.isEmpty()) {
                         for (const auto &e : string2.splitRef(splitPoints)) {
                                 if (!e.isEmpty()) // NOTE(Nico): Use Qt::SkipEmptyParts in Qt 5.14
-                                        trie_.insert(e.toUcs4(), i);
+                                        searchIndex->insert(e.toUcs4(), i);
                         }
                 }
         }
 
+        return searchIndex;
+}
+
+CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
+                                           int max_mistakes,
+                                           size_t max_completions,
+                                           QObject *parent)
+  : CompletionProxyModel(
+      model,
+      [model]() { return buildSearchIndex(model); },
+      max_mistakes,
+      max_completions,
+      parent)
+{}
+
+CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
+                                           SearchIndexProvider searchIndex,
+                                           int max_mistakes,
+                                           size_t max_completions,
+                                           QObject *parent)
+  : QAbstractProxyModel(parent)
+  , searchIndexProvider_(std::move(searchIndex))
+  , trie_(searchIndexProvider_())
+  , maxMistakes_(max_mistakes)
+  , max_completions_(max_completions)
+{
+        setSourceModel(model);
+
+        mapping = defaultMapping();
+
+        // Some source models change while the completer is open. Rebuild the index only once for
+        // a batch of changes, i.e. for all member events in a sync.
+        auto scheduleRebuild = [this]() {
+                // Running searches return rows of the old index.
+                ++*searchGeneration_;
+
+                if (rebuildPending_)
+                        return;
+
+                rebuildPending_ = true;
+                QTimer::singleShot(0, this, [this]() {
+                        rebuildPending_ = false;
+                        trie_           = searchIndexProvider_();
+                        invalidate();
+                });
+        };
+        // Until the new results are there, keep the shown rows pointing at the same entries.
+        connect(model,
+                &QAbstractItemModel::rowsInserted,
+                this,
+                [this, scheduleRebuild](const QModelIndex &, int first, int last) {
+                        shiftMapping(first, last - first + 1);
+                        scheduleRebuild();
+                });
+        connect(model,
+                &QAbstractItemModel::rowsAboutToBeRemoved,
+                this,
+                [this](const QModelIndex &, int first, int last) {
+                        removeMappedRows(first, last);
+                });
+        connect(model,
+                &QAbstractItemModel::rowsRemoved,
+                this,
+                [this, scheduleRebuild](const QModelIndex &, int first, int last) {
+                        shiftMapping(last + 1, first - last - 1);
+                        scheduleRebuild();
+                });
+        connect(model,
+                &QAbstractItemModel::dataChanged,
+                this,
+                [this, scheduleRebuild](const QModelIndex &topLeft,
+                                        const QModelIndex &bottomRight,
+                                        const QVector<int> &roles) {
+                        for (int i = 0; i < (int)mapping.size(); i++) {
+                                if (mapping[i] >= topLeft.row() && mapping[i] <= bottomRight.row())
+                                        emit dataChanged(index(i, 0), index(i, 0), roles);
+                        }
+
+                        // Only the search strings are indexed, i.e. not the avatars.
+                        if (roles.isEmpty() || roles.contains(CompletionModel::SearchRole) ||
+                            roles.contains(CompletionModel::SearchRole2))
+                                scheduleRebuild();
+                });
+        connect(model, &QAbstractItemModel::modelAboutToBeReset, this, [this]() {
+                beginResetModel();
+        });
+        connect(model, &QAbstractItemModel::modelReset, this, [this, scheduleRebuild]() {
+                // The search results are restored, once the index is rebuilt.
+                if (searchString_.isEmpty())
+                        mapping = defaultMapping();
+                else
+                        mapping.clear();
+                inverseMappingOutdated = true;
+                endResetModel();
+                scheduleRebuild();
+        });
+
         connect(
           this,
           &CompletionProxyModel::newSearchString,
@@ -73,7 +180,7 @@ CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
           [this](QString s) {
                   s.remove(":");
                   s.remove("@");
-                  searchString_ = s.toLower();
+                  pendingSearchString_ = s.toLower();
                   invalidate();
           },
           Qt::QueuedConnection);
@@ -82,11 +189,165 @@ CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
 void
 CompletionProxyModel::invalidate()
 {
-        auto key = searchString_.toUcs4();
-        beginResetModel();
-        if (!key.empty()) // return default model data, if no search string
-                mapping = trie_.search(key, max_completions_, maxMistakes_);
-        endResetModel();
+        // The index doesn't match the source model, the rebuild searches again.
+        if (rebuildPending_)
+                return;
+
+        auto generation   = ++*searchGeneration_;
+        auto searchString = pendingSearchString_;
+
+        // return default model data, if no search string
+        if (searchString.isEmpty()) {
+                searchString_ = searchString;
+                updateMapping(defaultMapping());
+                return;
+        }
+
+        // Fuzzy searches in large rooms take a while, so don't block the UI on every keystroke.
+        auto watcher = new QFutureWatcher<std::vector<int>>(this);
+        connect(watcher,
+                &QFutureWatcher<std::vector<int>>::finished,
+                this,
+                [this, watcher, generation, searchString]() {
+                        watcher->deleteLater();
+
+                        if (generation != *searchGeneration_)
+                                return;
+
+                        searchString_ = searchString;
+                        updateMapping(watcher->result());
+                });
+        auto search = [searchIndex       = trie_,
+                       key               = searchString.toUcs4(),
+                       maxMistakes       = maxMistakes_,
+                       maxCompletions    = max_completions_,
+                       currentGeneration = searchGeneration_,
+                       generation]() {
+                auto isStale = [&currentGeneration, generation] {
+                        return *currentGeneration != generation;
+                };
+                return searchIndex->search(key, maxCompletions, maxMistakes, isStale);
+        };
+        watcher->setFuture(QtConcurrent::run(completionPool(), std::move(search)));
+}
+
+std::vector<int>
+CompletionProxyModel::defaultMapping() const
+{
+        std::vector<int> rows;
+        for (int i = 0; i < sourceModel()->rowCount() && static_cast<size_t>(i) < max_completions_;
+             i++)
+                rows.push_back(i);
+        return rows;
+}
+
+void
+CompletionProxyModel::shiftMapping(int from, int offset)
+{
+        for (auto &row : mapping) {
+                if (row >= from)
+                        row += offset;
+        }
+        inverseMappingOutdated = true;
+}
+
+void
+CompletionProxyModel::removeMappedRows(int first, int last)
+{
+        auto removed = [this, first, last](int i) {
+                return mapping[i] >= first && mapping[i] <= last;
+        };
+
+        // back to front, so that the rows of the following ranges stay valid
+        for (int end = (int)mapping.size(); end > 0;) {
+                if (!removed(end - 1)) {
+                        end -= 1;
+                        continue;
+                }
+
+                int begin = end - 1;
+                while (begin > 0 && removed(begin - 1))
+                        begin -= 1;
+
+                beginRemoveRows(QModelIndex(), begin, end - 1);
+                mapping.erase(mapping.begin() + begin, mapping.begin() + end);
+                inverseMappingOutdated = true;
+                endRemoveRows();
+
+                end = begin;
+        }
+}
+
+void
+CompletionProxyModel::updateMapping(std::vector<int> newMapping)
+{
+        // Only publish the rows that changed, so that the views don't have to recreate all their
+        // delegates on every keystroke.
+        const std::unordered_set<int> newRows(newMapping.begin(), newMapping.end());
+
+        // remove the rows, which are not part of the results anymore, back to front
+        for (int end = (int)mapping.size(); end > 0;) {
+                if (newRows.count(mapping[end - 1])) {
+                        end -= 1;
+                        continue;
+                }
+
+                int begin = end - 1;
+                while (begin > 0 && !newRows.count(mapping[begin - 1]))
+                        begin -= 1;
+
+                beginRemoveRows(QModelIndex(), begin, end - 1);
+                mapping.erase(mapping.begin() + begin, mapping.begin() + end);
+                inverseMappingOutdated = true;
+                endRemoveRows();
+
+                end = begin;
+        }
+
+        // insert the new results, as long as the remaining rows are still in the same order
+        const std::unordered_set<int> oldRows(mapping.begin(), mapping.end());
+        int row = 0;
+        while (row < (int)newMapping.size()) {
+                if (row < (int)mapping.size() && mapping[row] == newMapping[row]) {
+                        row += 1;
+                        continue;
+                } else if (oldRows.count(newMapping[row])) {
+                        break;
+                }
+
+                int end = row + 1;
+                while (end < (int)newMapping.size() && !oldRows.count(newMapping[end]))
+                        end += 1;
+
+                beginInsertRows(QModelIndex(), row, end - 1);
+                mapping.insert(mapping.begin() + row,
+                               newMapping.begin() + row,
+                               newMapping.begin() + end);
+                inverseMappingOutdated = true;
+                endInsertRows();
+
+                row = end;
+        }
+
+        if (row >= (int)newMapping.size())
+                return;
+
+        // The order changed, replace the remaining rows in place.
+        const int common = (int)std::min(mapping.size(), newMapping.size());
+        std::copy(newMapping.begin() + row, newMapping.begin() + common, mapping.begin() + row);
+        inverseMappingOutdated = true;
+        if (row < common)
+                emit dataChanged(index(row, 0), index(common - 1, 0));
+
+        if (mapping.size() > newMapping.size()) {
+                beginRemoveRows(QModelIndex(), common, (int)mapping.size() - 1);
+                mapping.resize(newMapping.size());
+                endRemoveRows();
+        } else if (mapping.size() < newMapping.size()) {
+                beginInsertRows(QModelIndex(), common, (int)newMapping.size() - 1);
+                mapping.insert(mapping.end(), newMapping.begin() + common, newMapping.end());
+                endInsertRows();
+        }
 }
 
 QHash<int, QByteArray>
@@ -98,28 +359,26 @@ CompletionProxyModel::roleNames() const
 int
 CompletionProxyModel::rowCount(const QModelIndex &) const
 {
-        if (searchString_.isEmpty())
-                return std::min(static_cast<int>(std::min<size_t>(max_completions_,
-                                                                  std::numeric_limits<int>::max())),
-                                sourceModel()->rowCount());
-        else
-                return (int)mapping.size();
+        return (int)mapping.size();
 }
 
 QModelIndex
 CompletionProxyModel::mapFromSource(const QModelIndex &sourceIndex) const
 {
-        // return default model data, if no search string
-        if (searchString_.isEmpty()) {
-                return index(sourceIndex.row(), 0);
-        }
-
-        for (int i = 0; i < (int)mapping.size(); i++) {
-                if (mapping[i] == sourceIndex.row()) {
-                        return index(i, 0);
+        if (inverseMappingOutdated) {
+                inverseMapping.assign(sourceModel()->rowCount(), -1);
+                for (int i = 0; i < (int)mapping.size(); i++) {
+                        if (mapping[i] >= 0 && mapping[i] < (int)inverseMapping.size())
+                                inverseMapping[mapping[i]] = i;
                 }
+                inverseMappingOutdated = false;
         }
-        return QModelIndex();
+
+        auto row = sourceIndex.row();
+        if (row < 0 || row >= (int)inverseMapping.size() || inverseMapping[row] == -1)
+                return QModelIndex();
+
+        return index(inverseMapping[row], 0);
 }
 
 QModelIndex
@@ -127,11 +386,6 @@ CompletionProxyModel::mapToSource(const QModelIndex &proxyIndex) const
 {
         auto row = proxyIndex.row();
 
-        // return default model data, if no search string
-        if (searchString_.isEmpty()) {
-                return index(row, 0);
-        }
-
         if (row < 0 || row >= (int)mapping.size())
                 return QModelIndex();
 
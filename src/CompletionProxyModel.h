@@ -8,141 +8,185 @@
 
 #include <QAbstractProxyModel>
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
 template<typename Key, typename Value>
 struct trie
 {
-        std::vector<Value> values;
-        std::map<Key, trie> next;
+        //! Nodes are stored in one contiguous vector and reference their children by index, the
+        //! root is the first node.
+        struct Node
+        {
+                std::vector<Value> values;
+                //! Sorted by key.
+                std::vector<std::pair<Key, std::uint32_t>> next;
+        };
+        std::vector<Node> nodes{Node{}};
 
         void insert(const QVector<Key> &keys, const Value &v)
         {
-                auto t = this;
+                std::uint32_t t = 0;
                 for (const auto k : keys) {
-                        t = &t->next[k];
+                        auto &next = nodes[t].next;
+                        auto e     = std::lower_bound(
+                          next.begin(), next.end(), k, [](const auto &n, Key key) {
+                                  return n.first < key;
+                          });
+
+                        if (e != next.end() && e->first == k) {
+                                t = e->second;
+                        } else {
+                                auto child = static_cast<std::uint32_t>(nodes.size());
+                                next.insert(e, {k, child});
+                                nodes.emplace_back(); // invalidates next
+                                t = child;
+                        }
                 }
 
-                t->values.push_back(v);
+                nodes[t].values.push_back(v);
         }
 
         std::vector<Value> valuesAndSubvalues(size_t limit = -1) const
         {
-                std::vector<Value> ret;
-                if (limit < 200)
-                        ret.reserve(limit);
-
-                for (const auto &v : values) {
-                        if (ret.size() >= limit)
-                                return ret;
-                        else
-                                ret.push_back(v);
-                }
+                Results ret(limit, nullptr);
+                collect(0, ret);
+                return std::move(ret.values);
+        }
 
-                for (const auto &[k, t] : next) {
-                        (void)k;
-                        if (ret.size() >= limit)
-                                return ret;
-                        else {
-                                auto temp = t.valuesAndSubvalues(limit - ret.size());
-                                for (auto &&v : temp) {
-                                        if (ret.size() >= limit)
-                                                return ret;
-
-                                        if (std::find(ret.begin(), ret.end(), v) == ret.end()) {
-                                                ret.push_back(std::move(v));
-                                        }
-                                }
-                        }
+        //! Returns up to result_count_limit values, whose keys start with the search keys,
+        //! allowing up to max_edit_distance mistakes. Exact matches are returned first. Returns
+        //! early, if the search was cancelled.
+        std::vector<Value> search(const QVector<Key> &keys,
+                                  size_t result_count_limit,
+                                  size_t max_edit_distance_                 = 2,
+                                  const std::function<bool()> &isCancelled = {}) const
+        {
+                Results ret(result_count_limit, isCancelled ? &isCancelled : nullptr);
+                if (!result_count_limit)
+                        return {};
+
+                search(0,
+                       keys.constData(),
+                       static_cast<size_t>(keys.size()),
+                       max_edit_distance_,
+                       ret);
+                return std::move(ret.values);
+        }
+
+private:
+        static constexpr std::uint32_t npos = -1;
+
+        struct Results
+        {
+                Results(size_t limit_, const std::function<bool()> *isCancelled_)
+                  : limit(limit_)
+                  , isCancelled(isCancelled_)
+                {}
+
+                std::vector<Value> values;
+                std::unordered_set<Value> seen;
+                size_t limit;
+                const std::function<bool()> *isCancelled;
+
+                bool done() const
+                {
+                        return values.size() >= limit || (isCancelled && (*isCancelled)());
+                }
+                void add(const Value &v)
+                {
+                        if (values.size() < limit && seen.insert(v).second)
+                                values.push_back(v);
                 }
+        };
 
-                return ret;
+        std::uint32_t find(std::uint32_t t, Key k) const
+        {
+                const auto &next = nodes[t].next;
+                auto e = std::lower_bound(next.begin(), next.end(), k, [](const auto &n, Key key) {
+                        return n.first < key;
+                });
+                return (e != next.end() && e->first == k) ? e->second : npos;
         }
 
-        std::vector<Value> search(const QVector<Key> &keys, //< TODO(Nico): replace this with a span
-                                  size_t result_count_limit,
-                                  size_t max_edit_distance_ = 2) const
+        void collect(std::uint32_t t, Results &ret) const
         {
-                std::vector<Value> ret;
-                if (!result_count_limit)
-                        return ret;
+                for (const auto &v : nodes[t].values) {
+                        if (ret.values.size() >= ret.limit)
+                                return;
+                        ret.add(v);
+                }
 
-                if (keys.isEmpty())
-                        return valuesAndSubvalues(result_count_limit);
+                for (const auto &[k, child] : nodes[t].next) {
+                        (void)k;
+                        if (ret.done())
+                                return;
+                        collect(child, ret);
+                }
+        }
 
-                auto append = [&ret, result_count_limit](std::vector<Value> &&in) {
-                        for (auto &&v : in) {
-                                if (ret.size() >= result_count_limit)
-                                        return;
+        void search(std::uint32_t t,
+                    const Key *keys,
+                    size_t keyCount,
+                    size_t max_edit_distance_,
+                    Results &ret) const
+        {
+                if (ret.done())
+                        return;
 
-                                if (std::find(ret.begin(), ret.end(), v) == ret.end()) {
-                                        ret.push_back(std::move(v));
-                                }
-                        }
-                };
+                if (!keyCount) {
+                        collect(t, ret);
+                        return;
+                }
 
-                auto limit = [&ret, result_count_limit] {
-                        return std::min(result_count_limit, (result_count_limit - ret.size()) * 2);
-                };
+                const auto &next = nodes[t].next;
 
                 // Try first exact matches, then with maximum errors
                 for (size_t max_edit_distance = 0;
-                     max_edit_distance <= max_edit_distance_ && ret.size() < result_count_limit;
+                     max_edit_distance <= max_edit_distance_ && !ret.done();
                      max_edit_distance += 1) {
-                        if (max_edit_distance && ret.size() < result_count_limit) {
-                                max_edit_distance -= 1;
+                        if (max_edit_distance) {
+                                const auto remaining = max_edit_distance - 1;
 
                                 // swap chars case
-                                if (keys.size() >= 2) {
-                                        auto t = this;
-                                        for (int i = 1; i >= 0; i--) {
-                                                if (auto e = t->next.find(keys[i]);
-                                                    e != t->next.end()) {
-                                                        t = &e->second;
-                                                } else {
-                                                        t = nullptr;
-                                                        break;
-                                                }
-                                        }
-
-                                        if (t) {
-                                                append(t->search(
-                                                  keys.mid(2), limit(), max_edit_distance));
-                                        }
+                                if (keyCount >= 2) {
+                                        auto swapped = find(t, keys[1]);
+                                        if (swapped != npos)
+                                                swapped = find(swapped, keys[0]);
+                                        if (swapped != npos)
+                                                search(
+                                                  swapped, keys + 2, keyCount - 2, remaining, ret);
                                 }
 
                                 // insert case
-                                for (const auto &[k, t] : this->next) {
-                                        if (k == keys[0])
-                                                continue;
-                                        if (ret.size() >= limit())
+                                for (const auto &[k, child] : next) {
+                                        if (ret.done())
                                                 break;
-
-                                        // insert
-                                        append(t.search(keys, limit(), max_edit_distance));
+                                        if (k != keys[0])
+                                                search(child, keys, keyCount, remaining, ret);
                                 }
 
                                 // delete character case
-                                append(this->search(keys.mid(1), limit(), max_edit_distance));
+                                search(t, keys + 1, keyCount - 1, remaining, ret);
 
                                 // substitute case
-                                for (const auto &[k, t] : this->next) {
-                                        if (k == keys[0])
-                                                continue;
-                                        if (ret.size() >= limit())
+                                for (const auto &[k, child] : next) {
+                                        if (ret.done())
                                                 break;
-
-                                        // substitute
-                                        append(t.search(keys.mid(1), limit(), max_edit_distance));
+                                        if (k != keys[0])
+                                                search(
+                                                  child, keys + 1, keyCount - 1, remaining, ret);
                                 }
-
-                                max_edit_distance += 1;
                         }
 
-                        if (auto e = this->next.find(keys[0]); e != this->next.end()) {
-                                append(e->second.search(keys.mid(1), limit(), max_edit_distance));
-                        }
+                        if (auto e = find(t, keys[0]); e != npos)
+                                search(e, keys + 1, keyCount - 1, max_edit_distance, ret);
                 }
-
-                return ret;
         }
 };
 
@@ -152,11 +196,28 @@ class CompletionProxyModel : public QAbstractProxyModel
         Q_PROPERTY(
           QString searchString READ searchString WRITE setSearchString NOTIFY newSearchString)
 public:
+        //! Maps the search strings of the rows of a model to their row. Immutable once built, so
+        //! it can be shared by all completers over models with the same content.
+        using SearchIndex = trie<uint, int>;
+        //! Returns the index for the current rows of the source model. Called again after the
+        //! source model changed, so that models owning a shared index can hand out their rebuilt
+        //! one instead of every completer building its own.
+        using SearchIndexProvider = std::function<std::shared_ptr<const SearchIndex>()>;
+
+        static std::shared_ptr<const SearchIndex> buildSearchIndex(QAbstractItemModel *model);
+
+        CompletionProxyModel(QAbstractItemModel *model,
+                             int max_mistakes       = 2,
+                             size_t max_completions = 7,
+                             QObject *parent        = nullptr);
         CompletionProxyModel(QAbstractItemModel *model,
+                             SearchIndexProvider searchIndex,
                              int max_mistakes       = 2,
                              size_t max_completions = 7,
                              QObject *parent        = nullptr);
 
+        //! Searches for the current search string on a worker thread. The model is reset, once the
+        //! results are available. Searches, which are still running, are cancelled.
         void invalidate();
 
         QHash<int, QByteArray> roleNames() const override;
@@ -181,9 +242,31 @@ signals:
         void newSearchString(QString);
 
 private:
+        //! The rows shown without a search string.
+        std::vector<int> defaultMapping() const;
+        //! Replaces the current results, emitting only the row changes needed to get there. Only
+        //! valid, while the source rows keep their position.
+        void updateMapping(std::vector<int> newMapping);
+        //! Moves the mapped source rows starting at from by offset, after source rows were
+        //! inserted or removed.
+        void shiftMapping(int from, int offset);
+        //! Removes the results for the source rows first to last, before they are removed.
+        void removeMappedRows(int first, int last);
+
+        //! The search string the current results are for.
         QString searchString_;
-        trie<uint, int> trie_;
+        QString pendingSearchString_;
+        //! Incremented for every search, so that older searches can notice they are stale.
+        std::shared_ptr<std::atomic<std::uint64_t>> searchGeneration_ =
+          std::make_shared<std::atomic<std::uint64_t>>(0);
+        SearchIndexProvider searchIndexProvider_;
+        std::shared_ptr<const SearchIndex> trie_;
+        bool rebuildPending_ = false;
+        //! proxy row to source row
         std::vector<int> mapping;
+        //! source row to proxy row or -1, rebuilt on demand after the mapping changed
+        mutable std::vector<int> inverseMapping;
+        mutable bool inverseMappingOutdated = true;
         int maxMistakes_;
         size_t max_completions_;
 };
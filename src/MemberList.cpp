@@ -12,9 +12,12 @@
 #include <QStyleOption>
 #include <QVBoxLayout>
 
+#include <algorithm>
+
 #include "MemberList.h"
 
 #include "Cache.h"
+#include "Cache_p.h"
 #include "ChatPage.h"
 #include "Config.h"
 #include "Logging.h"
@@ -22,6 +25,10 @@
 #include "timeline/TimelineViewManager.h"
 #include "ui/Avatar.h"
 
+namespace {
+constexpr int MEMBERS_PER_PAGE = 30;
+}
+
 MemberList::MemberList(const QString &room_id, QObject *parent)
   : QAbstractListModel{parent}
   , room_id_{room_id}
@@ -34,27 +41,66 @@ MemberList::MemberList(const QString &room_id, QObject *parent)
         }
 
         try {
-                auto members = cache::getMembers(room_id_.toStdString());
-                addUsers(members);
-                numUsersLoaded_ = members.size();
+                using namespace mtx::events;
+                auto powerLevels =
+                  cache::client()
+                    ->getStateEvent<state::PowerLevels>(room_id_.toStdString())
+                    .value_or(StateEvent<state::PowerLevels>{})
+                    .content;
+
+                auto members = cache::getMemberInfos(room_id_.toStdString());
+                members_.reserve(members.size());
+                for (const auto &[user_id, info] : members)
+                        members_.push_back(Member{
+                          RoomMember{QString::fromStdString(user_id),
+                                     QString::fromStdString(info.name)},
+                          QString::fromStdString(info.avatar_url),
+                          powerLevels.user_level(user_id),
+                        });
         } catch (const lmdb::error &e) {
                 nhlog::db()->critical("Failed to retrieve members from cache: {}", e.what());
         }
+
+        std::sort(members_.begin(), members_.end(), [](const Member &a, const Member &b) {
+                if (a.powerLevel != b.powerLevel)
+                        return a.powerLevel > b.powerLevel;
+                if (auto c = a.member.display_name.compare(b.member.display_name,
+                                                           Qt::CaseInsensitive))
+                        return c < 0;
+                return a.member.user_id < b.member.user_id;
+        });
+
+        updateMatches();
 }
 
 void
-MemberList::addUsers(const std::vector<RoomMember> &members)
+MemberList::updateMatches()
 {
-        beginInsertRows(
-          QModelIndex{}, m_memberList.count(), m_memberList.count() + members.size() - 1);
+        matches_.clear();
+        for (int i = 0; i < (int)members_.size(); i++) {
+                const auto &member = members_[i].member;
+                if (filterString_.isEmpty() ||
+                    member.display_name.contains(filterString_, Qt::CaseInsensitive) ||
+                    member.user_id.contains(filterString_, Qt::CaseInsensitive))
+                        matches_.push_back(i);
+        }
 
-        for (const auto &member : members)
-                m_memberList.push_back(
-                  {member,
-                   ChatPage::instance()->timelineManager()->rooms()->currentRoom()->avatarUrl(
-                     member.user_id)});
+        numUsersLoaded_ = std::min(MEMBERS_PER_PAGE, (int)matches_.size());
+}
 
-        endInsertRows();
+void
+MemberList::setFilterString(const QString &filter)
+{
+        if (filter == filterString_)
+                return;
+
+        beginResetModel();
+        filterString_ = filter;
+        updateMatches();
+        endResetModel();
+
+        emit filterStringChanged();
+        emit numUsersLoadedChanged();
 }
 
 QHash<int, QByteArray>
@@ -70,16 +116,17 @@ MemberList::roleNames() const
 QVariant
 MemberList::data(const QModelIndex &index, int role) const
 {
-        if (!index.isValid() || index.row() >= (int)m_memberList.size() || index.row() < 0)
+        if (!index.isValid() || index.row() >= rowCount() || index.row() < 0)
                 return {};
 
+        const auto &member = members_[matches_[index.row()]];
         switch (role) {
         case Mxid:
-                return m_memberList[index.row()].first.user_id;
+                return member.member.user_id;
         case DisplayName:
-                return m_memberList[index.row()].first.display_name;
+                return member.member.display_name;
         case AvatarUrl:
-                return m_memberList[index.row()].second;
+                return member.avatarUrl;
         default:
                 return {};
         }
@@ -88,11 +135,7 @@ MemberList::data(const QModelIndex &index, int role) const
 bool
 MemberList::canFetchMore(const QModelIndex &) const
 {
-        const size_t numMembers = rowCount();
-        if (numMembers > 1 && numMembers < info_.member_count)
-                return true;
-        else
-                return false;
+        return numUsersLoaded_ < (int)matches_.size();
 }
 
 void
@@ -101,9 +144,10 @@ MemberList::fetchMore(const QModelIndex &)
         loadingMoreMembers_ = true;
         emit loadingMoreMembersChanged();
 
-        auto members = cache::getMembers(room_id_.toStdString(), rowCount());
-        addUsers(members);
-        numUsersLoaded_ += members.size();
+        auto count = std::min(MEMBERS_PER_PAGE, (int)matches_.size() - numUsersLoaded_);
+        beginInsertRows(QModelIndex{}, numUsersLoaded_, numUsersLoaded_ + count - 1);
+        numUsersLoaded_ += count;
+        endInsertRows();
         emit numUsersLoadedChanged();
 
         loadingMoreMembers_ = false;
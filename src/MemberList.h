@@ -7,6 +7,9 @@
 #include "CacheStructs.h"
 #include <QAbstractListModel>
 
+#include <cstdint>
+#include <vector>
+
 class MemberList : public QAbstractListModel
 {
         Q_OBJECT
@@ -17,6 +20,8 @@ class MemberList : public QAbstractListModel
         Q_PROPERTY(QString roomId READ roomId NOTIFY roomIdChanged)
         Q_PROPERTY(int numUsersLoaded READ numUsersLoaded NOTIFY numUsersLoadedChanged)
         Q_PROPERTY(bool loadingMoreMembers READ loadingMoreMembers NOTIFY loadingMoreMembersChanged)
+        Q_PROPERTY(
+          QString filterString READ filterString WRITE setFilterString NOTIFY filterStringChanged)
 
 public:
         enum Roles
@@ -31,7 +36,7 @@ public:
         int rowCount(const QModelIndex &parent = QModelIndex()) const override
         {
                 Q_UNUSED(parent)
-                return static_cast<int>(m_memberList.size());
+                return numUsersLoaded_;
         }
         QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
 
@@ -41,6 +46,8 @@ public:
         QString roomId() const { return room_id_; }
         int numUsersLoaded() const { return numUsersLoaded_; }
         bool loadingMoreMembers() const { return loadingMoreMembers_; }
+        QString filterString() const { return filterString_; }
+        void setFilterString(const QString &filter);
 
 signals:
         void roomNameChanged();
@@ -49,16 +56,28 @@ signals:
         void roomIdChanged();
         void numUsersLoadedChanged();
         void loadingMoreMembersChanged();
-
-public slots:
-        void addUsers(const std::vector<RoomMember> &users);
+        void filterStringChanged();
 
 protected:
         bool canFetchMore(const QModelIndex &) const override;
         void fetchMore(const QModelIndex &) override;
 
 private:
-        QVector<QPair<RoomMember, QString>> m_memberList;
+        struct Member
+        {
+                RoomMember member;
+                QString avatarUrl;
+                int64_t powerLevel = 0;
+        };
+
+        void updateMatches();
+
+        //! All members, sorted by power level and then by name. Read once, so that pages can be
+        //! handed out without going back to the database.
+        std::vector<Member> members_;
+        //! Indices of the members matching the filter string. The first numUsersLoaded_ are shown.
+        std::vector<int> matches_;
+        QString filterString_;
         QString room_id_;
         RoomInfo info_;
         int numUsersLoaded_{0};
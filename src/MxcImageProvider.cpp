@@ -4,40 +4,347 @@
 
 #include "MxcImageProvider.h"
 
+#include <mutex>
 #include <optional>
+#include <vector>
 
 #include <mtxclient/crypto/client.hpp>
 
+#include <QBuffer>
 #include <QByteArray>
+#include <QCache>
+#include <QCryptographicHash>
 #include <QDir>
 #include <QFileInfo>
+#include <QMessageAuthenticationCode>
 #include <QStandardPaths>
 
+#include "AvatarProvider.h"
+#include "Cache_p.h"
 #include "Logging.h"
 #include "MatrixClient.h"
 #include "Utils.h"
 
-QHash<QString, mtx::crypto::EncryptedFile> infos;
+namespace {
+// Recently used encryption infos. The full mapping is persisted in the cache db, so that encrypted
+// media can be served from the media cache after a restart.
+std::mutex infosMtx;
+QCache<QString, mtx::crypto::EncryptedFile> infos(1000);
+
+std::optional<mtx::crypto::EncryptedFile>
+encryptionInfoFor(const QString &mxcUrl)
+{
+        {
+                std::lock_guard<std::mutex> lock(infosMtx);
+                if (auto info = infos.object(mxcUrl))
+                        return *info;
+        }
+
+        if (!cache::client())
+                return std::nullopt;
+
+        auto info = cache::client()->mediaEncryptionInfo(mxcUrl.toStdString());
+        if (info) {
+                std::lock_guard<std::mutex> lock(infosMtx);
+                infos.insert(mxcUrl, new mtx::crypto::EncryptedFile(*info));
+        }
+        return info;
+}
+
+using DownloadCallback = std::function<void(QString, QSize, QImage, QString)>;
+
+// Fetches currently in flight, keyed by media id and requested size. Additional requests for the
+// same media attach their callback to the pending fetch instead of hitting the server again.
+std::mutex pendingDownloadsMtx;
+struct PendingDownload
+{
+        std::vector<DownloadCallback> callbacks;
+        //! Smallest size satisfying every caller, invalid if one of them wants the full image.
+        QSize decodeSize;
+};
+QHash<QString, PendingDownload> pendingDownloads;
+
+QString
+pendingDownloadKey(const QString &id, const QSize &requestedSize)
+{
+        if (requestedSize.isValid())
+                return QString("%1_%2x%3")
+                  .arg(id)
+                  .arg(requestedSize.width())
+                  .arg(requestedSize.height());
+        return id;
+}
+
+//! Returns true, if the caller should start the fetch. Otherwise the callback was queued on an
+//! already running fetch. decodeSize is the size the caller needs the image in, if it is invalid,
+//! the fetched image is decoded at full size.
+bool
+attachToPendingDownload(const QString &key, DownloadCallback then, QSize decodeSize = QSize())
+{
+        std::lock_guard<std::mutex> lock(pendingDownloadsMtx);
+        auto &download = pendingDownloads[key];
+        if (download.callbacks.empty())
+                download.decodeSize = decodeSize;
+        else if (!download.decodeSize.isValid() || !decodeSize.isValid())
+                download.decodeSize = QSize();
+        else
+                download.decodeSize = download.decodeSize.expandedTo(decodeSize);
+
+        download.callbacks.push_back(std::move(then));
+        return download.callbacks.size() == 1;
+}
+
+//! Removes a pending fetch to run its callbacks. Requests arriving after this start a new fetch,
+//! which can then be served from the media cache.
+PendingDownload
+takePendingDownload(const QString &key)
+{
+        std::lock_guard<std::mutex> lock(pendingDownloadsMtx);
+        return pendingDownloads.take(key);
+}
+
+void
+finishPendingDownload(const QString &key, QString id, QSize size, QImage image, QString path)
+{
+        for (const auto &callback : takePendingDownload(key).callbacks)
+                callback(id, size, image, path);
+}
+
+// Scaled variants of encrypted media are stored encrypted with a local key, so that showing them
+// again doesn't need to decrypt and decode the full size original. The file is the IV, the
+// ciphertext and a MAC over both, so that damaged files are never handed to the image decoder.
+constexpr int VARIANT_IV_SIZE  = 16;
+constexpr int VARIANT_MAC_SIZE = 32;
+
+QByteArray
+variantMac(const mtx::crypto::BinaryBuf &key, const QByteArray &data)
+{
+        // Don't use the encryption key directly for the MAC.
+        const auto macKey = QMessageAuthenticationCode::hash(
+          "nheko media cache mac",
+          QByteArray(reinterpret_cast<const char *>(key.data()), (int)key.size()),
+          QCryptographicHash::Sha256);
+        return QMessageAuthenticationCode::hash(data, macKey, QCryptographicHash::Sha256);
+}
+
+bool
+variantMacMatches(const QByteArray &expected, const QByteArray &actual)
+{
+        if (expected.size() != actual.size())
+                return false;
+
+        char difference = 0;
+        for (int i = 0; i < expected.size(); i++)
+                difference |= expected[i] ^ actual[i];
+        return difference == 0;
+}
+
+QFileInfo
+encryptedVariantFile(const QString &id, const QSize &requestedSize)
+{
+        QString fileName =
+          QString("%1_%2x%3_enc")
+            .arg(QString::fromUtf8(id.toUtf8().toBase64(QByteArray::Base64UrlEncoding |
+                                                        QByteArray::OmitTrailingEquals)))
+            .arg(requestedSize.width())
+            .arg(requestedSize.height());
+        return QFileInfo(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
+                           "/media_cache",
+                         fileName);
+}
+
+QImage
+readEncryptedVariant(const QFileInfo &fileInfo)
+{
+        if (!cache::client() || !fileInfo.exists())
+                return {};
+
+        auto key = cache::client()->mediaCacheKey();
+        if (!key)
+                return {};
+
+        QFile f(fileInfo.absoluteFilePath());
+        if (!f.open(QIODevice::ReadOnly))
+                return {};
+
+        QByteArray data = f.readAll();
+        if (data.size() <= VARIANT_IV_SIZE + VARIANT_MAC_SIZE)
+                return {};
+
+        const auto mac = data.right(VARIANT_MAC_SIZE);
+        data.chop(VARIANT_MAC_SIZE);
+        if (!variantMacMatches(variantMac(*key, data), mac)) {
+                nhlog::ui()->warn("Cached media variant {} is damaged, ignoring it",
+                                  fileInfo.absoluteFilePath().toStdString());
+                return {};
+        }
+
+        try {
+                mtx::crypto::BinaryBuf iv(data.begin(), data.begin() + VARIANT_IV_SIZE);
+                auto plaintext = mtx::crypto::AES_CTR_256_Decrypt(
+                  std::string(data.constData() + VARIANT_IV_SIZE, data.size() - VARIANT_IV_SIZE),
+                  *key,
+                  iv);
+                return utils::readImage(QByteArray(reinterpret_cast<const char *>(plaintext.data()),
+                                                   (int)plaintext.size()));
+        } catch (std::exception &e) {
+                nhlog::ui()->warn("Failed to read cached media variant {}: {}",
+                                  fileInfo.absoluteFilePath().toStdString(),
+                                  e.what());
+                return {};
+        }
+}
+
+//! Scales down decrypted media to the requested size and stores the result for the next request.
+QImage
+storeEncryptedVariant(const QString &id, const QSize &requestedSize, QImage image)
+{
+        if (image.width() > requestedSize.width() || image.height() > requestedSize.height())
+                image = image.scaled(requestedSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+        if (image.isNull() || !cache::client())
+                return image;
+
+        auto key = cache::client()->mediaCacheKey();
+        if (!key)
+                return image;
+
+        auto fileInfo = encryptedVariantFile(id, requestedSize);
+        try {
+                QByteArray png;
+                QBuffer buffer(&png);
+                buffer.open(QIODevice::WriteOnly);
+                if (!image.save(&buffer, "png"))
+                        return image;
+
+                auto iv         = mtx::crypto::create_buffer(VARIANT_IV_SIZE);
+                auto ciphertext = mtx::crypto::AES_CTR_256_Encrypt(png.toStdString(), *key, iv);
+
+                QByteArray data(reinterpret_cast<const char *>(iv.data()), (int)iv.size());
+                data.append(reinterpret_cast<const char *>(ciphertext.data()),
+                            (int)ciphertext.size());
+                data.append(variantMac(*key, data));
+
+                QFile f(fileInfo.absoluteFilePath());
+                if (!f.open(QIODevice::Truncate | QIODevice::WriteOnly)) {
+                        nhlog::ui()->debug("Failed to write: {}",
+                                           fileInfo.absoluteFilePath().toStdString());
+                        return image;
+                }
+                f.write(data);
+                nhlog::ui()->debug("Wrote: {}", fileInfo.absoluteFilePath().toStdString());
+        } catch (std::exception &e) {
+                nhlog::ui()->warn("Failed to store cached media variant {}: {}",
+                                  fileInfo.absoluteFilePath().toStdString(),
+                                  e.what());
+        }
+
+        return image;
+}
+
+//! Writes a downloaded media file to the media cache and answers the requests waiting on it.
+void
+storeDownloadedMedia(const QString &requestKey,
+                     const QString &id,
+                     const QFileInfo &fileInfo,
+                     const std::optional<mtx::crypto::EncryptedFile> &encryptionInfo,
+                     const std::string &res,
+                     const std::string &originalFilename)
+{
+        QFile f(fileInfo.absoluteFilePath());
+        if (!f.open(QIODevice::Truncate | QIODevice::WriteOnly)) {
+                finishPendingDownload(requestKey, id, QSize(), {}, "");
+                return;
+        }
+        f.write(res.data(), res.size());
+        f.close();
+
+        if (encryptionInfo) {
+                auto tempData =
+                  mtx::crypto::to_string(mtx::crypto::decrypt_file(res, encryptionInfo.value()));
+                auto data = QByteArray(tempData.data(), (int)tempData.size());
+
+                // Decode only as large as the callers need it, usually that is a timeline
+                // thumbnail. The callbacks are taken at this point, so they have to run even if
+                // decoding fails.
+                auto download = takePendingDownload(requestKey);
+                QImage image;
+                try {
+                        image = utils::readImage(data, download.decodeSize);
+                } catch (const std::exception &e) {
+                        nhlog::net()->warn(
+                          "failed to read media {}: {}", id.toStdString(), e.what());
+                }
+                image.setText("original filename", QString::fromStdString(originalFilename));
+                image.setText("mxc url", "mxc://" + id);
+                for (const auto &callback : download.callbacks)
+                        callback(id, QSize(), image, fileInfo.absoluteFilePath());
+                return;
+        }
+
+        QImage image = utils::readImageFromFile(fileInfo.absoluteFilePath());
+        image.setText("original filename", QString::fromStdString(originalFilename));
+        image.setText("mxc url", "mxc://" + id);
+        finishPendingDownload(requestKey, id, QSize(), image, fileInfo.absoluteFilePath());
+}
+}
 
 QQuickImageResponse *
 MxcImageProvider::requestImageResponse(const QString &id, const QSize &requestedSize)
 {
-        MxcImageResponse *response = new MxcImageResponse(id, requestedSize);
-        pool.start(response);
+        MxcImageResponse *response = new MxcImageResponse(id, avatars_, requestedSize);
+        // Thumbnails are what the visible delegates show, so serve them before full size images.
+        pool.start(response, requestedSize.isValid() ? 1 : 0);
         return response;
 }
 
 void
 MxcImageProvider::addEncryptionInfo(mtx::crypto::EncryptedFile info)
 {
-        infos.insert(QString::fromStdString(info.url), info);
+        const auto url = QString::fromStdString(info.url);
+        {
+                std::lock_guard<std::mutex> lock(infosMtx);
+                if (infos.contains(url))
+                        return;
+                infos.insert(url, new mtx::crypto::EncryptedFile(info));
+        }
+
+        if (cache::client())
+                cache::client()->saveMediaEncryptionInfo(info);
+}
+void
+MxcImageResponse::cancel()
+{
+        m_cancelled = true;
 }
+
 void
 MxcImageResponse::run()
 {
+        // The delegate was destroyed before we got to it, no need to fetch anything.
+        if (m_cancelled) {
+                m_error = "Image request cancelled.";
+                emit finished();
+                return;
+        }
+
+        if (m_isAvatar) {
+                if (auto image = AvatarProvider::cachedAvatar(m_id, m_requestedSize);
+                    !image.isNull()) {
+                        m_image = image;
+                        emit finished();
+                        return;
+                }
+        }
+
         MxcImageProvider::download(
           m_id, m_requestedSize, [this](QString, QSize, QImage image, QString) {
-                  if (image.isNull()) {
+                  if (m_isAvatar)
+                          AvatarProvider::cacheAvatar(m_id, m_requestedSize, image);
+
+                  if (m_cancelled) {
+                          m_error = "Image request cancelled.";
+                  } else if (image.isNull()) {
                           m_error = "Failed to download image.";
                   } else {
                           m_image = image;
@@ -51,10 +358,7 @@ MxcImageProvider::download(const QString &id,
                            const QSize &requestedSize,
                            std::function<void(QString, QSize, QImage, QString)> then)
 {
-        std::optional<mtx::crypto::EncryptedFile> encryptionInfo;
-        auto temp = infos.find("mxc://" + id);
-        if (temp != infos.end())
-                encryptionInfo = *temp;
+        std::optional<mtx::crypto::EncryptedFile> encryptionInfo = encryptionInfoFor("mxc://" + id);
 
         if (requestedSize.isValid() && !encryptionInfo) {
                 QString fileName =
@@ -69,7 +373,8 @@ MxcImageProvider::download(const QString &id,
                 QDir().mkpath(fileInfo.absolutePath());
 
                 if (fileInfo.exists()) {
-                        QImage image = utils::readImageFromFile(fileInfo.absoluteFilePath());
+                        QImage image =
+                          utils::readImageFromFile(fileInfo.absoluteFilePath(), requestedSize);
                         if (!image.isNull()) {
                                 image = image.scaled(
                                   requestedSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
@@ -81,6 +386,10 @@ MxcImageProvider::download(const QString &id,
                         }
                 }
 
+                const auto requestKey = pendingDownloadKey(id, requestedSize);
+                if (!attachToPendingDownload(requestKey, then))
+                        return;
+
                 mtx::http::ThumbOpts opts;
                 opts.mxc_url = "mxc://" + id.toStdString();
                 opts.width   = requestedSize.width() > 0 ? requestedSize.width() : -1;
@@ -88,16 +397,25 @@ MxcImageProvider::download(const QString &id,
                 opts.method  = "crop";
                 http::client()->get_thumbnail(
                   opts,
-                  [fileInfo, requestedSize, then, id](const std::string &res,
-                                                      mtx::http::RequestErr err) {
+                  [fileInfo, requestedSize, requestKey, id](const std::string &res,
+                                                            mtx::http::RequestErr err) {
                           if (err || res.empty()) {
-                                  then(id, QSize(), {}, "");
+                                  finishPendingDownload(requestKey, id, QSize(), {}, "");
 
                                   return;
                           }
 
-                          auto data    = QByteArray(res.data(), (int)res.size());
-                          QImage image = utils::readImage(data);
+                          QImage image;
+                          try {
+                                  auto data = QByteArray(res.data(), (int)res.size());
+                                  image     = utils::readImage(data, requestedSize);
+                          } catch (const std::exception &e) {
+                                  nhlog::net()->warn("failed to read thumbnail of {}: {}",
+                                                     id.toStdString(),
+                                                     e.what());
+                                  finishPendingDownload(requestKey, id, QSize(), {}, "");
+                                  return;
+                          }
                           if (!image.isNull()) {
                                   image = image.scaled(
                                     requestedSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
@@ -110,9 +428,12 @@ MxcImageProvider::download(const QString &id,
                                   nhlog::ui()->debug("Failed to write: {}",
                                                      fileInfo.absoluteFilePath().toStdString());
 
-                          then(id, requestedSize, image, fileInfo.absoluteFilePath());
+                          finishPendingDownload(
+                            requestKey, id, requestedSize, image, fileInfo.absoluteFilePath());
                   });
         } else {
+                const auto requestKey = pendingDownloadKey(id, QSize());
+                bool fetchStarted     = false;
                 try {
                         QString fileName = QString::fromUtf8(id.toUtf8().toBase64(
                           QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals));
@@ -122,6 +443,18 @@ MxcImageProvider::download(const QString &id,
                           fileName);
                         QDir().mkpath(fileInfo.absolutePath());
 
+                        const bool wantsVariant = encryptionInfo && requestedSize.width() > 0 &&
+                                                  requestedSize.height() > 0;
+                        if (wantsVariant) {
+                                QImage image =
+                                  readEncryptedVariant(encryptedVariantFile(id, requestedSize));
+                                if (!image.isNull()) {
+                                        image.setText("mxc url", "mxc://" + id);
+                                        then(id, requestedSize, image, fileInfo.absoluteFilePath());
+                                        return;
+                                }
+                        }
+
                         if (fileInfo.exists()) {
                                 if (encryptionInfo) {
                                         QFile f(fileInfo.absoluteFilePath());
@@ -133,7 +466,11 @@ MxcImageProvider::download(const QString &id,
                                             fileData.toStdString(), encryptionInfo.value()));
                                         auto data =
                                           QByteArray(tempData.data(), (int)tempData.size());
-                                        QImage image = utils::readImage(data);
+                                        QImage image = utils::readImage(
+                                          data, wantsVariant ? requestedSize : QSize());
+                                        if (wantsVariant && !image.isNull())
+                                                image =
+                                                  storeEncryptedVariant(id, requestedSize, image);
                                         image.setText("mxc url", "mxc://" + id);
                                         if (!image.isNull()) {
                                                 then(id,
@@ -155,51 +492,58 @@ MxcImageProvider::download(const QString &id,
                                 }
                         }
 
+                        // Encrypted media is always fetched in full, so requests with different
+                        // sizes can share the download. Each caller gets the size it asked for.
+                        auto reply = [then, requestedSize, wantsVariant](
+                                       QString mediaId, QSize, QImage image, QString path) {
+                                if (image.isNull()) {
+                                        then(mediaId, QSize(), image, path);
+                                        return;
+                                }
+
+                                if (wantsVariant)
+                                        image =
+                                          storeEncryptedVariant(mediaId, requestedSize, image);
+                                then(mediaId, requestedSize, image, path);
+                        };
+                        if (!attachToPendingDownload(requestKey,
+                                                     std::move(reply),
+                                                     wantsVariant ? requestedSize : QSize()))
+                                return;
+                        fetchStarted = true;
+
                         http::client()->download(
                           "mxc://" + id.toStdString(),
-                          [fileInfo, requestedSize, then, id, encryptionInfo](
+                          [fileInfo, requestKey, id, encryptionInfo](
                             const std::string &res,
                             const std::string &,
                             const std::string &originalFilename,
                             mtx::http::RequestErr err) {
                                   if (err) {
-                                          then(id, QSize(), {}, "");
+                                          finishPendingDownload(requestKey, id, QSize(), {}, "");
                                           return;
                                   }
 
-                                  auto tempData = res;
-                                  QFile f(fileInfo.absoluteFilePath());
-                                  if (!f.open(QIODevice::Truncate | QIODevice::WriteOnly)) {
-                                          then(id, QSize(), {}, "");
-                                          return;
+                                  // Other requests for the media are waiting on this
+                                  // download, they have to be answered even if it fails.
+                                  try {
+                                          storeDownloadedMedia(requestKey,
+                                                               id,
+                                                               fileInfo,
+                                                               encryptionInfo,
+                                                               res,
+                                                               originalFilename);
+                                  } catch (const std::exception &e) {
+                                          nhlog::net()->warn("failed to store media {}: {}",
+                                                             id.toStdString(),
+                                                             e.what());
+                                          finishPendingDownload(requestKey, id, QSize(), {}, "");
                                   }
-                                  f.write(tempData.data(), tempData.size());
-                                  f.close();
-
-                                  if (encryptionInfo) {
-                                          tempData =
-                                            mtx::crypto::to_string(mtx::crypto::decrypt_file(
-                                              tempData, encryptionInfo.value()));
-                                          auto data =
-                                            QByteArray(tempData.data(), (int)tempData.size());
-                                          QImage image = utils::readImage(data);
-                                          image.setText("original filename",
-                                                        QString::fromStdString(originalFilename));
-                                          image.setText("mxc url", "mxc://" + id);
-                                          then(
-                                            id, requestedSize, image, fileInfo.absoluteFilePath());
-                                          return;
-                                  }
-
-                                  QImage image =
-                                    utils::readImageFromFile(fileInfo.absoluteFilePath());
-                                  image.setText("original filename",
-                                                QString::fromStdString(originalFilename));
-                                  image.setText("mxc url", "mxc://" + id);
-                                  then(id, requestedSize, image, fileInfo.absoluteFilePath());
                           });
                 } catch (std::exception &e) {
                         nhlog::net()->error("Exception while downloading media: {}", e.what());
+                        if (fetchStarted)
+                                finishPendingDownload(requestKey, id, QSize(), {}, "");
                 }
         }
 }
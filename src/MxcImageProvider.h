@@ -10,6 +10,7 @@
 #include <QImage>
 #include <QThreadPool>
 
+#include <atomic>
 #include <functional>
 
 #include <mtx/common.hpp>
@@ -19,9 +20,10 @@ class MxcImageResponse
   , public QRunnable
 {
 public:
-        MxcImageResponse(const QString &id, const QSize &requestedSize)
+        MxcImageResponse(const QString &id, bool isAvatar, const QSize &requestedSize)
           : m_id(id)
           , m_requestedSize(requestedSize)
+          , m_isAvatar(isAvatar)
         {
                 setAutoDelete(false);
         }
@@ -31,12 +33,15 @@ public:
                 return QQuickTextureFactory::textureFactoryForImage(m_image);
         }
         QString errorString() const override { return m_error; }
+        void cancel() override;
 
         void run() override;
 
         QString m_id, m_error;
         QSize m_requestedSize;
         QImage m_image;
+        bool m_isAvatar;
+        std::atomic<bool> m_cancelled = false;
 };
 
 class MxcImageProvider
@@ -44,6 +49,12 @@ class MxcImageProvider
   , public QQuickAsyncImageProvider
 {
         Q_OBJECT
+public:
+        //! Avatars are served from and stored in the shared avatar cache.
+        explicit MxcImageProvider(bool avatars = false)
+          : avatars_(avatars)
+        {}
+
 public slots:
         QQuickImageResponse *requestImageResponse(const QString &id,
                                                   const QSize &requestedSize) override;
@@ -55,4 +66,5 @@ public slots:
 
 private:
         QThreadPool pool;
+        bool avatars_;
 };
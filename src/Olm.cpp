@@ -6,8 +6,14 @@
 
 #include <QObject>
 #include <QTimer>
+#include <QtConcurrent>
 
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <set>
 #include <variant>
 
 #include <mtx/responses/common.hpp>
@@ -29,6 +35,19 @@ std::map<std::string, std::string> request_id_to_secret_name;
 
 const std::string STORAGE_SECRET_KEY("secret");
 constexpr auto MEGOLM_ALGO = "m.megolm.v1.aes-sha2";
+
+//! Only one thread may use the olm sessions with a device at a time, otherwise two of them could
+//! encrypt or decrypt with the same ratchet state of a session. Devices are spread over a fixed
+//! number of locks, so that unrelated devices rarely wait for each other.
+std::array<std::mutex, 64> olm_session_mtxs;
+
+std::mutex &
+olm_session_mtx(const std::string &curve25519)
+{
+        return olm_session_mtxs[std::hash<std::string>{}(curve25519) % olm_session_mtxs.size()];
+}
+//! Guards changes to the olm account, which is shared by the GUI thread and the olm workers.
+std::mutex olm_account_mtx;
 }
 
 namespace olm {
@@ -54,6 +73,12 @@ client()
         return client_.get();
 }
 
+std::unique_lock<std::mutex>
+lock_account()
+{
+        return std::unique_lock<std::mutex>(olm_account_mtx);
+}
+
 static void
 handle_secret_request(const mtx::events::DeviceEvent<mtx::events::msg::SecretRequest> *e,
                       const std::string &sender)
@@ -102,107 +127,335 @@ handle_secret_request(const mtx::events::DeviceEvent<mtx::events::msg::SecretReq
                            e->content.requesting_device_id);
 }
 
+namespace {
+//! Serialize an event for the log, but only if the crypto log is that verbose.
+template<class T>
+void
+log_event(spdlog::level::level_enum level, std::string_view description, const T &event)
+{
+        if (nhlog::crypto()->should_log(level))
+                nhlog::crypto()->log(level, "{}: {}", description, json(event).dump(2));
+}
+
+//! An olm message waiting for the keys of its sender.
+struct PendingOlmMessage
+{
+        OlmMessage msg;
+        //! Set once the key query for the sender finished.
+        bool ready = false;
+        //! Empty, if the keys of the sender couldn't be fetched.
+        std::optional<UserKeyCache> senderKeys;
+};
+
+//! Olm messages by sender key. They are decrypted on the Qt Concurrent pool, but messages from
+//! the same sender key strictly in the order they arrived in, since each one advances the ratchet.
+std::mutex olm_queue_mtx;
+std::map<std::string, std::deque<std::shared_ptr<PendingOlmMessage>>> olm_queues;
+//! Sender keys, which currently have a worker processing their queue.
+std::set<std::string> olm_queues_processing;
+
+void
+process_olm_queue(const std::string &sender_key)
+{
+        while (true) {
+                std::shared_ptr<PendingOlmMessage> pending;
+                {
+                        std::lock_guard<std::mutex> lock(olm_queue_mtx);
+                        auto queue = olm_queues.find(sender_key);
+                        if (queue == olm_queues.end() || queue->second.empty() ||
+                            !queue->second.front()->ready) {
+                                // restarted by the key query of the front message
+                                olm_queues_processing.erase(sender_key);
+                                if (queue != olm_queues.end() && queue->second.empty())
+                                        olm_queues.erase(queue);
+                                return;
+                        }
+
+                        pending = std::move(queue->second.front());
+                        queue->second.pop_front();
+                }
+
+                if (!pending->senderKeys) {
+                        nhlog::crypto()->error("Failed to query user keys, dropping olm message");
+                        continue;
+                }
+
+                try {
+                        handle_olm_message(pending->msg, *pending->senderKeys);
+                } catch (const std::exception &e) {
+                        nhlog::crypto()->error("Failed to handle olm message from {}: {}",
+                                               pending->msg.sender,
+                                               e.what());
+                }
+        }
+}
+
+//! Start a worker for the queue of the sender key, if its next message can be processed.
+void
+schedule_olm_queue(const std::string &sender_key)
+{
+        {
+                std::lock_guard<std::mutex> lock(olm_queue_mtx);
+                auto queue = olm_queues.find(sender_key);
+                if (queue == olm_queues.end() || queue->second.empty() ||
+                    !queue->second.front()->ready || olm_queues_processing.count(sender_key))
+                        return;
+
+                olm_queues_processing.insert(sender_key);
+        }
+
+        QtConcurrent::run([sender_key]() { process_olm_queue(sender_key); });
+}
+
+void
+enqueue_olm_message(OlmMessage msg)
+{
+        auto pending = std::make_shared<PendingOlmMessage>();
+        pending->msg = std::move(msg);
+
+        const auto &sender_key = pending->msg.sender_key;
+        {
+                std::lock_guard<std::mutex> lock(olm_queue_mtx);
+                olm_queues[sender_key].push_back(pending);
+        }
+
+        cache::client()->query_keys(
+          pending->msg.sender,
+          [pending](const UserKeyCache &userKeys, mtx::http::RequestErr err) {
+                  {
+                          std::lock_guard<std::mutex> lock(olm_queue_mtx);
+                          pending->ready = true;
+                          if (!err)
+                                  pending->senderKeys = userKeys;
+                  }
+                  schedule_olm_queue(pending->msg.sender_key);
+          });
+}
+
+//! Handles to-device events by the type of their variant, without converting them to json first.
+struct ToDeviceEventHandler
+{
+        void operator()(const mtx::events::DeviceEvent<mtx::events::msg::OlmEncrypted> &e) const
+        {
+                if (e.content.algorithm != OLM_ALGO) {
+                        nhlog::crypto()->warn("validation error for olm message: invalid algorithm "
+                                              "{}",
+                                              e.content.algorithm);
+                        return;
+                }
+
+                OlmMessage olm_msg;
+                olm_msg.sender     = e.sender;
+                olm_msg.sender_key = e.content.sender_key;
+                olm_msg.ciphertext = e.content.ciphertext;
+
+                enqueue_olm_message(std::move(olm_msg));
+        }
+        void operator()(const mtx::events::DeviceEvent<mtx::events::msg::KeyRequest> &e) const
+        {
+                log_event(spdlog::level::debug, "handling key request event", e);
+                if (e.content.action == mtx::events::msg::RequestAction::Request)
+                        handle_key_request_message(e);
+                else
+                        nhlog::crypto()->warn("ignore key request (unhandled action): {}",
+                                              e.content.request_id);
+        }
+        void operator()(
+          const mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationAccept> &e) const
+        {
+                ChatPage::instance()->receivedDeviceVerificationAccept(e.content);
+        }
+        void operator()(
+          const mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationRequest> &e) const
+        {
+                ChatPage::instance()->receivedDeviceVerificationRequest(e.content, e.sender);
+        }
+        void operator()(
+          const mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationCancel> &e) const
+        {
+                ChatPage::instance()->receivedDeviceVerificationCancel(e.content);
+        }
+        void operator()(
+          const mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationKey> &e) const
+        {
+                ChatPage::instance()->receivedDeviceVerificationKey(e.content);
+        }
+        void operator()(
+          const mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationMac> &e) const
+        {
+                ChatPage::instance()->receivedDeviceVerificationMac(e.content);
+        }
+        void operator()(
+          const mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationStart> &e) const
+        {
+                ChatPage::instance()->receivedDeviceVerificationStart(e.content, e.sender);
+        }
+        void operator()(
+          const mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationReady> &e) const
+        {
+                ChatPage::instance()->receivedDeviceVerificationReady(e.content);
+        }
+        void operator()(
+          const mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationDone> &e) const
+        {
+                ChatPage::instance()->receivedDeviceVerificationDone(e.content);
+        }
+        void operator()(const mtx::events::DeviceEvent<mtx::events::msg::SecretRequest> &e) const
+        {
+                handle_secret_request(&e, e.sender);
+        }
+        template<class T>
+        void operator()(const T &e) const
+        {
+                nhlog::crypto()->warn("unhandled event: {}", to_string(e.type));
+                log_event(spdlog::level::debug, "unhandled event", e);
+        }
+};
+
+//! Parsers for the event types we handle in olm encrypted to-device messages.
+using DecryptedEventParser = mtx::events::collections::DeviceEvents (*)(const nlohmann::json &);
+
+template<class Content>
+mtx::events::collections::DeviceEvents
+parse_decrypted_event(const nlohmann::json &j)
+{
+        return j.get<mtx::events::DeviceEvent<Content>>();
+}
+
+const std::map<std::string, DecryptedEventParser, std::less<>> &
+decrypted_event_parsers()
+{
+        using namespace mtx::events;
+        static const std::map<std::string, DecryptedEventParser, std::less<>> parsers = {
+          {to_string(EventType::KeyVerificationAccept),
+           parse_decrypted_event<msg::KeyVerificationAccept>},
+          {to_string(EventType::KeyVerificationRequest),
+           parse_decrypted_event<msg::KeyVerificationRequest>},
+          {to_string(EventType::KeyVerificationCancel),
+           parse_decrypted_event<msg::KeyVerificationCancel>},
+          {to_string(EventType::KeyVerificationKey),
+           parse_decrypted_event<msg::KeyVerificationKey>},
+          {to_string(EventType::KeyVerificationMac),
+           parse_decrypted_event<msg::KeyVerificationMac>},
+          {to_string(EventType::KeyVerificationStart),
+           parse_decrypted_event<msg::KeyVerificationStart>},
+          {to_string(EventType::KeyVerificationReady),
+           parse_decrypted_event<msg::KeyVerificationReady>},
+          {to_string(EventType::KeyVerificationDone),
+           parse_decrypted_event<msg::KeyVerificationDone>},
+          {to_string(EventType::RoomKey), parse_decrypted_event<msg::RoomKey>},
+          {to_string(EventType::ForwardedRoomKey), parse_decrypted_event<msg::ForwardedRoomKey>},
+          {to_string(EventType::SecretSend), parse_decrypted_event<msg::SecretSend>},
+          {to_string(EventType::SecretRequest), parse_decrypted_event<msg::SecretRequest>},
+        };
+        return parsers;
+}
+}
+
 void
 handle_to_device_messages(const std::vector<mtx::events::collections::DeviceEvents> &msgs)
 {
         if (msgs.empty())
                 return;
         nhlog::crypto()->info("received {} to_device messages", msgs.size());
-        nlohmann::json j_msg;
 
-        for (const auto &msg : msgs) {
-                j_msg = std::visit([](auto &e) { return json(e); }, std::move(msg));
-                if (j_msg.count("type") == 0) {
-                        nhlog::crypto()->warn("received message with no type field: {}",
-                                              j_msg.dump(2));
-                        continue;
-                }
+        for (const auto &msg : msgs)
+                std::visit(ToDeviceEventHandler{}, msg);
+}
 
-                std::string msg_type = j_msg.at("type");
+//! Handle an event decrypted from an olm message. Runs on the GUI thread, in the order the
+//! messages were decrypted in.
+static void
+handle_decrypted_olm_event(mtx::events::collections::DeviceEvents device_event,
+                           const std::string &sender,
+                           const std::string &sender_key,
+                           const std::string &sender_ed25519)
+{
+        using namespace mtx::events;
+        if (auto e1 = std::get_if<DeviceEvent<msg::KeyVerificationAccept>>(&device_event)) {
+                ChatPage::instance()->receivedDeviceVerificationAccept(e1->content);
+        } else if (auto e2 =
+                     std::get_if<DeviceEvent<msg::KeyVerificationRequest>>(&device_event)) {
+                ChatPage::instance()->receivedDeviceVerificationRequest(e2->content, e2->sender);
+        } else if (auto e3 = std::get_if<DeviceEvent<msg::KeyVerificationCancel>>(&device_event)) {
+                ChatPage::instance()->receivedDeviceVerificationCancel(e3->content);
+        } else if (auto e4 = std::get_if<DeviceEvent<msg::KeyVerificationKey>>(&device_event)) {
+                ChatPage::instance()->receivedDeviceVerificationKey(e4->content);
+        } else if (auto e5 = std::get_if<DeviceEvent<msg::KeyVerificationMac>>(&device_event)) {
+                ChatPage::instance()->receivedDeviceVerificationMac(e5->content);
+        } else if (auto e6 = std::get_if<DeviceEvent<msg::KeyVerificationStart>>(&device_event)) {
+                ChatPage::instance()->receivedDeviceVerificationStart(e6->content, e6->sender);
+        } else if (auto e7 = std::get_if<DeviceEvent<msg::KeyVerificationReady>>(&device_event)) {
+                ChatPage::instance()->receivedDeviceVerificationReady(e7->content);
+        } else if (auto e8 = std::get_if<DeviceEvent<msg::KeyVerificationDone>>(&device_event)) {
+                ChatPage::instance()->receivedDeviceVerificationDone(e8->content);
+        } else if (auto roomKey = std::get_if<DeviceEvent<msg::RoomKey>>(&device_event)) {
+                create_inbound_megolm_session(*roomKey, sender_key, sender_ed25519);
+        } else if (auto forwardedRoomKey =
+                     std::get_if<DeviceEvent<msg::ForwardedRoomKey>>(&device_event)) {
+                forwardedRoomKey->content.forwarding_curve25519_key_chain.push_back(sender_key);
+                import_inbound_megolm_session(*forwardedRoomKey);
+        } else if (auto e = std::get_if<DeviceEvent<msg::SecretSend>>(&device_event)) {
+                auto local_user = http::client()->user_id();
+
+                if (sender != local_user.to_string())
+                        return;
 
-                if (msg_type == to_string(mtx::events::EventType::RoomEncrypted)) {
-                        try {
-                                olm::OlmMessage olm_msg = j_msg;
-                                cache::client()->query_keys(
-                                  olm_msg.sender,
-                                  [olm_msg](const UserKeyCache &userKeys, mtx::http::RequestErr e) {
-                                          if (e) {
-                                                  nhlog::crypto()->error(
-                                                    "Failed to query user keys, dropping olm "
-                                                    "message");
-                                                  return;
-                                          }
-                                          handle_olm_message(std::move(olm_msg), userKeys);
-                                  });
-                        } catch (const nlohmann::json::exception &e) {
-                                nhlog::crypto()->warn(
-                                  "parsing error for olm message: {} {}", e.what(), j_msg.dump(2));
-                        } catch (const std::invalid_argument &e) {
-                                nhlog::crypto()->warn("validation error for olm message: {} {}",
-                                                      e.what(),
-                                                      j_msg.dump(2));
+                auto secret_name = request_id_to_secret_name.find(e->content.request_id);
+
+                if (secret_name != request_id_to_secret_name.end()) {
+                        nhlog::crypto()->info("Received secret: {}", secret_name->second);
+
+                        mtx::events::msg::SecretRequest secretRequest{};
+                        secretRequest.action = mtx::events::msg::RequestAction::Cancellation;
+                        secretRequest.requesting_device_id = http::client()->device_id();
+                        secretRequest.request_id           = e->content.request_id;
+
+                        auto verificationStatus = cache::verificationStatus(local_user.to_string());
+
+                        if (!verificationStatus)
+                                return;
+
+                        auto deviceKeys = cache::userKeys(local_user.to_string());
+                        std::string sender_device_id;
+                        if (deviceKeys) {
+                                for (auto &[dev, key] : deviceKeys->device_keys) {
+                                        if (key.keys["curve25519:" + dev] == sender_key) {
+                                                sender_device_id = dev;
+                                                break;
+                                        }
+                                }
                         }
 
-                } else if (msg_type == to_string(mtx::events::EventType::RoomKeyRequest)) {
-                        nhlog::crypto()->warn("handling key request event: {}", j_msg.dump(2));
-                        try {
-                                mtx::events::DeviceEvent<mtx::events::msg::KeyRequest> req = j_msg;
-                                if (req.content.action == mtx::events::msg::RequestAction::Request)
-                                        handle_key_request_message(req);
-                                else
-                                        nhlog::crypto()->warn(
-                                          "ignore key request (unhandled action): {}",
-                                          req.content.request_id);
-                        } catch (const nlohmann::json::exception &e) {
-                                nhlog::crypto()->warn(
-                                  "parsing error for key_request message: {} {}",
-                                  e.what(),
-                                  j_msg.dump(2));
+                        std::map<mtx::identifiers::User,
+                                 std::map<std::string, mtx::events::msg::SecretRequest>>
+                          body;
+
+                        for (const auto &dev : verificationStatus->verified_devices) {
+                                if (dev != secretRequest.requesting_device_id &&
+                                    dev != sender_device_id)
+                                        body[local_user][dev] = secretRequest;
                         }
-                } else if (msg_type == to_string(mtx::events::EventType::KeyVerificationAccept)) {
-                        auto message = std::get<
-                          mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationAccept>>(msg);
-                        ChatPage::instance()->receivedDeviceVerificationAccept(message.content);
-                } else if (msg_type == to_string(mtx::events::EventType::KeyVerificationRequest)) {
-                        auto message = std::get<
-                          mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationRequest>>(msg);
-                        ChatPage::instance()->receivedDeviceVerificationRequest(message.content,
-                                                                                message.sender);
-                } else if (msg_type == to_string(mtx::events::EventType::KeyVerificationCancel)) {
-                        auto message = std::get<
-                          mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationCancel>>(msg);
-                        ChatPage::instance()->receivedDeviceVerificationCancel(message.content);
-                } else if (msg_type == to_string(mtx::events::EventType::KeyVerificationKey)) {
-                        auto message =
-                          std::get<mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationKey>>(
-                            msg);
-                        ChatPage::instance()->receivedDeviceVerificationKey(message.content);
-                } else if (msg_type == to_string(mtx::events::EventType::KeyVerificationMac)) {
-                        auto message =
-                          std::get<mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationMac>>(
-                            msg);
-                        ChatPage::instance()->receivedDeviceVerificationMac(message.content);
-                } else if (msg_type == to_string(mtx::events::EventType::KeyVerificationStart)) {
-                        auto message = std::get<
-                          mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationStart>>(msg);
-                        ChatPage::instance()->receivedDeviceVerificationStart(message.content,
-                                                                              message.sender);
-                } else if (msg_type == to_string(mtx::events::EventType::KeyVerificationReady)) {
-                        auto message = std::get<
-                          mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationReady>>(msg);
-                        ChatPage::instance()->receivedDeviceVerificationReady(message.content);
-                } else if (msg_type == to_string(mtx::events::EventType::KeyVerificationDone)) {
-                        auto message =
-                          std::get<mtx::events::DeviceEvent<mtx::events::msg::KeyVerificationDone>>(
-                            msg);
-                        ChatPage::instance()->receivedDeviceVerificationDone(message.content);
-                } else if (auto e =
-                             std::get_if<mtx::events::DeviceEvent<mtx::events::msg::SecretRequest>>(
-                               &msg)) {
-                        handle_secret_request(e, e->sender);
-                } else {
-                        nhlog::crypto()->warn("unhandled event: {}", j_msg.dump(2));
+
+                        http::client()->send_to_device<mtx::events::msg::SecretRequest>(
+                          http::client()->generate_txn_id(),
+                          body,
+                          [name = secret_name->second](mtx::http::RequestErr err) {
+                                  if (err) {
+                                          nhlog::net()->error("Failed to send request cancellation "
+                                                              "for secrect "
+                                                              "'{}'",
+                                                              name);
+                                  }
+                          });
+
+                        cache::client()->storeSecret(secret_name->second, e->content.secret);
+
+                        request_id_to_secret_name.erase(secret_name);
                 }
+
+        } else if (auto sec_req = std::get_if<DeviceEvent<msg::SecretRequest>>(&device_event)) {
+                handle_secret_request(sec_req, sender);
         }
 }
 
@@ -225,17 +478,20 @@ handle_olm_message(const OlmMessage &msg, const UserKeyCache &otherUserDeviceKey
                 const auto type = cipher.second.type;
                 nhlog::crypto()->info("type: {}", type == 0 ? "OLM_PRE_KEY" : "OLM_MESSAGE");
 
-                auto payload = try_olm_decryption(msg.sender_key, cipher.second);
+                nlohmann::json payload;
+                {
+                        std::lock_guard<std::mutex> lock(olm_session_mtx(msg.sender_key));
+                        payload = try_olm_decryption(msg.sender_key, cipher.second);
 
-                if (payload.is_null()) {
                         // Check for PRE_KEY message
-                        if (cipher.second.type == 0) {
+                        if (payload.is_null() && cipher.second.type == 0)
                                 payload = handle_pre_key_olm_message(
                                   msg.sender, msg.sender_key, cipher.second);
-                        } else {
-                                nhlog::crypto()->error("Undecryptable olm message!");
-                                continue;
-                        }
+                }
+
+                if (payload.is_null() && cipher.second.type != 0) {
+                        nhlog::crypto()->error("Undecryptable olm message!");
+                        continue;
                 }
 
                 if (!payload.is_null()) {
@@ -249,16 +505,16 @@ handle_olm_message(const OlmMessage &msg, const UserKeyCache &otherUserDeviceKey
                         std::string receiver_ed25519 = payload["recipient_keys"]["ed25519"];
                         if (receiver_ed25519.empty() ||
                             receiver_ed25519 != olm::client()->identity_keys().ed25519) {
-                                nhlog::crypto()->warn(
-                                  "Decrypted event doesn't include our ed25519: {}",
-                                  payload.dump());
+                                log_event(spdlog::level::warn,
+                                          "Decrypted event doesn't include our ed25519",
+                                          payload);
                                 return;
                         }
                         std::string receiver = payload["recipient"];
                         if (receiver.empty() || receiver != http::client()->user_id().to_string()) {
-                                nhlog::crypto()->warn(
-                                  "Decrypted event doesn't include our user_id: {}",
-                                  payload.dump());
+                                log_event(spdlog::level::warn,
+                                          "Decrypted event doesn't include our user_id",
+                                          payload);
                                 return;
                         }
 
@@ -270,9 +526,9 @@ handle_olm_message(const OlmMessage &msg, const UserKeyCache &otherUserDeviceKey
                         // This is crucial when the ed25519 key corresponds to a verified device.
                         std::string sender_ed25519 = payload["keys"]["ed25519"];
                         if (sender_ed25519.empty()) {
-                                nhlog::crypto()->warn(
-                                  "Decrypted event doesn't include sender ed25519: {}",
-                                  payload.dump());
+                                log_event(spdlog::level::warn,
+                                          "Decrypted event doesn't include sender ed25519",
+                                          payload);
                                 return;
                         }
 
@@ -286,141 +542,39 @@ handle_olm_message(const OlmMessage &msg, const UserKeyCache &otherUserDeviceKey
                                 }
                         }
                         if (!from_their_device) {
-                                nhlog::crypto()->warn("Decrypted event isn't sent from a device "
-                                                      "listed by that user! {}",
-                                                      payload.dump());
+                                log_event(spdlog::level::warn,
+                                          "Decrypted event isn't sent from a device listed by "
+                                          "that user!",
+                                          payload);
                                 return;
                         }
 
-                        {
-                                std::string msg_type = payload["type"];
-                                json event_array     = json::array();
-                                event_array.push_back(payload);
-
-                                std::vector<mtx::events::collections::DeviceEvents> temp_events;
-                                mtx::responses::utils::parse_device_events(event_array,
-                                                                           temp_events);
-                                if (temp_events.empty()) {
-                                        nhlog::crypto()->warn("Decrypted unknown event: {}",
-                                                              payload.dump());
+                        try {
+                                const auto &parsers = decrypted_event_parsers();
+                                auto parser = parsers.find(payload.at("type").get<std::string>());
+                                if (parser == parsers.end()) {
+                                        nhlog::crypto()->warn("Decrypted unhandled event: {}",
+                                                              payload.at("type").dump());
                                         return;
                                 }
-                                device_event = temp_events.at(0);
+                                device_event = parser->second(payload);
+                        } catch (const nlohmann::json::exception &e) {
+                                nhlog::crypto()->warn("Decrypted invalid event: {}", e.what());
+                                log_event(spdlog::level::debug, "invalid event", payload);
+                                return;
                         }
 
-                        using namespace mtx::events;
-                        if (auto e1 =
-                              std::get_if<DeviceEvent<msg::KeyVerificationAccept>>(&device_event)) {
-                                ChatPage::instance()->receivedDeviceVerificationAccept(e1->content);
-                        } else if (auto e2 = std::get_if<DeviceEvent<msg::KeyVerificationRequest>>(
-                                     &device_event)) {
-                                ChatPage::instance()->receivedDeviceVerificationRequest(e2->content,
-                                                                                        e2->sender);
-                        } else if (auto e3 = std::get_if<DeviceEvent<msg::KeyVerificationCancel>>(
-                                     &device_event)) {
-                                ChatPage::instance()->receivedDeviceVerificationCancel(e3->content);
-                        } else if (auto e4 = std::get_if<DeviceEvent<msg::KeyVerificationKey>>(
-                                     &device_event)) {
-                                ChatPage::instance()->receivedDeviceVerificationKey(e4->content);
-                        } else if (auto e5 = std::get_if<DeviceEvent<msg::KeyVerificationMac>>(
-                                     &device_event)) {
-                                ChatPage::instance()->receivedDeviceVerificationMac(e5->content);
-                        } else if (auto e6 = std::get_if<DeviceEvent<msg::KeyVerificationStart>>(
-                                     &device_event)) {
-                                ChatPage::instance()->receivedDeviceVerificationStart(e6->content,
-                                                                                      e6->sender);
-                        } else if (auto e7 = std::get_if<DeviceEvent<msg::KeyVerificationReady>>(
-                                     &device_event)) {
-                                ChatPage::instance()->receivedDeviceVerificationReady(e7->content);
-                        } else if (auto e8 = std::get_if<DeviceEvent<msg::KeyVerificationDone>>(
-                                     &device_event)) {
-                                ChatPage::instance()->receivedDeviceVerificationDone(e8->content);
-                        } else if (auto roomKey =
-                                     std::get_if<DeviceEvent<msg::RoomKey>>(&device_event)) {
-                                create_inbound_megolm_session(
-                                  *roomKey, msg.sender_key, sender_ed25519);
-                        } else if (auto forwardedRoomKey =
-                                     std::get_if<DeviceEvent<msg::ForwardedRoomKey>>(
-                                       &device_event)) {
-                                forwardedRoomKey->content.forwarding_curve25519_key_chain.push_back(
-                                  msg.sender_key);
-                                import_inbound_megolm_session(*forwardedRoomKey);
-                        } else if (auto e =
-                                     std::get_if<DeviceEvent<msg::SecretSend>>(&device_event)) {
-                                auto local_user = http::client()->user_id();
-
-                                if (msg.sender != local_user.to_string())
-                                        return;
-
-                                auto secret_name =
-                                  request_id_to_secret_name.find(e->content.request_id);
-
-                                if (secret_name != request_id_to_secret_name.end()) {
-                                        nhlog::crypto()->info("Received secret: {}",
-                                                              secret_name->second);
-
-                                        mtx::events::msg::SecretRequest secretRequest{};
-                                        secretRequest.action =
-                                          mtx::events::msg::RequestAction::Cancellation;
-                                        secretRequest.requesting_device_id =
-                                          http::client()->device_id();
-                                        secretRequest.request_id = e->content.request_id;
-
-                                        auto verificationStatus =
-                                          cache::verificationStatus(local_user.to_string());
-
-                                        if (!verificationStatus)
-                                                return;
-
-                                        auto deviceKeys = cache::userKeys(local_user.to_string());
-                                        std::string sender_device_id;
-                                        if (deviceKeys) {
-                                                for (auto &[dev, key] : deviceKeys->device_keys) {
-                                                        if (key.keys["curve25519:" + dev] ==
-                                                            msg.sender_key) {
-                                                                sender_device_id = dev;
-                                                                break;
-                                                        }
-                                                }
-                                        }
-
-                                        std::map<
-                                          mtx::identifiers::User,
-                                          std::map<std::string, mtx::events::msg::SecretRequest>>
-                                          body;
-
-                                        for (const auto &dev :
-                                             verificationStatus->verified_devices) {
-                                                if (dev != secretRequest.requesting_device_id &&
-                                                    dev != sender_device_id)
-                                                        body[local_user][dev] = secretRequest;
-                                        }
-
-                                        http::client()
-                                          ->send_to_device<mtx::events::msg::SecretRequest>(
-                                            http::client()->generate_txn_id(),
-                                            body,
-                                            [name =
-                                               secret_name->second](mtx::http::RequestErr err) {
-                                                    if (err) {
-                                                            nhlog::net()->error(
-                                                              "Failed to send request cancellation "
-                                                              "for secrect "
-                                                              "'{}'",
-                                                              name);
-                                                    }
-                                            });
-
-                                        cache::client()->storeSecret(secret_name->second,
-                                                                     e->content.secret);
-
-                                        request_id_to_secret_name.erase(secret_name);
-                                }
-
-                        } else if (auto sec_req =
-                                     std::get_if<DeviceEvent<msg::SecretRequest>>(&device_event)) {
-                                handle_secret_request(sec_req, msg.sender);
-                        }
+                        // The handlers emit signals and touch state owned by the GUI thread.
+                        QMetaObject::invokeMethod(
+                          ChatPage::instance(),
+                          [device_event = std::move(device_event),
+                           sender       = msg.sender,
+                           sender_key   = msg.sender_key,
+                           sender_ed25519]() {
+                                  handle_decrypted_olm_event(
+                                    device_event, sender, sender_key, sender_ed25519);
+                          },
+                          Qt::QueuedConnection);
 
                         return;
                 }
@@ -451,6 +605,7 @@ handle_pre_key_olm_message(const std::string &sender,
 
         mtx::crypto::OlmSessionPtr inbound_session = nullptr;
         try {
+                auto lock = lock_account();
                 inbound_session =
                   olm::client()->create_inbound_session_from(sender_key, content.body);
 
@@ -481,7 +636,7 @@ handle_pre_key_olm_message(const std::string &sender,
         }
 
         auto plaintext = json::parse(std::string((char *)output.data(), output.size()));
-        nhlog::crypto()->debug("decrypted message: \n {}", plaintext.dump(2));
+        log_event(spdlog::level::debug, "decrypted message", plaintext);
 
         try {
                 nhlog::crypto()->debug("New olm session: {}",
@@ -504,7 +659,10 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
 
         auto own_user_id = http::client()->user_id().to_string();
 
-        auto members = cache::client()->getMembersWithKeys(room_id);
+        auto memberDevices = cache::client()->getMemberDevices(room_id);
+        if (!memberDevices)
+                memberDevices = std::make_shared<const RoomMemberDevices>();
+        const auto &members = *memberDevices;
 
         std::map<std::string, std::vector<std::string>> sendSessionTo;
         mtx::crypto::OutboundGroupSessionPtr session = nullptr;
@@ -538,15 +696,11 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
                                         while (member_it != members.end()) {
                                                 sendSessionTo[member_it->first] = {};
 
-                                                if (member_it->second)
-                                                        for (const auto &dev :
-                                                             member_it->second->device_keys)
-                                                                if (member_it->first !=
-                                                                      own_user_id ||
-                                                                    dev.first != device_id)
-                                                                        sendSessionTo[member_it
-                                                                                        ->first]
-                                                                          .push_back(dev.first);
+                                                for (const auto &dev : member_it->second)
+                                                        if (member_it->first != own_user_id ||
+                                                            dev != device_id)
+                                                                sendSessionTo[member_it->first]
+                                                                  .push_back(dev);
 
                                                 ++member_it;
                                         }
@@ -564,14 +718,11 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
                                         // new member, send them the session at this index
                                         sendSessionTo[member_it->first] = {};
 
-                                        if (member_it->second) {
-                                                for (const auto &dev :
-                                                     member_it->second->device_keys)
-                                                        if (member_it->first != own_user_id ||
-                                                            dev.first != device_id)
-                                                                sendSessionTo[member_it->first]
-                                                                  .push_back(dev.first);
-                                        }
+                                        for (const auto &dev : member_it->second)
+                                                if (member_it->first != own_user_id ||
+                                                    dev != device_id)
+                                                        sendSessionTo[member_it->first].push_back(
+                                                          dev);
 
                                         ++member_it;
                                 } else {
@@ -579,9 +730,7 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
                                         bool device_removed = false;
                                         for (const auto &dev :
                                              session_member_it->second.deviceids) {
-                                                if (!member_it->second ||
-                                                    !member_it->second->device_keys.count(
-                                                      dev.first)) {
+                                                if (!member_it->second.count(dev.first)) {
                                                         device_removed = true;
                                                         break;
                                                 }
@@ -597,15 +746,13 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
                                         }
 
                                         // check for new devices to share with
-                                        if (member_it->second)
-                                                for (const auto &dev :
-                                                     member_it->second->device_keys)
-                                                        if (!session_member_it->second.deviceids
-                                                               .count(dev.first) &&
-                                                            (member_it->first != own_user_id ||
-                                                             dev.first != device_id))
-                                                                sendSessionTo[member_it->first]
-                                                                  .push_back(dev.first);
+                                        for (const auto &dev : member_it->second)
+                                                if (!session_member_it->second.deviceids.count(
+                                                      dev) &&
+                                                    (member_it->first != own_user_id ||
+                                                     dev != device_id))
+                                                        sendSessionTo[member_it->first].push_back(
+                                                          dev);
 
                                         ++member_it;
                                         ++session_member_it;
@@ -640,14 +787,11 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
                 for (const auto &[user, devices] : members) {
                         sendSessionTo[user]               = {};
                         session_data.currently.keys[user] = {};
-                        if (devices) {
-                                for (const auto &[device_id_, key] : devices->device_keys) {
-                                        (void)key;
-                                        if (device_id != device_id_ || user != own_user_id) {
-                                                sendSessionTo[user].push_back(device_id_);
-                                                session_data.currently.keys[user]
-                                                  .deviceids[device_id_] = 0;
-                                        }
+                        for (const auto &device_id_ : devices) {
+                                if (device_id != device_id_ || user != own_user_id) {
+                                        sendSessionTo[user].push_back(device_id_);
+                                        session_data.currently.keys[user].deviceids[device_id_] =
+                                          0;
                                 }
                         }
                 }
@@ -734,8 +878,9 @@ try_olm_decryption(const std::string &sender_key, const mtx::events::msg::OlmCip
                         text = olm::client()->decrypt_message(session->get(), msg.type, msg.body);
                         nhlog::crypto()->debug("Updated olm session: {}",
                                                mtx::crypto::session_id(session->get()));
-                        cache::saveOlmSession(
-                          id, std::move(session.value()), QDateTime::currentMSecsSinceEpoch());
+                        cache::saveOlmSession(sender_key,
+                                              std::move(session.value()),
+                                              QDateTime::currentMSecsSinceEpoch());
                 } catch (const mtx::crypto::olm_exception &e) {
                         nhlog::crypto()->debug("failed to decrypt olm message ({}, {}) with {}: {}",
                                                msg.type,
@@ -829,41 +974,58 @@ import_inbound_megolm_session(
 void
 mark_keys_as_published()
 {
+        auto lock = lock_account();
         olm::client()->mark_keys_as_published();
         cache::saveOlmAccount(olm::client()->save(STORAGE_SECRET_KEY));
 }
 
-void
-send_key_request_for(mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> e,
-                     const std::string &request_id,
-                     bool cancel)
+namespace {
+//! Delay before an unanswered key request is sent again. Doubles with every attempt.
+constexpr uint64_t KEY_REQUEST_BACKOFF_MS     = 60 * 1000;
+constexpr uint64_t KEY_REQUEST_MAX_BACKOFF_MS = 24 * 60 * 60 * 1000;
+//! Every key request goes to all our devices, so each one needs its own to-device call. Limit
+//! how many of them are sent at once, when a room full of undecryptable messages is opened.
+constexpr std::size_t MAX_KEY_REQUESTS_PER_FLUSH = 10;
+constexpr int KEY_REQUEST_FLUSH_INTERVAL_MS      = 1000;
+
+std::mutex key_requests_mtx;
+//! Key requests waiting to be sent.
+std::deque<OutgoingKeyRequest> queued_key_requests;
+
+uint64_t
+key_request_backoff(uint64_t attempts)
 {
-        using namespace mtx::events;
-
-        nhlog::crypto()->debug("sending key request: sender_key {}, session_id {}",
-                               e.content.sender_key,
-                               e.content.session_id);
+        if (attempts == 0)
+                return 0;
+        return std::min(KEY_REQUEST_BACKOFF_MS << std::min<uint64_t>(attempts - 1, 16),
+                        KEY_REQUEST_MAX_BACKOFF_MS);
+}
 
+void
+send_key_request(const OutgoingKeyRequest &outgoing, bool cancel)
+{
         mtx::events::msg::KeyRequest request;
         request.action = cancel ? mtx::events::msg::RequestAction::Cancellation
                                 : mtx::events::msg::RequestAction::Request;
 
         request.algorithm            = MEGOLM_ALGO;
-        request.room_id              = e.room_id;
-        request.sender_key           = e.content.sender_key;
-        request.session_id           = e.content.session_id;
-        request.request_id           = request_id;
+        request.room_id              = outgoing.room_id;
+        request.sender_key           = outgoing.sender_key;
+        request.session_id           = outgoing.session_id;
+        request.request_id           = outgoing.request_id;
         request.requesting_device_id = http::client()->device_id();
 
-        nhlog::crypto()->debug("m.room_key_request: {}", json(request).dump(2));
+        log_event(spdlog::level::debug, "m.room_key_request", request);
 
         std::map<mtx::identifiers::User, std::map<std::string, decltype(request)>> body;
-        body[mtx::identifiers::parse<mtx::identifiers::User>(e.sender)][e.content.device_id] =
-          request;
+        body[mtx::identifiers::parse<mtx::identifiers::User>(outgoing.sender)]
+            [outgoing.device_id] = request;
         body[http::client()->user_id()]["*"] = request;
 
         http::client()->send_to_device(
-          http::client()->generate_txn_id(), body, [e](mtx::http::RequestErr err) {
+          http::client()->generate_txn_id(),
+          body,
+          [sender = outgoing.sender, device_id = outgoing.device_id](mtx::http::RequestErr err) {
                   if (err) {
                           nhlog::net()->warn("failed to send "
                                              "send_to_device "
@@ -872,11 +1034,113 @@ send_key_request_for(mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> e,
                   }
 
                   nhlog::net()->info("m.room_key_request sent to {}:{} and your own devices",
-                                     e.sender,
-                                     e.content.device_id);
+                                     sender,
+                                     device_id);
           });
 }
 
+void
+send_queued_key_requests()
+{
+        std::vector<OutgoingKeyRequest> requests;
+        bool more = false;
+        {
+                std::lock_guard<std::mutex> lock(key_requests_mtx);
+                while (!queued_key_requests.empty() &&
+                       requests.size() < MAX_KEY_REQUESTS_PER_FLUSH) {
+                        requests.push_back(std::move(queued_key_requests.front()));
+                        queued_key_requests.pop_front();
+                }
+                more = !queued_key_requests.empty();
+        }
+
+        for (const auto &request : requests)
+                send_key_request(request, false);
+
+        if (more)
+                QTimer::singleShot(
+                  KEY_REQUEST_FLUSH_INTERVAL_MS, ChatPage::instance(), send_queued_key_requests);
+}
+}
+
+void
+request_session_key(const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e)
+{
+        const uint64_t now = QDateTime::currentMSecsSinceEpoch();
+
+        std::lock_guard<std::mutex> lock(key_requests_mtx);
+
+        auto request = cache::client()->outgoingKeyRequest(e.content.session_id);
+        if (request) {
+                if (now < request->last_request_ts + key_request_backoff(request->attempts)) {
+                        nhlog::crypto()->debug("keys for session {} were already requested",
+                                               e.content.session_id);
+                        return;
+                }
+        } else {
+                request             = OutgoingKeyRequest{};
+                request->request_id = "key_request." + http::client()->generate_txn_id();
+                request->session_id = e.content.session_id;
+        }
+
+        nhlog::crypto()->debug("requesting keys: sender_key {}, session_id {}, attempt {}",
+                               e.content.sender_key,
+                               e.content.session_id,
+                               request->attempts + 1);
+
+        // The latest event tells us best, who to ask for the keys.
+        request->room_id    = e.room_id;
+        request->sender_key = e.content.sender_key;
+        request->sender     = e.sender;
+        request->device_id  = e.content.device_id;
+        request->attempts++;
+        request->last_request_ts = now;
+
+        try {
+                cache::client()->storeOutgoingKeyRequest(*request);
+        } catch (const lmdb::error &err) {
+                nhlog::db()->warn("failed to store key request: {}", err.what());
+        }
+
+        queued_key_requests.push_back(std::move(*request));
+        if (queued_key_requests.size() == 1)
+                QMetaObject::invokeMethod(
+                  ChatPage::instance(), send_queued_key_requests, Qt::QueuedConnection);
+}
+
+void
+cancel_session_key_request(const std::string &session_id)
+{
+        std::optional<OutgoingKeyRequest> request;
+        bool sent = true;
+        {
+                std::lock_guard<std::mutex> lock(key_requests_mtx);
+
+                request = cache::client()->outgoingKeyRequest(session_id);
+                if (!request)
+                        return;
+
+                auto queued = std::find_if(queued_key_requests.begin(),
+                                           queued_key_requests.end(),
+                                           [&session_id](const OutgoingKeyRequest &r) {
+                                                   return r.session_id == session_id;
+                                           });
+                if (queued != queued_key_requests.end()) {
+                        sent = queued->attempts > 1;
+                        queued_key_requests.erase(queued);
+                }
+
+                try {
+                        cache::client()->removeOutgoingKeyRequest(session_id);
+                } catch (const lmdb::error &err) {
+                        nhlog::db()->warn("failed to remove key request: {}", err.what());
+                }
+        }
+
+        if (sent)
+                send_key_request(*request, true);
+}
+
 void
 handle_key_request_message(const mtx::events::DeviceEvent<mtx::events::msg::KeyRequest> &req)
 {
@@ -1066,6 +1330,182 @@ calculate_trust(const std::string &user_id, const std::string &curve25519)
         return trustlevel;
 }
 
+namespace {
+//! Upper bound of devices per to-device request, so that sharing a key in a large room doesn't
+//! end up in one huge request body.
+constexpr std::size_t MAX_DEVICES_PER_TO_DEVICE_REQUEST = 100;
+
+//! A device to send an olm encrypted message to.
+struct OlmTarget
+{
+        std::string user_id;
+        std::string device_id;
+        DevicePublicKeys keys;
+        //! Claimed one time key to create a new session with. If empty, the newest existing session
+        //! with the device is used.
+        std::string one_time_key;
+};
+
+//! Encrypts the payload for a single device. Runs on the Qt Concurrent pool and only locks the
+//! olm sessions of that device.
+struct EncryptForDevice
+{
+        using result_type = std::optional<mtx::events::msg::OlmEncrypted>;
+
+        nlohmann::json payload;
+
+        result_type operator()(const OlmTarget &target) const
+        {
+                try {
+                        std::lock_guard<std::mutex> lock(olm_session_mtx(target.keys.curve25519));
+
+                        mtx::crypto::OlmSessionPtr session;
+                        if (target.one_time_key.empty()) {
+                                auto latest = cache::getLatestOlmSession(target.keys.curve25519);
+                                if (!latest)
+                                        return std::nullopt;
+                                session = std::move(*latest);
+                        } else {
+                                auto accountLock = lock_account();
+                                session          = olm::client()->create_outbound_session(
+                                  target.keys.curve25519, target.one_time_key);
+                        }
+
+                        auto encrypted = olm::client()
+                                           ->create_olm_encrypted_content(session.get(),
+                                                                          payload,
+                                                                          UserId(target.user_id),
+                                                                          target.keys.ed25519,
+                                                                          target.keys.curve25519)
+                                           .get<mtx::events::msg::OlmEncrypted>();
+
+                        nhlog::crypto()->debug("Updated olm session: {}",
+                                               mtx::crypto::session_id(session.get()));
+                        cache::saveOlmSession(target.keys.curve25519,
+                                              std::move(session),
+                                              QDateTime::currentMSecsSinceEpoch());
+                        return encrypted;
+                } catch (const lmdb::error &e) {
+                        nhlog::db()->critical("failed to save outbound olm session: {}", e.what());
+                } catch (const mtx::crypto::olm_exception &e) {
+                        nhlog::crypto()->critical(
+                          "failed to encrypt olm message for {}: {}", target.device_id, e.what());
+                }
+                return std::nullopt;
+        }
+};
+
+//! Send the encrypted messages in bounded chunks, without waiting for the previous chunk.
+void
+send_olm_messages(const std::vector<OlmTarget> &targets,
+                  const std::vector<EncryptForDevice::result_type> &encrypted)
+{
+        std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::OlmEncrypted>>
+          messages;
+        std::size_t count = 0;
+
+        auto send = [&messages, &count]() {
+                if (messages.empty())
+                        return;
+
+                http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
+                  http::client()->generate_txn_id(), messages, [](mtx::http::RequestErr err) {
+                          if (err) {
+                                  nhlog::net()->warn("failed to send "
+                                                     "send_to_device "
+                                                     "message: {}",
+                                                     err->matrix_error.error);
+                          }
+                  });
+
+                messages.clear();
+                count = 0;
+        };
+
+        for (std::size_t i = 0; i < targets.size(); i++) {
+                if (!encrypted[i])
+                        continue;
+
+                messages[mtx::identifiers::parse<mtx::identifiers::User>(targets[i].user_id)]
+                        [targets[i].device_id] = *encrypted[i];
+
+                if (++count >= MAX_DEVICES_PER_TO_DEVICE_REQUEST)
+                        send();
+        }
+        send();
+}
+
+//! Encrypt for all targets in parallel and send the messages. Returns the targets without an
+//! olm session, which need a one time key claimed first.
+std::vector<OlmTarget>
+encrypt_and_send(const std::vector<OlmTarget> &targets, const nlohmann::json &payload)
+{
+        if (targets.empty())
+                return {};
+
+        auto encrypted = QtConcurrent::blockingMapped<std::vector<EncryptForDevice::result_type>>(
+          targets.begin(), targets.end(), EncryptForDevice{payload});
+
+        send_olm_messages(targets, encrypted);
+
+        std::vector<OlmTarget> withoutSession;
+        for (std::size_t i = 0; i < targets.size(); i++)
+                if (!encrypted[i] && targets[i].one_time_key.empty())
+                        withoutSession.push_back(targets[i]);
+        return withoutSession;
+}
+
+//! Claim one time keys for the targets and send them the payload over new sessions.
+void
+claim_and_send(const std::vector<OlmTarget> &targets, const nlohmann::json &payload)
+{
+        if (targets.empty())
+                return;
+
+        mtx::requests::ClaimKeys claims;
+        for (const auto &target : targets)
+                claims.one_time_keys[target.user_id][target.device_id] =
+                  mtx::crypto::SIGNED_CURVE25519;
+
+        http::client()->claim_keys(
+          claims,
+          [targets, payload](const mtx::responses::ClaimKeys &res, mtx::http::RequestErr err) {
+                  if (err) {
+                          nhlog::net()->warn("failed to claim one time keys: {}",
+                                             err->matrix_error.error);
+                          return;
+                  }
+
+                  std::vector<OlmTarget> claimed;
+                  for (const auto &target : targets) {
+                          auto user = res.one_time_keys.find(target.user_id);
+                          if (user == res.one_time_keys.end())
+                                  continue;
+
+                          auto device = user->second.find(target.device_id);
+                          if (device == user->second.end() || device->second.empty() ||
+                              !device->second.begin()->contains("key")) {
+                                  nhlog::net()->warn("Skipping device {} as it has no key.",
+                                                     target.device_id);
+                                  continue;
+                          }
+
+                          // TODO: Verify signatures
+                          claimed.push_back(target);
+                          claimed.back().one_time_key =
+                            device->second.begin()->at("key").get<std::string>();
+                  }
+
+                  nhlog::net()->info("claimed keys for {} devices", claimed.size());
+
+                  // Don't block the network thread with the encryption.
+                  QtConcurrent::run([claimed = std::move(claimed), payload]() {
+                          encrypt_and_send(claimed, payload);
+                  });
+          });
+}
+}
+
 //! Send encrypted to device messages, targets is a map from userid to device ids or {} for all
 //! devices
 void
@@ -1076,10 +1516,7 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
         nlohmann::json ev_json = std::visit([](const auto &e) { return json(e); }, event);
 
         std::map<std::string, std::vector<std::string>> keysToQuery;
-        mtx::requests::ClaimKeys claims;
-        std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::OlmEncrypted>>
-          messages;
-        std::map<std::string, std::map<std::string, DevicePublicKeys>> pks;
+        std::vector<OlmTarget> knownDevices;
 
         for (const auto &[user, devices] : targets) {
                 auto deviceKeys = cache::client()->userKeys(user);
@@ -1105,7 +1542,7 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
                                 break;
                         }
 
-                        auto d = deviceKeys->device_keys.at(device);
+                        const auto &d = deviceKeys->device_keys.at(device);
 
                         if (!d.keys.count("curve25519:" + device) ||
                             !d.keys.count("ed25519:" + device)) {
@@ -1114,142 +1551,28 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
                                 continue;
                         }
 
-                        auto session =
-                          cache::getLatestOlmSession(d.keys.at("curve25519:" + device));
-                        if (!session || force_new_session) {
-                                claims.one_time_keys[user][device] = mtx::crypto::SIGNED_CURVE25519;
-                                pks[user][device].ed25519          = d.keys.at("ed25519:" + device);
-                                pks[user][device].curve25519 = d.keys.at("curve25519:" + device);
-                                continue;
-                        }
-
-                        messages[mtx::identifiers::parse<mtx::identifiers::User>(user)][device] =
-                          olm::client()
-                            ->create_olm_encrypted_content(session->get(),
-                                                           ev_json,
-                                                           UserId(user),
-                                                           d.keys.at("ed25519:" + device),
-                                                           d.keys.at("curve25519:" + device))
-                            .get<mtx::events::msg::OlmEncrypted>();
-
-                        try {
-                                nhlog::crypto()->debug("Updated olm session: {}",
-                                                       mtx::crypto::session_id(session->get()));
-                                cache::saveOlmSession(d.keys.at("curve25519:" + device),
-                                                      std::move(*session),
-                                                      QDateTime::currentMSecsSinceEpoch());
-                        } catch (const lmdb::error &e) {
-                                nhlog::db()->critical("failed to save outbound olm session: {}",
-                                                      e.what());
-                        } catch (const mtx::crypto::olm_exception &e) {
-                                nhlog::crypto()->critical(
-                                  "failed to pickle outbound olm session: {}", e.what());
-                        }
+                        OlmTarget target;
+                        target.user_id         = user;
+                        target.device_id       = device;
+                        target.keys.ed25519    = d.keys.at("ed25519:" + device);
+                        target.keys.curve25519 = d.keys.at("curve25519:" + device);
+                        knownDevices.push_back(std::move(target));
                 }
         }
 
-        if (!messages.empty())
-                http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
-                  http::client()->generate_txn_id(), messages, [](mtx::http::RequestErr err) {
-                          if (err) {
-                                  nhlog::net()->warn("failed to send "
-                                                     "send_to_device "
-                                                     "message: {}",
-                                                     err->matrix_error.error);
-                          }
-                  });
-
-        auto BindPks = [ev_json](decltype(pks) pks_temp) {
-                return [pks = pks_temp, ev_json](const mtx::responses::ClaimKeys &res,
-                                                 mtx::http::RequestErr) {
-                        std::map<mtx::identifiers::User,
-                                 std::map<std::string, mtx::events::msg::OlmEncrypted>>
-                          messages;
-                        for (const auto &[user_id, retrieved_devices] : res.one_time_keys) {
-                                nhlog::net()->debug("claimed keys for {}", user_id);
-                                if (retrieved_devices.size() == 0) {
-                                        nhlog::net()->debug(
-                                          "no one-time keys found for user_id: {}", user_id);
-                                        continue;
-                                }
-
-                                for (const auto &rd : retrieved_devices) {
-                                        const auto device_id = rd.first;
-
-                                        nhlog::net()->debug(
-                                          "{} : \n {}", device_id, rd.second.dump(2));
-
-                                        if (rd.second.empty() ||
-                                            !rd.second.begin()->contains("key")) {
-                                                nhlog::net()->warn(
-                                                  "Skipping device {} as it has no key.",
-                                                  device_id);
-                                                continue;
-                                        }
-
-                                        // TODO: Verify signatures
-                                        auto otk = rd.second.begin()->at("key");
-
-                                        auto id_key = pks.at(user_id).at(device_id).curve25519;
-                                        auto session =
-                                          olm::client()->create_outbound_session(id_key, otk);
-
-                                        messages[mtx::identifiers::parse<mtx::identifiers::User>(
-                                          user_id)][device_id] =
-                                          olm::client()
-                                            ->create_olm_encrypted_content(
-                                              session.get(),
-                                              ev_json,
-                                              UserId(user_id),
-                                              pks.at(user_id).at(device_id).ed25519,
-                                              id_key)
-                                            .get<mtx::events::msg::OlmEncrypted>();
-
-                                        try {
-                                                nhlog::crypto()->debug(
-                                                  "Updated olm session: {}",
-                                                  mtx::crypto::session_id(session.get()));
-                                                cache::saveOlmSession(
-                                                  id_key,
-                                                  std::move(session),
-                                                  QDateTime::currentMSecsSinceEpoch());
-                                        } catch (const lmdb::error &e) {
-                                                nhlog::db()->critical(
-                                                  "failed to save outbound olm session: {}",
-                                                  e.what());
-                                        } catch (const mtx::crypto::olm_exception &e) {
-                                                nhlog::crypto()->critical(
-                                                  "failed to pickle outbound olm session: {}",
-                                                  e.what());
-                                        }
-                                }
-                                nhlog::net()->info("send_to_device: {}", user_id);
-                        }
-
-                        if (!messages.empty())
-                                http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
-                                  http::client()->generate_txn_id(),
-                                  messages,
-                                  [](mtx::http::RequestErr err) {
-                                          if (err) {
-                                                  nhlog::net()->warn("failed to send "
-                                                                     "send_to_device "
-                                                                     "message: {}",
-                                                                     err->matrix_error.error);
-                                          }
-                                  });
-                };
-        };
-
-        http::client()->claim_keys(claims, BindPks(pks));
+        // Devices we already have a session with are encrypted for (in parallel) and sent to
+        // before returning, so that callers can rely on the message being sent before anything
+        // depending on it, like the megolm message using a room key we just shared. Only claiming
+        // keys for the remaining devices happens asynchronously.
+        claim_and_send(force_new_session ? knownDevices : encrypt_and_send(knownDevices, ev_json),
+                       ev_json);
 
         if (!keysToQuery.empty()) {
                 mtx::requests::QueryKeys req;
                 req.device_keys = keysToQuery;
                 http::client()->query_keys(
                   req,
-                  [ev_json, BindPks](const mtx::responses::QueryKeys &res,
-                                     mtx::http::RequestErr err) {
+                  [ev_json](const mtx::responses::QueryKeys &res, mtx::http::RequestErr err) {
                           if (err) {
                                   nhlog::net()->warn("failed to query device keys: {} {}",
                                                      err->matrix_error.error,
@@ -1261,9 +1584,7 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
 
                           cache::client()->updateUserKeys(cache::nextBatchToken(), res);
 
-                          mtx::requests::ClaimKeys claim_keys;
-
-                          std::map<std::string, std::map<std::string, DevicePublicKeys>> deviceKeys;
+                          std::vector<OlmTarget> newDevices;
 
                           for (const auto &user : res.device_keys) {
                                   for (const auto &dev : user.second) {
@@ -1311,9 +1632,11 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
                                                   continue;
                                           }
 
-                                          deviceKeys[user_id].emplace(device_id, pks);
-                                          claim_keys.one_time_keys[user.first][device_id] =
-                                            mtx::crypto::SIGNED_CURVE25519;
+                                          OlmTarget target;
+                                          target.user_id   = user.first;
+                                          target.device_id = device_id.get();
+                                          target.keys      = pks;
+                                          newDevices.push_back(std::move(target));
 
                                           nhlog::net()->info("{}", device_id.get());
                                           nhlog::net()->info("  curve25519 {}", pks.curve25519);
@@ -1321,7 +1644,7 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
                                   }
                           }
 
-                          http::client()->claim_keys(claim_keys, BindPks(deviceKeys));
+                          claim_and_send(newDevices, ev_json);
                   });
         }
 }
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <memory>
+#include <mutex>
 #include <mtx/events.hpp>
 #include <mtx/events/encrypted.hpp>
 #include <mtxclient/crypto/client.hpp>
@@ -51,6 +52,10 @@ from_json(const nlohmann::json &obj, OlmMessage &msg);
 mtx::crypto::OlmClient *
 client();
 
+//! Lock the olm account while changing it, since the olm workers use it as well.
+std::unique_lock<std::mutex>
+lock_account();
+
 void
 handle_to_device_messages(const std::vector<mtx::events::collections::DeviceEvents> &msgs);
 
@@ -89,11 +94,14 @@ calculate_trust(const std::string &user_id, const std::string &curve25519);
 void
 mark_keys_as_published();
 
-//! Request the encryption keys from sender's device for the given event.
+//! Request the keys for the session of the event from the sender's device and our own devices.
+//! Requests are persisted by session id, so a session is only requested again after a growing
+//! delay, even across rooms and restarts.
+void
+request_session_key(const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e);
+//! Cancel the request for the keys of a session, because we received them.
 void
-send_key_request_for(mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> e,
-                     const std::string &request_id,
-                     bool cancel = false);
+cancel_session_key_request(const std::string &session_id);
 
 void
 handle_key_request_message(const mtx::events::DeviceEvent<mtx::events::msg::KeyRequest> &);
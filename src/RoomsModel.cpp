@@ -4,6 +4,8 @@
 
 #include "RoomsModel.h"
 
+#include <algorithm>
+
 #include <QUrl>
 
 #include "Cache_p.h"
@@ -14,27 +16,11 @@ RoomsModel::RoomsModel(bool showOnlyRoomWithAliases, QObject *parent)
   : QAbstractListModel(parent)
   , showOnlyRoomWithAliases_(showOnlyRoomWithAliases)
 {
-        std::vector<std::string> rooms_ = cache::joinedRooms();
-        roomInfos                       = cache::getRoomInfo(rooms_);
-        if (!showOnlyRoomWithAliases_) {
-                roomids.reserve(rooms_.size());
-                roomAliases.reserve(rooms_.size());
-        }
-
-        for (const auto &r : rooms_) {
-                auto roomAliasesList = cache::client()->getRoomAliases(r);
+        rooms = cache::client()->roomDirectory();
 
-                if (showOnlyRoomWithAliases_) {
-                        if (roomAliasesList && !roomAliasesList->alias.empty()) {
-                                roomids.push_back(QString::fromStdString(r));
-                                roomAliases.push_back(
-                                  QString::fromStdString(roomAliasesList->alias));
-                        }
-                } else {
-                        roomids.push_back(QString::fromStdString(r));
-                        roomAliases.push_back(
-                          roomAliasesList ? QString::fromStdString(roomAliasesList->alias) : "");
-                }
+        if (showOnlyRoomWithAliases_) {
+                auto withoutAlias = [](const auto &room) { return room.second.alias.empty(); };
+                rooms.erase(std::remove_if(rooms.begin(), rooms.end(), withoutAlias), rooms.end());
         }
 }
 
@@ -54,30 +40,29 @@ QVariant
 RoomsModel::data(const QModelIndex &index, int role) const
 {
         if (hasIndex(index.row(), index.column(), index.parent())) {
+                const auto &[roomid, room] = rooms[index.row()];
                 switch (role) {
                 case CompletionModel::CompletionRole: {
+                        auto alias = QString::fromStdString(room.alias);
                         if (UserSettings::instance()->markdown()) {
-                                QString percentEncoding =
-                                  QUrl::toPercentEncoding(roomAliases[index.row()]);
+                                QString percentEncoding = QUrl::toPercentEncoding(alias);
                                 return QString("[%1](https://matrix.to/#/%2)")
-                                  .arg(roomAliases[index.row()], percentEncoding);
+                                  .arg(alias, percentEncoding);
                         } else {
-                                return roomAliases[index.row()];
+                                return alias;
                         }
                 }
                 case CompletionModel::SearchRole:
                 case Qt::DisplayRole:
                 case Roles::RoomAlias:
-                        return roomAliases[index.row()].toHtmlEscaped();
+                        return QString::fromStdString(room.alias).toHtmlEscaped();
                 case CompletionModel::SearchRole2:
                 case Roles::RoomName:
-                        return QString::fromStdString(roomInfos.at(roomids[index.row()]).name)
-                          .toHtmlEscaped();
+                        return QString::fromStdString(room.name).toHtmlEscaped();
                 case Roles::AvatarUrl:
-                        return QString::fromStdString(
-                          roomInfos.at(roomids[index.row()]).avatar_url);
+                        return QString::fromStdString(room.avatar_url);
                 case Roles::RoomID:
-                        return roomids[index.row()];
+                        return QString::fromStdString(roomid);
                 }
         }
         return {};
@@ -13,8 +13,10 @@
 #include <QLabel>
 #include <QLineEdit>
 #include <QMessageBox>
+#include <QFutureWatcher>
 #include <QPainter>
 #include <QProcessEnvironment>
+#include <QProgressDialog>
 #include <QPushButton>
 #include <QResizeEvent>
 #include <QScrollArea>
@@ -24,8 +26,10 @@
 #include <QStandardPaths>
 #include <QString>
 #include <QTextStream>
+#include <QtConcurrent>
 #include <QtQml>
 
+#include "AvatarProvider.h"
 #include "Cache.h"
 #include "CallDevices.h"
 #include "Config.h"
@@ -90,6 +94,7 @@ UserSettings::load(std::optional<QString> profile)
         decryptSidebar_       = settings.value("user/decrypt_sidebar", true).toBool();
         privacyScreen_        = settings.value("user/privacy_screen", false).toBool();
         privacyScreenTimeout_ = settings.value("user/privacy_screen_timeout", 0).toInt();
+        messageSearchIndex_   = settings.value("user/message_search_index", false).toBool();
         shareKeysWithTrustedUsers_ =
           settings.value("user/automatically_share_keys_with_trusted_users", false).toBool();
         mobileMode_        = settings.value("user/mobile_mode", false).toBool();
@@ -125,6 +130,7 @@ UserSettings::load(std::optional<QString> profile)
 
         disableCertificateValidation_ =
           settings.value("disable_certificate_validation", false).toBool();
+        avatarCacheBudget_ = settings.value("user/avatar_cache_budget", 20).toInt();
 
         applyTheme();
 }
@@ -412,6 +418,17 @@ UserSettings::setShareKeysWithTrustedUsers(bool shareKeys)
         save();
 }
 
+void
+UserSettings::setMessageSearchIndex(bool state)
+{
+        if (state == messageSearchIndex_)
+                return;
+
+        messageSearchIndex_ = state;
+        emit messageSearchIndexChanged(state);
+        save();
+}
+
 void
 UserSettings::setRingtone(QString ringtone)
 {
@@ -563,6 +580,17 @@ UserSettings::setDisableCertificateValidation(bool disabled)
         save();
 }
 
+void
+UserSettings::setAvatarCacheBudget(int mebibytes)
+{
+        if (mebibytes == avatarCacheBudget_)
+                return;
+        avatarCacheBudget_ = mebibytes;
+        AvatarProvider::setCacheBudget(mebibytes * 1024);
+        emit avatarCacheBudgetChanged(mebibytes);
+        save();
+}
+
 void
 UserSettings::applyTheme()
 {
@@ -607,11 +635,13 @@ UserSettings::save()
         settings.endGroup(); // timeline
 
         settings.setValue("avatar_circles", avatarCircles_);
+        settings.setValue("avatar_cache_budget", avatarCacheBudget_);
         settings.setValue("decrypt_sidebar", decryptSidebar_);
         settings.setValue("privacy_screen", privacyScreen_);
         settings.setValue("privacy_screen_timeout", privacyScreenTimeout_);
         settings.setValue("automatically_share_keys_with_trusted_users",
                           shareKeysWithTrustedUsers_);
+        settings.setValue("message_search_index", messageSearchIndex_);
         settings.setValue("mobile_mode", mobileMode_);
         settings.setValue("font_size", baseFontSize_);
         settings.setValue("typing_notifications", typingNotifications_);
@@ -709,6 +739,7 @@ UserSettingsPage::UserSettingsPage(QSharedPointer<UserSettings> settings, QWidge
         decryptSidebar_            = new Toggle(this);
         privacyScreen_             = new Toggle{this};
         shareKeysWithTrustedUsers_ = new Toggle(this);
+        messageSearchIndex_        = new Toggle{this};
         groupViewToggle_           = new Toggle{this};
         timelineButtonsToggle_     = new Toggle{this};
         typingNotifications_       = new Toggle{this};
@@ -739,6 +770,7 @@ UserSettingsPage::UserSettingsPage(QSharedPointer<UserSettings> settings, QWidge
         decryptSidebar_->setChecked(settings_->decryptSidebar());
         privacyScreen_->setChecked(settings_->privacyScreen());
         shareKeysWithTrustedUsers_->setChecked(settings_->shareKeysWithTrustedUsers());
+        messageSearchIndex_->setChecked(settings_->messageSearchIndex());
         groupViewToggle_->setChecked(settings_->groupView());
         timelineButtonsToggle_->setChecked(settings_->buttonsInTimeline());
         typingNotifications_->setChecked(settings_->typingNotifications());
@@ -1012,6 +1044,11 @@ UserSettingsPage::UserSettingsPage(QSharedPointer<UserSettings> settings, QWidge
           tr("Share keys with verified users and devices"),
           shareKeysWithTrustedUsers_,
           tr("Automatically replies to key requests from other users, if they are verified."));
+        boxWrap(tr("Search index for messages"),
+                messageSearchIndex_,
+                tr("Index new messages, so that they can be searched with Ctrl+F.
+The index is "
+                   "stored on this device. Turning this off deletes it."));
         formLayout_->addRow(new HorizontalLine{this});
         formLayout_->addRow(sessionKeysLabel, sessionKeysLayout);
         formLayout_->addRow(crossSigningKeysLabel, crossSigningKeysLayout);
@@ -1183,6 +1220,10 @@ UserSettingsPage::UserSettingsPage(QSharedPointer<UserSettings> settings, QWidge
                 settings_->setShareKeysWithTrustedUsers(enabled);
         });
 
+        connect(messageSearchIndex_, &Toggle::toggled, this, [this](bool enabled) {
+                settings_->setMessageSearchIndex(enabled);
+        });
+
         connect(avatarCircles_, &Toggle::toggled, this, [this](bool enabled) {
                 settings_->setAvatarCircles(enabled);
         });
@@ -1272,6 +1313,7 @@ UserSettingsPage::showEvent(QShowEvent *)
         decryptSidebar_->setState(settings_->decryptSidebar());
         privacyScreen_->setState(settings_->privacyScreen());
         shareKeysWithTrustedUsers_->setState(settings_->shareKeysWithTrustedUsers());
+        messageSearchIndex_->setState(settings_->messageSearchIndex());
         avatarCircles_->setState(settings_->avatarCircles());
         typingNotifications_->setState(settings_->typingNotifications());
         sortByImportance_->setState(settings_->sortByImportance());
@@ -1349,13 +1391,29 @@ UserSettingsPage::importSessionKeys()
                 return;
         }
 
-        try {
-                auto sessions =
-                  mtx::crypto::decrypt_exported_sessions(payload, password.toStdString());
-                cache::importSessionKeys(std::move(sessions));
-        } catch (const std::exception &e) {
-                QMessageBox::warning(this, tr("Error"), e.what());
-        }
+        auto progress = sessionKeysProgressDialog(tr("Importing session keys..."));
+
+        // Decrypting and importing large backups takes a while, keep the UI responsive.
+        auto watcher = new QFutureWatcher<QString>(this);
+        connect(watcher, &QFutureWatcher<QString>::finished, this, [this, watcher, progress]() {
+                progress->deleteLater();
+                watcher->deleteLater();
+
+                if (auto error = watcher->result(); !error.isEmpty())
+                        QMessageBox::warning(this, tr("Error"), error);
+        });
+        watcher->setFuture(QtConcurrent::run(
+          [payload, passphrase = password.toStdString(), progress]() -> QString {
+                  try {
+                          auto sessions =
+                            mtx::crypto::decrypt_exported_sessions(payload, passphrase);
+                          cache::importSessionKeys(sessions,
+                                                   sessionKeysProgressCallback(progress));
+                  } catch (const std::exception &e) {
+                          return QString::fromStdString(e.what());
+                  }
+                  return {};
+          }));
 }
 
 void
@@ -1382,28 +1440,65 @@ UserSettingsPage::exportSessionKeys()
         const QString fileName =
           QFileDialog::getSaveFileName(this, tr("File to save the exported session keys"), "", "");
 
-        QFile file(fileName);
-        if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
-                QMessageBox::warning(this, tr("Error"), file.errorString());
+        auto file = std::make_shared<QFile>(fileName);
+        if (!file->open(QIODevice::WriteOnly | QIODevice::Text)) {
+                QMessageBox::warning(this, tr("Error"), file->errorString());
                 return;
         }
 
+        auto progress = sessionKeysProgressDialog(tr("Exporting session keys..."));
+
+        auto watcher = new QFutureWatcher<QString>(this);
+        connect(watcher, &QFutureWatcher<QString>::finished, this, [this, watcher, progress]() {
+                progress->deleteLater();
+                watcher->deleteLater();
+
+                if (auto error = watcher->result(); !error.isEmpty())
+                        QMessageBox::warning(this, tr("Error"), error);
+        });
         // Export sessions & save to file.
-        try {
-                auto encrypted_blob = mtx::crypto::encrypt_exported_sessions(
-                  cache::exportSessionKeys(), password.toStdString());
-
-                QString b64 = QString::fromStdString(mtx::crypto::bin2base64(encrypted_blob));
-
-                QString prefix("-----BEGIN MEGOLM SESSION DATA-----");
-                QString suffix("-----END MEGOLM SESSION DATA-----");
-                QString newline("\n");
-                QTextStream out(&file);
-                out << prefix << newline << b64 << newline << suffix;
-                file.close();
-        } catch (const std::exception &e) {
-                QMessageBox::warning(this, tr("Error"), e.what());
-        }
+        watcher->setFuture(QtConcurrent::run(
+          [file, passphrase = password.toStdString(), progress]() -> QString {
+                  try {
+                          auto encrypted_blob = mtx::crypto::encrypt_exported_sessions(
+                            cache::exportSessionKeys(sessionKeysProgressCallback(progress)),
+                            passphrase);
+
+                          // Write the base64 directly, instead of converting it to a QString.
+                          file->write("-----BEGIN MEGOLM SESSION DATA-----\n");
+                          file->write(mtx::crypto::bin2base64(encrypted_blob).c_str());
+                          file->write("\n-----END MEGOLM SESSION DATA-----");
+                          file->close();
+                  } catch (const std::exception &e) {
+                          return QString::fromStdString(e.what());
+                  }
+                  return {};
+          }));
+}
+
+QProgressDialog *
+UserSettingsPage::sessionKeysProgressDialog(const QString &label)
+{
+        auto progress = new QProgressDialog(label, QString(), 0, 0, this);
+        progress->setWindowModality(Qt::WindowModal);
+        progress->setMinimumDuration(0);
+        progress->show();
+        return progress;
+}
+
+std::function<void(std::size_t, std::size_t)>
+UserSettingsPage::sessionKeysProgressCallback(QProgressDialog *progress)
+{
+        return [progress](std::size_t done, std::size_t total) {
+                // Called from a worker thread, the dialog lives on the main thread.
+                QMetaObject::invokeMethod(
+                  progress,
+                  [progress, done, total]() {
+                          progress->setMaximum(static_cast<int>(total));
+                          progress->setValue(static_cast<int>(done));
+                  },
+                  Qt::QueuedConnection);
+        };
 }
 
 void
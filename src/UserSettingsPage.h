@@ -11,6 +11,7 @@
 #include <QSharedPointer>
 #include <QWidget>
 
+#include <functional>
 #include <optional>
 
 class Toggle;
@@ -20,6 +21,7 @@ class QComboBox;
 class QFontComboBox;
 class QSpinBox;
 class QHBoxLayout;
+class QProgressDialog;
 class QVBoxLayout;
 
 constexpr int OptionMargin       = 6;
@@ -90,6 +92,8 @@ class UserSettings : public QObject
           bool useStunServer READ useStunServer WRITE setUseStunServer NOTIFY useStunServerChanged)
         Q_PROPERTY(bool shareKeysWithTrustedUsers READ shareKeysWithTrustedUsers WRITE
                      setShareKeysWithTrustedUsers NOTIFY shareKeysWithTrustedUsersChanged)
+        Q_PROPERTY(bool messageSearchIndex READ messageSearchIndex WRITE setMessageSearchIndex
+                     NOTIFY messageSearchIndexChanged)
         Q_PROPERTY(QString profile READ profile WRITE setProfile NOTIFY profileChanged)
         Q_PROPERTY(QString userId READ userId WRITE setUserId NOTIFY userIdChanged)
         Q_PROPERTY(
@@ -98,6 +102,8 @@ class UserSettings : public QObject
         Q_PROPERTY(QString homeserver READ homeserver WRITE setHomeserver NOTIFY homeserverChanged)
         Q_PROPERTY(bool disableCertificateValidation READ disableCertificateValidation WRITE
                      setDisableCertificateValidation NOTIFY disableCertificateValidationChanged)
+        Q_PROPERTY(int avatarCacheBudget READ avatarCacheBudget WRITE setAvatarCacheBudget NOTIFY
+                     avatarCacheBudgetChanged)
 
         UserSettings();
 
@@ -153,12 +159,14 @@ public:
         void setScreenShareHideCursor(bool state);
         void setUseStunServer(bool state);
         void setShareKeysWithTrustedUsers(bool state);
+        void setMessageSearchIndex(bool state);
         void setProfile(QString profile);
         void setUserId(QString userId);
         void setAccessToken(QString accessToken);
         void setDeviceId(QString deviceId);
         void setHomeserver(QString homeserver);
         void setDisableCertificateValidation(bool disabled);
+        void setAvatarCacheBudget(int mebibytes);
         void setHiddenTags(QStringList hiddenTags);
 
         QString theme() const { return !theme_.isEmpty() ? theme_ : defaultTheme_; }
@@ -208,12 +216,15 @@ public:
         bool screenShareHideCursor() const { return screenShareHideCursor_; }
         bool useStunServer() const { return useStunServer_; }
         bool shareKeysWithTrustedUsers() const { return shareKeysWithTrustedUsers_; }
+        bool messageSearchIndex() const { return messageSearchIndex_; }
         QString profile() const { return profile_; }
         QString userId() const { return userId_; }
         QString accessToken() const { return accessToken_; }
         QString deviceId() const { return deviceId_; }
         QString homeserver() const { return homeserver_; }
         bool disableCertificateValidation() const { return disableCertificateValidation_; }
+        //! Memory budget of the avatar cache in MiB.
+        int avatarCacheBudget() const { return avatarCacheBudget_; }
         QStringList hiddenTags() const { return hiddenTags_; }
 
 signals:
@@ -253,12 +264,14 @@ signals:
         void screenShareHideCursorChanged(bool state);
         void useStunServerChanged(bool state);
         void shareKeysWithTrustedUsersChanged(bool state);
+        void messageSearchIndexChanged(bool state);
         void profileChanged(QString profile);
         void userIdChanged(QString userId);
         void accessTokenChanged(QString accessToken);
         void deviceIdChanged(QString deviceId);
         void homeserverChanged(QString homeserver);
         void disableCertificateValidationChanged(bool disabled);
+        void avatarCacheBudgetChanged(int mebibytes);
 
 private:
         // Default to system theme if QT_QPA_PLATFORMTHEME var is set.
@@ -284,6 +297,7 @@ private:
         bool privacyScreen_;
         int privacyScreenTimeout_;
         bool shareKeysWithTrustedUsers_;
+        bool messageSearchIndex_;
         bool mobileMode_;
         int timelineMaxWidth_;
         int roomListWidth_;
@@ -303,6 +317,7 @@ private:
         bool screenShareHideCursor_;
         bool useStunServer_;
         bool disableCertificateValidation_ = false;
+        int avatarCacheBudget_             = 20;
         QString profile_;
         QString userId_;
         QString accessToken_;
@@ -346,6 +361,11 @@ private slots:
         void exportSessionKeys();
 
 private:
+        QProgressDialog *sessionKeysProgressDialog(const QString &label);
+        //! Updates the progress dialog from the thread importing or exporting the keys.
+        static std::function<void(std::size_t, std::size_t)> sessionKeysProgressCallback(
+          QProgressDialog *progress);
+
         // Layouts
         QVBoxLayout *topLayout_;
         QHBoxLayout *topBarLayout_;
@@ -372,6 +392,7 @@ private:
         Toggle *privacyScreen_;
         QSpinBox *privacyScreenTimeout_;
         Toggle *shareKeysWithTrustedUsers_;
+        Toggle *messageSearchIndex_;
         Toggle *mobileMode_;
         QLabel *deviceFingerprintValue_;
         QLabel *deviceIdValue_;
@@ -14,11 +14,96 @@ UsersModel::UsersModel(const std::string &roomId, QObject *parent)
   : QAbstractListModel(parent)
   , room_id(roomId)
 {
-        roomMembers_ = cache::roomMembers(roomId);
-        for (const auto &m : roomMembers_) {
-                displayNames.push_back(QString::fromStdString(cache::displayName(room_id, m)));
-                userids.push_back(QString::fromStdString(m));
+        // Read all members in one go, looking them up one by one is slow in large rooms.
+        auto members = cache::getMemberInfos(roomId);
+
+        roomMembers_.reserve(members.size());
+        displayNames.reserve(members.size());
+        userids.reserve(members.size());
+        avatarUrls.reserve(members.size());
+
+        for (auto &[user_id, info] : members) {
+                rows[user_id] = (int)roomMembers_.size();
+                displayNames.push_back(
+                  QString::fromStdString(info.name.empty() ? user_id : info.name));
+                userids.push_back(QString::fromStdString(user_id));
+                avatarUrls.push_back(QString::fromStdString(info.avatar_url));
+                roomMembers_.push_back(std::move(user_id));
+        }
+}
+
+void
+UsersModel::updateMember(const mtx::events::StateEvent<mtx::events::state::Member> &event)
+{
+        using mtx::events::state::Membership;
+
+        const auto &user_id = event.state_key;
+        auto row            = rows.find(user_id);
+
+        // Same as in the cache, we only keep users with invite or join membership.
+        if (event.content.membership != Membership::Join &&
+            event.content.membership != Membership::Invite) {
+                if (row == rows.end())
+                        return;
+
+                int idx = row->second;
+                beginRemoveRows(QModelIndex(), idx, idx);
+                roomMembers_.erase(roomMembers_.begin() + idx);
+                displayNames.erase(displayNames.begin() + idx);
+                userids.erase(userids.begin() + idx);
+                avatarUrls.erase(avatarUrls.begin() + idx);
+                rows.erase(row);
+                for (auto &[id, r] : rows) {
+                        (void)id;
+                        if (r > idx)
+                                r -= 1;
+                }
+                searchIndex_ = nullptr;
+                endRemoveRows();
+                return;
         }
+
+        auto displayName = QString::fromStdString(
+          event.content.display_name.empty() ? user_id : event.content.display_name);
+        auto avatarUrl = QString::fromStdString(event.content.avatar_url);
+
+        if (row == rows.end()) {
+                int idx = (int)roomMembers_.size();
+                beginInsertRows(QModelIndex(), idx, idx);
+                rows[user_id] = idx;
+                roomMembers_.push_back(user_id);
+                displayNames.push_back(std::move(displayName));
+                userids.push_back(QString::fromStdString(user_id));
+                avatarUrls.push_back(std::move(avatarUrl));
+                searchIndex_ = nullptr;
+                endInsertRows();
+        } else {
+                int idx = row->second;
+
+                // Completers only rebuild their index, if the searched names changed.
+                QVector<int> roles;
+                if (displayNames[idx] != displayName) {
+                        roles << CompletionModel::CompletionRole << CompletionModel::SearchRole
+                              << Qt::DisplayRole << Roles::DisplayName;
+                        searchIndex_ = nullptr;
+                }
+                if (avatarUrls[idx] != avatarUrl)
+                        roles << Roles::AvatarUrl;
+                if (roles.isEmpty())
+                        return;
+
+                displayNames[idx] = std::move(displayName);
+                avatarUrls[idx]   = std::move(avatarUrl);
+                emit dataChanged(index(idx), index(idx), roles);
+        }
+}
+
+std::shared_ptr<const CompletionProxyModel::SearchIndex>
+UsersModel::searchIndex()
+{
+        if (!searchIndex_)
+                searchIndex_ = CompletionProxyModel::buildSearchIndex(this);
+        return searchIndex_;
 }
 
 QHash<int, QByteArray>
@@ -53,8 +138,7 @@ UsersModel::data(const QModelIndex &index, int role) const
                 case CompletionModel::SearchRole2:
                         return userids[index.row()];
                 case Roles::AvatarUrl:
-                        return cache::avatarUrl(QString::fromStdString(room_id),
-                                                QString::fromStdString(roomMembers_[index.row()]));
+                        return avatarUrls[index.row()];
                 case Roles::UserID:
                         return userids[index.row()];
                 }
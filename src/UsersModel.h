@@ -6,6 +6,16 @@
 
 #include <QAbstractListModel>
 
+#include <memory>
+#include <unordered_map>
+
+#include <mtx/events.hpp>
+#include <mtx/events/member.hpp>
+
+#include "CompletionProxyModel.h"
+
+//! The members of a room. Loaded once and then updated from the member events in the sync, so
+//! that it can be kept around as long as the room is loaded.
 class UsersModel : public QAbstractListModel
 {
 public:
@@ -25,9 +35,19 @@ public:
         }
         QVariant data(const QModelIndex &index, int role) const override;
 
+        //! Adds, removes or updates the member the event is about.
+        void updateMember(const mtx::events::StateEvent<mtx::events::state::Member> &event);
+        //! The completion search index over the members, built on first use after a change and
+        //! shared by all completers of the room.
+        std::shared_ptr<const CompletionProxyModel::SearchIndex> searchIndex();
+
 private:
         std::string room_id;
         std::vector<std::string> roomMembers_;
         std::vector<QString> displayNames;
         std::vector<QString> userids;
+        std::vector<QString> avatarUrls;
+        //! user id to row
+        std::unordered_map<std::string, int> rows;
+        std::shared_ptr<const CompletionProxyModel::SearchIndex> searchIndex_;
 };
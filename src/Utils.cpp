@@ -824,21 +824,42 @@ utils::restoreCombobox(QComboBox *combo, const QString &value)
         }
 }
 
-QImage
-utils::readImageFromFile(const QString &filename)
+static QImage
+readScaledImage(QImageReader &reader, QSize targetSize)
 {
-        QImageReader reader(filename);
         reader.setAutoTransform(true);
+
+        // Let the reader decode at a lower resolution instead of allocating the full image just to
+        // scale it down afterwards. Formats like JPEG can do that natively.
+        if (targetSize.width() > 0 && targetSize.height() > 0) {
+                // The size is reported before the exif orientation is applied.
+                if (reader.transformation() & QImageIOHandler::TransformationRotate90)
+                        targetSize.transpose();
+
+                QSize size = reader.size();
+                if (size.isValid() &&
+                    (size.width() > targetSize.width() || size.height() > targetSize.height()))
+                        reader.setScaledSize(
+                          size.scaled(targetSize, Qt::KeepAspectRatioByExpanding)
+                            .boundedTo(size));
+        }
+
         return reader.read();
 }
+
+QImage
+utils::readImageFromFile(const QString &filename, const QSize &targetSize)
+{
+        QImageReader reader(filename);
+        return readScaledImage(reader, targetSize);
+}
 QImage
-utils::readImage(const QByteArray &data)
+utils::readImage(const QByteArray &data, const QSize &targetSize)
 {
         QBuffer buf;
         buf.setData(data);
         QImageReader reader(&buf);
-        reader.setAutoTransform(true);
-        return reader.read();
+        return readScaledImage(reader, targetSize);
 }
 
 bool
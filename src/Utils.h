@@ -319,13 +319,15 @@ centerWidget(QWidget *widget, QWidget *parent);
 void
 restoreCombobox(QComboBox *combo, const QString &value);
 
-//! Read image respecting exif orientation
+//! Read image respecting exif orientation. If a target size is given, images larger than that are
+//! decoded at a reduced resolution, which still covers the target size.
 QImage
-readImageFromFile(const QString &filename);
+readImageFromFile(const QString &filename, const QSize &targetSize = QSize());
 
-//! Read image respecting exif orientation
+//! Read image respecting exif orientation. If a target size is given, images larger than that are
+//! decoded at a reduced resolution, which still covers the target size.
 QImage
-readImage(const QByteArray &data);
+readImage(const QByteArray &data, const QSize &targetSize = QSize());
 
 bool
 isReply(const mtx::events::collections::TimelineEvents &e);
@@ -292,13 +292,8 @@ EventStore::receivedSessionKey(const std::string &session_id)
         if (!pending_key_requests.count(session_id))
                 return;
 
-        auto request = pending_key_requests.at(session_id);
-
-        // Don't request keys again until Nheko is restarted (for now)
-        pending_key_requests[session_id].events.clear();
-
-        if (!request.events.empty())
-                olm::send_key_request_for(request.events.front(), request.request_id, true);
+        auto request = std::move(pending_key_requests.at(session_id));
+        pending_key_requests.erase(session_id);
 
         for (const auto &e : request.events) {
                 auto idx = idToIndex(e.event_id);
@@ -681,17 +676,11 @@ EventStore::decryptEvent(const IdIndex &idx,
                         // TODO: Check if this actually works and look in key backup
                         auto copy    = e;
                         copy.room_id = room_id_;
-                        if (pending_key_requests.count(e.content.session_id)) {
-                                pending_key_requests.at(e.content.session_id)
-                                  .events.push_back(copy);
-                        } else {
-                                PendingKeyRequests request;
-                                request.request_id =
-                                  "key_request." + http::client()->generate_txn_id();
-                                request.events.push_back(copy);
-                                olm::send_key_request_for(copy, request.request_id);
-                                pending_key_requests[e.content.session_id] = request;
-                        }
+                        auto &request = pending_key_requests[e.content.session_id];
+                        // Duplicate and unanswered requests are filtered globally.
+                        if (request.events.empty())
+                                olm::request_session_key(copy);
+                        request.events.push_back(copy);
                         break;
                 }
                 case olm::DecryptionErrorCode::DbError:
@@ -809,6 +798,7 @@ EventStore::decryptEvent(const IdIndex &idx,
                 if (encInfo)
                         emit newEncryptedImage(encInfo.value());
 
+                cache::client()->indexDecryptedMessage(room_id_, temp_events[0]);
                 return asCacheEntry(std::move(temp_events[0]));
         }
 
@@ -816,6 +806,7 @@ EventStore::decryptEvent(const IdIndex &idx,
         if (encInfo)
                 emit newEncryptedImage(encInfo.value());
 
+        cache::client()->indexDecryptedMessage(room_id_, decryptionResult.event.value());
         return asCacheEntry(std::move(decryptionResult.event.value()));
 }
 
@@ -133,9 +133,9 @@ private:
         static QCache<Index, mtx::events::collections::TimelineEvents> events_;
         static QCache<IdIndex, mtx::events::collections::TimelineEvents> events_by_id_;
 
+        //! Events waiting for the keys of a session, to be refreshed once they arrive.
         struct PendingKeyRequests
         {
-                std::string request_id;
                 std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> events;
         };
         std::map<std::string, PendingKeyRequests> pending_key_requests;
@@ -4,6 +4,10 @@
 
 #include "RoomlistModel.h"
 
+#include <QTimer>
+
+#include <algorithm>
+
 #include "Cache_p.h"
 #include "ChatPage.h"
 #include "Logging.h"
@@ -13,6 +17,27 @@
 #include "TimelineViewManager.h"
 #include "UserSettingsPage.h"
 
+namespace {
+//! Loaded timelines, which weren't opened and had no live events for this long, are released.
+constexpr qint64 ROOM_IDLE_TIMEOUT_MS        = 10 * 60 * 1000;
+constexpr int RELEASE_IDLE_ROOMS_INTERVAL_MS = 60 * 1000;
+
+//! If the sync changes which spaces rooms are in.
+bool
+hasSpaceUpdates(const mtx::responses::JoinedRoom &room)
+{
+        auto isSpaceEvent = [](const auto &e) {
+                using namespace mtx::events;
+                return std::holds_alternative<StateEvent<state::space::Child>>(e) ||
+                       std::holds_alternative<StateEvent<state::space::Parent>>(e) ||
+                       std::holds_alternative<StateEvent<state::PowerLevels>>(e);
+        };
+        return std::any_of(room.state.events.begin(), room.state.events.end(), isSpaceEvent) ||
+               std::any_of(
+                 room.timeline.events.begin(), room.timeline.events.end(), isSpaceEvent);
+}
+}
+
 RoomlistModel::RoomlistModel(TimelineViewManager *parent)
   : QAbstractListModel(parent)
   , manager(parent)
@@ -21,6 +46,8 @@ RoomlistModel::RoomlistModel(TimelineViewManager *parent)
 
         connect(ChatPage::instance(), &ChatPage::decryptSidebarChanged, this, [this]() {
                 auto decrypt = ChatPage::instance()->userSettings()->decryptSidebar();
+                coalesceChanges = true;
+
                 QHash<QString, QSharedPointer<TimelineModel>>::iterator i;
                 for (i = models.begin(); i != models.end(); ++i) {
                         auto ptr = i.value();
@@ -30,8 +57,28 @@ RoomlistModel::RoomlistModel(TimelineViewManager *parent)
                                 ptr->updateLastMessage();
                         }
                 }
+
+                for (auto summary = summaries.begin(); summary != summaries.end(); ++summary) {
+                        if (models.contains(summary.key()))
+                                continue;
+
+                        summary->lastMessage = TimelineModel::lastMessageOf(summary.key(), decrypt);
+                        roomDataChanged(summary.key(),
+                                        {
+                                          Roles::LastMessage,
+                                          Roles::Time,
+                                          Roles::Timestamp,
+                                          Qt::DisplayRole,
+                                        });
+                }
+
+                flushRoomDataChanges();
         });
 
+        auto releaseTimer = new QTimer(this);
+        connect(releaseTimer, &QTimer::timeout, this, &RoomlistModel::releaseIdleRooms);
+        releaseTimer->start(RELEASE_IDLE_ROOMS_INTERVAL_MS);
+
         connect(this,
                 &RoomlistModel::totalUnreadMessageCountUpdated,
                 ChatPage::instance(),
@@ -86,11 +133,7 @@ RoomlistModel::data(const QModelIndex &index, int role) const
                 auto roomid = roomids.at(index.row());
 
                 if (role == Roles::ParentSpaces) {
-                        auto parents = cache::client()->getParentRoomIds(roomid.toStdString());
-                        QStringList list;
-                        for (const auto &t : parents)
-                                list.push_back(QString::fromStdString(t));
-                        return list;
+                        return parentSpaces.value(roomid);
                 } else if (role == Roles::RoomId) {
                         return roomid;
                 }
@@ -122,13 +165,39 @@ RoomlistModel::data(const QModelIndex &index, int role) const
                                 return room->isSpace();
                         case Roles::IsPreview:
                                 return false;
-                        case Roles::Tags: {
-                                auto info = cache::singleRoomInfo(roomid.toStdString());
-                                QStringList list;
-                                for (const auto &t : info.tags)
-                                        list.push_back(QString::fromStdString(t));
-                                return list;
+                        case Roles::Tags:
+                                return summaries.value(roomid).tags;
+                        default:
+                                return {};
                         }
+                } else if (summaries.contains(roomid)) {
+                        const auto &room = summaries[roomid];
+                        switch (role) {
+                        case Roles::AvatarUrl:
+                                return room.avatarUrl;
+                        case Roles::RoomName:
+                                return room.name;
+                        case Roles::LastMessage:
+                                return room.lastMessage.body;
+                        case Roles::Time:
+                                return room.lastMessage.descriptiveTime;
+                        case Roles::Timestamp:
+                                return QVariant(static_cast<quint64>(room.lastMessage.timestamp));
+                        case Roles::HasUnreadMessages:
+                                return this->roomReadStatus.count(roomid) &&
+                                       this->roomReadStatus.at(roomid);
+                        case Roles::HasLoudNotification:
+                                return false;
+                        case Roles::NotificationCount:
+                                return 0;
+                        case Roles::IsInvite:
+                                return false;
+                        case Roles::IsSpace:
+                                return room.isSpace;
+                        case Roles::IsPreview:
+                                return false;
+                        case Roles::Tags:
+                                return summaries.value(roomid).tags;
                         default:
                                 return {};
                         }
@@ -234,28 +303,106 @@ RoomlistModel::data(const QModelIndex &index, int role) const
 void
 RoomlistModel::updateReadStatus(const std::map<QString, bool> roomReadStatus_)
 {
-        std::vector<int> roomsToUpdate;
-        roomsToUpdate.resize(roomReadStatus_.size());
+        const bool alreadyCoalescing = coalesceChanges;
+        coalesceChanges              = true;
+
         for (const auto &[roomid, roomUnread] : roomReadStatus_) {
-                if (roomUnread != roomReadStatus[roomid]) {
-                        roomsToUpdate.push_back(this->roomidToIndex(roomid));
-                }
+                if (roomUnread != roomReadStatus[roomid])
+                        roomDataChanged(roomid, {Roles::HasUnreadMessages});
 
                 this->roomReadStatus[roomid] = roomUnread;
         }
 
-        for (auto idx : roomsToUpdate) {
-                emit dataChanged(index(idx),
-                                 index(idx),
-                                 {
-                                   Roles::HasUnreadMessages,
-                                 });
+        if (!alreadyCoalescing)
+                flushRoomDataChanges();
+}
+
+void
+RoomlistModel::roomDataChanged(const QString &room_id, const QVector<int> &roles)
+{
+        if (!coalesceChanges) {
+                auto idx = roomidToIndex(room_id);
+                if (idx != -1)
+                        emit dataChanged(index(idx), index(idx), roles);
+                return;
         }
+
+        changedRooms.insert(room_id);
+        for (auto role : roles)
+                changedRoles.insert(role);
 }
+
 void
-RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
+RoomlistModel::flushRoomDataChanges()
+{
+        coalesceChanges = false;
+
+        if (unreadCountChanged) {
+                unreadCountChanged = false;
+                emitTotalUnreadMessageCount();
+        }
+
+        if (changedRooms.isEmpty())
+                return;
+
+        QVector<int> roles;
+        roles.reserve(changedRoles.size());
+        for (auto role : qAsConst(changedRoles))
+                roles.push_back(role);
+        std::sort(roles.begin(), roles.end());
+
+        // Only the changed rows are announced, so that the proxy model only reorders and the views
+        // only update those. Neighbouring rows share one change.
+        std::vector<std::pair<int, int>> runs;
+        for (int i = 0; i < (int)roomids.size(); i++) {
+                if (!changedRooms.contains(roomids[i]))
+                        continue;
+
+                if (!runs.empty() && runs.back().second == i - 1)
+                        runs.back().second = i;
+                else
+                        runs.emplace_back(i, i);
+        }
+
+        changedRooms.clear();
+        changedRoles.clear();
+
+        for (const auto &[first, last] : runs)
+                emit dataChanged(index(first), index(last), roles);
+}
+
+void
+RoomlistModel::emitTotalUnreadMessageCount()
+{
+        int total_unread_msgs = 0;
+
+        for (const auto &room : qAsConst(models)) {
+                if (!room.isNull())
+                        total_unread_msgs += room->notificationCount();
+        }
+
+        emit totalUnreadMessageCountUpdated(total_unread_msgs);
+}
+RoomlistModel::RoomSummary
+RoomlistModel::summarize(const QString &room_id, const RoomInfo &info) const
 {
-        if (!models.contains(room_id)) {
+        RoomSummary summary;
+        summary.name        = QString::fromStdString(info.name);
+        summary.avatarUrl   = QString::fromStdString(info.avatar_url);
+        summary.isSpace     = info.is_space;
+        for (const auto &t : info.tags)
+                summary.tags.push_back(QString::fromStdString(t));
+        summary.lastMessage =
+          TimelineModel::lastMessageOf(room_id, UserSettings::instance()->decryptSidebar());
+        return summary;
+}
+
+void
+RoomlistModel::addRoom(const QString &room_id,
+                       const RoomInfo &info,
+                       bool suppressInsertNotification)
+{
+        if (!summaries.contains(room_id)) {
                 // ensure we get read status updates and are only connected once
                 connect(cache::client(),
                         &Cache::roomReadStatus,
@@ -263,77 +410,14 @@ RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
                         &RoomlistModel::updateReadStatus,
                         Qt::UniqueConnection);
 
-                QSharedPointer<TimelineModel> newRoom(new TimelineModel(manager, room_id));
-                newRoom->setDecryptDescription(
-                  ChatPage::instance()->userSettings()->decryptSidebar());
-
-                connect(newRoom.data(),
-                        &TimelineModel::newEncryptedImage,
-                        manager->imageProvider(),
-                        &MxcImageProvider::addEncryptionInfo);
-                connect(newRoom.data(),
-                        &TimelineModel::forwardToRoom,
-                        manager,
-                        &TimelineViewManager::forwardMessageToRoom);
-                connect(
-                  newRoom.data(), &TimelineModel::lastMessageChanged, this, [room_id, this]() {
-                          auto idx = this->roomidToIndex(room_id);
-                          emit dataChanged(index(idx),
-                                           index(idx),
-                                           {
-                                             Roles::HasLoudNotification,
-                                             Roles::LastMessage,
-                                             Roles::Timestamp,
-                                             Roles::NotificationCount,
-                                             Qt::DisplayRole,
-                                           });
-                  });
-                connect(
-                  newRoom.data(), &TimelineModel::roomAvatarUrlChanged, this, [room_id, this]() {
-                          auto idx = this->roomidToIndex(room_id);
-                          emit dataChanged(index(idx),
-                                           index(idx),
-                                           {
-                                             Roles::AvatarUrl,
-                                           });
-                  });
-                connect(newRoom.data(), &TimelineModel::roomNameChanged, this, [room_id, this]() {
-                        auto idx = this->roomidToIndex(room_id);
-                        emit dataChanged(index(idx),
-                                         index(idx),
-                                         {
-                                           Roles::RoomName,
-                                         });
-                });
-                connect(
-                  newRoom.data(), &TimelineModel::notificationsChanged, this, [room_id, this]() {
-                          auto idx = this->roomidToIndex(room_id);
-                          emit dataChanged(index(idx),
-                                           index(idx),
-                                           {
-                                             Roles::HasLoudNotification,
-                                             Roles::NotificationCount,
-                                             Qt::DisplayRole,
-                                           });
-
-                          int total_unread_msgs = 0;
-
-                          for (const auto &room : models) {
-                                  if (!room.isNull())
-                                          total_unread_msgs += room->notificationCount();
-                          }
-
-                          emit totalUnreadMessageCountUpdated(total_unread_msgs);
-                  });
-
-                newRoom->updateLastMessage();
+                auto summary = summarize(room_id, info);
 
                 std::vector<QString> previewsToAdd;
-                if (newRoom->isSpace()) {
+                if (summary.isSpace) {
                         auto childs = cache::client()->getChildRoomIds(room_id.toStdString());
                         for (const auto &c : childs) {
                                 auto id = QString::fromStdString(c);
-                                if (!(models.contains(id) || invites.contains(id) ||
+                                if (!(summaries.contains(id) || invites.contains(id) ||
                                       previewedRooms.contains(id))) {
                                         previewsToAdd.push_back(std::move(id));
                                 }
@@ -351,7 +435,7 @@ RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
                                         (int)(roomids.size() + previewsToAdd.size() -
                                               ((wasInvite || wasPreview) ? 1 : 0)));
 
-                models.insert(room_id, std::move(newRoom));
+                summaries.insert(room_id, std::move(summary));
                 if (wasInvite) {
                         auto idx = roomidToIndex(room_id);
                         invites.remove(room_id);
@@ -366,7 +450,7 @@ RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
 
                 if ((wasInvite || wasPreview) && currentRoomPreview_ &&
                     currentRoomPreview_->roomid() == room_id) {
-                        currentRoom_ = models.value(room_id);
+                        currentRoom_ = getRoomById(room_id);
                         currentRoomPreview_.reset();
                         emit currentRoomChanged();
                 }
@@ -382,6 +466,164 @@ RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
         }
 }
 
+void
+RoomlistModel::forgetRoom(const QString &room_id)
+{
+        summaries.remove(room_id);
+        models.remove(room_id);
+        pinnedRooms.remove(room_id);
+        lastRoomActivity.remove(room_id);
+}
+
+QSharedPointer<TimelineModel>
+RoomlistModel::getRoomById(QString id)
+{
+        return loadRoom(id);
+}
+
+void
+RoomlistModel::keepRoomLoaded(const QString &room_id, QObject *holder)
+{
+        if (!holder || !loadRoom(room_id))
+                return;
+
+        pinnedRooms[room_id].insert(holder);
+        connect(holder, &QObject::destroyed, this, [this, room_id, holder]() {
+                auto pins = pinnedRooms.find(room_id);
+                if (pins == pinnedRooms.end())
+                        return;
+
+                pins->remove(holder);
+                if (pins->isEmpty())
+                        pinnedRooms.erase(pins);
+        });
+}
+
+void
+RoomlistModel::receivedSessionKeys(const QString &room_id,
+                                   const std::vector<std::string> &session_ids)
+{
+        auto summary = summaries.find(room_id);
+        if (summary == summaries.end() || models.contains(room_id) ||
+            summary->lastMessage.event_id.isEmpty() ||
+            !ChatPage::instance()->userSettings()->decryptSidebar())
+                return;
+
+        auto event = cache::client()->getEvent(room_id.toStdString(),
+                                               summary->lastMessage.event_id.toStdString());
+        if (!event)
+                return;
+
+        auto encrypted =
+          std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(&event->data);
+        if (!encrypted || std::find(session_ids.begin(),
+                                    session_ids.end(),
+                                    encrypted->content.session_id) == session_ids.end())
+                return;
+
+        summary->lastMessage = TimelineModel::lastMessageOf(room_id, true);
+        roomDataChanged(room_id,
+                        {
+                          Roles::LastMessage,
+                          Roles::Time,
+                          Roles::Timestamp,
+                          Qt::DisplayRole,
+                        });
+}
+
+QSharedPointer<TimelineModel>
+RoomlistModel::loadRoom(const QString &room_id)
+{
+        if (!summaries.contains(room_id))
+                return {};
+
+        lastRoomActivity[room_id] = QDateTime::currentMSecsSinceEpoch();
+
+        if (auto room = models.value(room_id))
+                return room;
+
+        QSharedPointer<TimelineModel> newRoom(new TimelineModel(manager, room_id));
+        newRoom->setDecryptDescription(ChatPage::instance()->userSettings()->decryptSidebar());
+
+        connect(newRoom.data(),
+                &TimelineModel::newEncryptedImage,
+                manager->imageProvider(),
+                &MxcImageProvider::addEncryptionInfo);
+        connect(newRoom.data(),
+                &TimelineModel::forwardToRoom,
+                manager,
+                &TimelineViewManager::forwardMessageToRoom);
+        connect(newRoom.data(), &TimelineModel::lastMessageChanged, this, [room_id, this]() {
+                roomDataChanged(room_id,
+                                {
+                                  Roles::HasLoudNotification,
+                                  Roles::LastMessage,
+                                  Roles::Timestamp,
+                                  Roles::NotificationCount,
+                                  Qt::DisplayRole,
+                                });
+        });
+        connect(newRoom.data(), &TimelineModel::roomAvatarUrlChanged, this, [room_id, this]() {
+                roomDataChanged(room_id,
+                                {
+                                  Roles::AvatarUrl,
+                                });
+        });
+        connect(newRoom.data(), &TimelineModel::roomNameChanged, this, [room_id, this]() {
+                roomDataChanged(room_id,
+                                {
+                                  Roles::RoomName,
+                                });
+        });
+        connect(newRoom.data(), &TimelineModel::notificationsChanged, this, [room_id, this]() {
+                roomDataChanged(room_id,
+                                {
+                                  Roles::HasLoudNotification,
+                                  Roles::NotificationCount,
+                                  Qt::DisplayRole,
+                                });
+
+                if (coalesceChanges)
+                        unreadCountChanged = true;
+                else
+                        emitTotalUnreadMessageCount();
+        });
+
+        newRoom->updateLastMessage();
+
+        models.insert(room_id, newRoom);
+        return newRoom;
+}
+
+void
+RoomlistModel::releaseIdleRooms()
+{
+        const auto now = QDateTime::currentMSecsSinceEpoch();
+
+        for (auto it = models.begin(); it != models.end();) {
+                const auto room_id = it.key();
+                auto room          = it.value();
+
+                // Unread counts are only sent on changes, so we would lose them.
+                if (pinnedRooms.contains(room_id) || room == currentRoom_ ||
+                    room->notificationCount() > 0 || room->hasMentions() ||
+                    now - lastRoomActivity.value(room_id) < ROOM_IDLE_TIMEOUT_MS) {
+                        ++it;
+                        continue;
+                }
+
+                auto &summary       = summaries[room_id];
+                summary.name        = room->plainRoomName();
+                summary.avatarUrl   = room->roomAvatarUrl();
+                summary.isSpace     = room->isSpace();
+                summary.lastMessage = room->lastMessage();
+
+                nhlog::ui()->debug("Releasing idle timeline of {}", room_id.toStdString());
+                lastRoomActivity.remove(room_id);
+                it = models.erase(it);
+        }
+}
+
 void
 RoomlistModel::fetchPreview(QString roomid_) const
 {
@@ -444,12 +686,37 @@ RoomlistModel::fetchPreview(QString roomid_) const
 void
 RoomlistModel::sync(const mtx::responses::Rooms &rooms)
 {
+        bool spacesChanged = !rooms.leave.empty();
+
+        // Changes to rooms, that stay in the list, are collected and published once at the end,
+        // so that the room list is only resorted once per sync.
+        coalesceChanges = true;
+
         for (const auto &[room_id, room] : rooms.join) {
                 auto qroomid = QString::fromStdString(room_id);
 
                 // addRoom will only add the room, if it doesn't exist
-                addRoom(qroomid);
-                const auto &room_model = models.value(qroomid);
+                if (!summaries.contains(qroomid)) {
+                        addRoom(qroomid, cache::singleRoomInfo(room_id));
+                        spacesChanged = true;
+                } else {
+                        spacesChanged = spacesChanged || hasSpaceUpdates(room);
+                }
+
+                for (const auto &evt : room.account_data.events) {
+                        if (auto tags = std::get_if<mtx::events::AccountDataEvent<
+                              mtx::events::account_data::Tags>>(&evt)) {
+                                QStringList list;
+                                for (const auto &tag : tags->content.tags)
+                                        list.push_back(QString::fromStdString(tag.first));
+                                summaries[qroomid].tags = std::move(list);
+
+                                roomDataChanged(qroomid, {Roles::Tags});
+                        }
+                }
+
+                // live events need the timeline, even if the room isn't open
+                const auto room_model = loadRoom(qroomid);
                 room_model->sync(room);
                 // room_model->addEvents(room.timeline);
                 connect(room_model.data(),
@@ -488,8 +755,8 @@ RoomlistModel::sync(const mtx::responses::Rooms &rooms)
                 if (idx != -1) {
                         beginRemoveRows(QModelIndex(), idx, idx);
                         roomids.erase(roomids.begin() + idx);
-                        if (models.contains(qroomid))
-                                models.remove(qroomid);
+                        if (summaries.contains(qroomid))
+                                forgetRoom(qroomid);
                         else if (invites.contains(qroomid))
                                 invites.remove(qroomid);
                         endRemoveRows();
@@ -515,6 +782,30 @@ RoomlistModel::sync(const mtx::responses::Rooms &rooms)
                         endInsertRows();
                 }
         }
+
+        if (spacesChanged)
+                updateParentSpaces();
+
+        flushRoomDataChanges();
+}
+
+void
+RoomlistModel::updateParentSpaces()
+{
+        QHash<QString, QStringList> parents;
+        for (const auto &[room_id, spaces] : cache::client()->getAllParentRoomIds()) {
+                QStringList list;
+                for (const auto &space : spaces)
+                        list.push_back(QString::fromStdString(space));
+                parents.insert(QString::fromStdString(room_id), std::move(list));
+        }
+
+        std::swap(parents, parentSpaces);
+
+        for (int i = 0; i < (int)roomids.size(); i++) {
+                if (parents.value(roomids[i]) != parentSpaces.value(roomids[i]))
+                        emit dataChanged(index(i), index(i), {Roles::ParentSpaces});
+        }
 }
 
 void
@@ -522,6 +813,9 @@ RoomlistModel::initializeRooms()
 {
         beginResetModel();
         models.clear();
+        summaries.clear();
+        pinnedRooms.clear();
+        lastRoomActivity.clear();
         roomids.clear();
         invites.clear();
         currentRoom_ = nullptr;
@@ -530,10 +824,21 @@ RoomlistModel::initializeRooms()
         for (const auto &id : invites.keys())
                 roomids.push_back(id);
 
-        for (const auto &id : cache::client()->roomIds())
-                addRoom(id, true);
+        // Only summaries are created here, timelines are loaded once a room is used.
+        auto ids = cache::client()->roomIds();
+        std::vector<std::string> stdIds;
+        for (const auto &id : ids)
+                stdIds.push_back(id.toStdString());
+        auto infos = cache::getRoomInfo(stdIds);
+
+        for (const auto &id : ids) {
+                auto info = infos.find(id);
+                addRoom(id, info != infos.end() ? info->second : RoomInfo{}, true);
+        }
 
         endResetModel();
+
+        updateParentSpaces();
 }
 
 void
@@ -541,6 +846,10 @@ RoomlistModel::clear()
 {
         beginResetModel();
         models.clear();
+        summaries.clear();
+        parentSpaces.clear();
+        pinnedRooms.clear();
+        lastRoomActivity.clear();
         invites.clear();
         roomids.clear();
         currentRoom_ = nullptr;
@@ -587,13 +896,13 @@ RoomlistModel::declineInvite(QString roomid)
 void
 RoomlistModel::leave(QString roomid)
 {
-        if (models.contains(roomid)) {
+        if (summaries.contains(roomid)) {
                 auto idx = roomidToIndex(roomid);
 
                 if (idx != -1) {
                         beginRemoveRows(QModelIndex(), idx, idx);
                         roomids.erase(roomids.begin() + idx);
-                        models.remove(roomid);
+                        forgetRoom(roomid);
                         endRemoveRows();
                         ChatPage::instance()->leaveRoom(roomid);
                 }
@@ -608,8 +917,8 @@ RoomlistModel::setCurrentRoom(QString roomid)
                 return;
 
         nhlog::ui()->debug("Trying to switch to: {}", roomid.toStdString());
-        if (models.contains(roomid)) {
-                currentRoom_ = models.value(roomid);
+        if (summaries.contains(roomid)) {
+                currentRoom_ = getRoomById(roomid);
                 currentRoomPreview_.reset();
                 emit currentRoomChanged();
                 nhlog::ui()->debug("Switched to: {}", roomid.toStdString());
@@ -688,36 +997,66 @@ FilteredRoomlistModel::calculateImportance(const QModelIndex &idx) const
 bool
 FilteredRoomlistModel::lessThan(const QModelIndex &left, const QModelIndex &right) const
 {
-        QModelIndex const left_idx  = sourceModel()->index(left.row(), 0, QModelIndex());
-        QModelIndex const right_idx = sourceModel()->index(right.row(), 0, QModelIndex());
-
         // Sort by "importance" (i.e. invites before mentions before
         // notifs before new events before old events), then secondly
         // by recency.
+        const auto a = sortKey(left.row());
+        const auto b = sortKey(right.row());
 
         // Checking importance first
-        const auto a_importance = calculateImportance(left_idx);
-        const auto b_importance = calculateImportance(right_idx);
-        if (a_importance != b_importance) {
-                return a_importance > b_importance;
+        if (a.importance != b.importance) {
+                return a.importance > b.importance;
         }
 
         // Now sort by recency
         // Zero if empty, otherwise the time that the event occured
-        uint64_t a_recency = sourceModel()->data(left_idx, RoomlistModel::Timestamp).toULongLong();
-        uint64_t b_recency = sourceModel()->data(right_idx, RoomlistModel::Timestamp).toULongLong();
-
-        if (a_recency != b_recency)
-                return a_recency > b_recency;
+        if (a.recency != b.recency)
+                return a.recency > b.recency;
         else
                 return left.row() < right.row();
 }
 
+FilteredRoomlistModel::SortKey
+FilteredRoomlistModel::sortKey(int sourceRow) const
+{
+        if (sortKeys.size() <= (size_t)sourceRow)
+                sortKeys.resize(sourceModel()->rowCount());
+
+        auto &key = sortKeys.at(sourceRow);
+        if (!key) {
+                QModelIndex const idx = sourceModel()->index(sourceRow, 0, QModelIndex());
+                key = SortKey{calculateImportance(idx),
+                              sourceModel()->data(idx, RoomlistModel::Timestamp).toULongLong()};
+        }
+        return *key;
+}
+
+void
+FilteredRoomlistModel::invalidateSortKeys(int first, int last)
+{
+        for (int i = first; i <= last && i < (int)sortKeys.size(); i++)
+                sortKeys[i].reset();
+}
+
 FilteredRoomlistModel::FilteredRoomlistModel(RoomlistModel *model, QObject *parent)
   : QSortFilterProxyModel(parent)
   , roomlistmodel(model)
 {
         this->sortByImportance = UserSettings::instance()->sortByImportance();
+
+        // These need to be connected before setting the source model, so that the cached sort keys
+        // are already invalidated, when the proxy model reorders the changed rows.
+        connect(model,
+                &QAbstractItemModel::dataChanged,
+                this,
+                [this](const QModelIndex &topLeft, const QModelIndex &bottomRight) {
+                        invalidateSortKeys(topLeft.row(), bottomRight.row());
+                });
+        connect(model, &QAbstractItemModel::rowsInserted, this, [this]() { sortKeys.clear(); });
+        connect(model, &QAbstractItemModel::rowsRemoved, this, [this]() { sortKeys.clear(); });
+        connect(model, &QAbstractItemModel::modelReset, this, [this]() { sortKeys.clear(); });
+        connect(model, &QAbstractItemModel::layoutChanged, this, [this]() { sortKeys.clear(); });
+
         setSourceModel(model);
         setDynamicSortFilter(true);
 
@@ -726,6 +1065,7 @@ FilteredRoomlistModel::FilteredRoomlistModel(RoomlistModel *model, QObject *pare
                          this,
                          [this](bool sortByImportance_) {
                                  this->sortByImportance = sortByImportance_;
+                                 sortKeys.clear();
                                  invalidate();
                          });
 
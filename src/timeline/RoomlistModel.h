@@ -7,9 +7,12 @@
 #include <CacheStructs.h>
 #include <QAbstractListModel>
 #include <QHash>
+#include <QSet>
 #include <QSharedPointer>
 #include <QSortFilterProxyModel>
 #include <QString>
+#include <QVector>
+#include <optional>
 #include <set>
 
 #include <mtx/responses/sync.hpp>
@@ -75,12 +78,19 @@ public:
                 return (int)roomids.size();
         }
         QVariant data(const QModelIndex &index, int role) const override;
-        QSharedPointer<TimelineModel> getRoomById(QString id) const
+        //! Returns the timeline of a joined room, loading it if necessary. Idle timelines are
+        //! released again, use keepRoomLoaded to hold on to a raw pointer for longer.
+        QSharedPointer<TimelineModel> getRoomById(QString id);
+        //! Keeps the timeline of a room loaded, until the holder is destroyed.
+        void keepRoomLoaded(const QString &room_id, QObject *holder);
+        //! Refreshes the last message of a room without a loaded timeline, if it is encrypted
+        //! with one of the sessions.
+        void receivedSessionKeys(const QString &room_id,
+                                 const std::vector<std::string> &session_ids);
+        //! Returns the timeline of a joined room, but only if it is already loaded.
+        QSharedPointer<TimelineModel> getLoadedRoomById(QString id) const
         {
-                if (models.contains(id))
-                        return models.value(id);
-                else
-                        return {};
+                return models.value(id);
         }
 
 public slots:
@@ -115,6 +125,7 @@ public slots:
 
 private slots:
         void updateReadStatus(const std::map<QString, bool> roomReadStatus_);
+        void releaseIdleRooms();
 
 signals:
         void totalUnreadMessageCountUpdated(int unreadMessages);
@@ -122,16 +133,50 @@ signals:
         void fetchedPreview(QString roomid, RoomInfo info);
 
 private:
-        void addRoom(const QString &room_id, bool suppressInsertNotification = false);
+        //! What the room list shows for a joined room, as long as its timeline isn't loaded.
+        struct RoomSummary
+        {
+                QString name, avatarUrl;
+                DescInfo lastMessage{};
+                bool isSpace = false;
+                QStringList tags;
+        };
+
+        void addRoom(const QString &room_id,
+                     const RoomInfo &info,
+                     bool suppressInsertNotification = false);
+        QSharedPointer<TimelineModel> loadRoom(const QString &room_id);
+        void forgetRoom(const QString &room_id);
+        RoomSummary summarize(const QString &room_id, const RoomInfo &info) const;
+        void updateParentSpaces();
         void fetchPreview(QString roomid) const;
+        //! Emits dataChanged for a room or, while coalescing, remembers the change for later.
+        void roomDataChanged(const QString &room_id, const QVector<int> &roles);
+        //! Publishes the collected changes, one dataChanged per run of neighbouring changed rows.
+        void flushRoomDataChanges();
+        void emitTotalUnreadMessageCount();
 
         TimelineViewManager *manager = nullptr;
         std::vector<QString> roomids;
         QHash<QString, RoomInfo> invites;
+        //! Every joined room has a summary, only some of them have a loaded timeline.
+        QHash<QString, RoomSummary> summaries;
+        //! Room id to the spaces it is in, kept in memory for filtering.
+        QHash<QString, QStringList> parentSpaces;
         QHash<QString, QSharedPointer<TimelineModel>> models;
+        //! Timelines, which are referenced elsewhere, to the objects referencing them.
+        QHash<QString, QSet<QObject *>> pinnedRooms;
+        //! When a loaded timeline was last used, to release idle ones again.
+        QHash<QString, qint64> lastRoomActivity;
         std::map<QString, bool> roomReadStatus;
         QHash<QString, std::optional<RoomInfo>> previewedRooms;
 
+        //! Set while a batch of changes (i.e. a sync) is applied.
+        bool coalesceChanges    = false;
+        bool unreadCountChanged = false;
+        QSet<QString> changedRooms;
+        QSet<int> changedRoles;
+
         QSharedPointer<TimelineModel> currentRoom_;
         std::optional<RoomPreview> currentRoomPreview_;
 
@@ -186,6 +231,8 @@ public slots:
                         filterStr.clear();
                 }
 
+                // the importance of spaces depends on the current filter
+                sortKeys.clear();
                 invalidateFilter();
         }
 
@@ -195,7 +242,18 @@ signals:
         void currentRoomChanged();
 
 private:
+        //! What the rooms are ordered by, cached per source row.
+        struct SortKey
+        {
+                short int importance = 0;
+                uint64_t recency     = 0;
+        };
+
         short int calculateImportance(const QModelIndex &idx) const;
+        SortKey sortKey(int sourceRow) const;
+        void invalidateSortKeys(int first, int last);
+
+        mutable std::vector<std::optional<SortKey>> sortKeys;
         RoomlistModel *roomlistmodel;
         bool sortByImportance = true;
 
@@ -11,6 +11,7 @@
 #include <QCache>
 #include <QClipboard>
 #include <QDesktopServices>
+#include <QElapsedTimer>
 #include <QFileDialog>
 #include <QGuiApplication>
 #include <QMimeDatabase>
@@ -29,6 +30,7 @@
 #include "MxcImageProvider.h"
 #include "Olm.h"
 #include "TimelineViewManager.h"
+#include "UsersModel.h"
 #include "Utils.h"
 #include "dialogs/RawMessage.h"
 
@@ -780,6 +782,14 @@ TimelineModel::sync(const mtx::responses::JoinedRoom &room)
         }
 }
 
+UsersModel *
+TimelineModel::usersModel()
+{
+        if (!usersModel_)
+                usersModel_ = new UsersModel(room_id_.toStdString(), this);
+        return usersModel_;
+}
+
 void
 TimelineModel::syncState(const mtx::responses::State &s)
 {
@@ -795,7 +805,9 @@ TimelineModel::syncState(const mtx::responses::State &s)
                 else if (std::holds_alternative<StateEvent<state::Topic>>(e)) {
                         permissions_.invalidate();
                         emit permissionsChanged();
-                } else if (std::holds_alternative<StateEvent<state::Member>>(e)) {
+                } else if (auto member = std::get_if<StateEvent<state::Member>>(&e)) {
+                        if (usersModel_)
+                                usersModel_->updateMember(*member);
                         emit roomAvatarUrlChanged();
                         emit roomNameChanged();
                         emit roomMemberCountChanged();
@@ -855,7 +867,9 @@ TimelineModel::addEvents(const mtx::responses::Timeline &timeline)
                 else if (std::holds_alternative<StateEvent<state::PowerLevels>>(e)) {
                         permissions_.invalidate();
                         emit permissionsChanged();
-                } else if (std::holds_alternative<StateEvent<state::Member>>(e)) {
+                } else if (auto member = std::get_if<StateEvent<state::Member>>(&e)) {
+                        if (usersModel_)
+                                usersModel_->updateMember(*member);
                         emit roomAvatarUrlChanged();
                         emit roomNameChanged();
                         emit roomMemberCountChanged();
@@ -920,44 +934,57 @@ isYourJoin(const mtx::events::Event<T> &)
         return false;
 }
 
-void
-TimelineModel::updateLastMessage()
+//! Description of the newest message in the store, if there is any.
+static std::optional<DescInfo>
+lastMessageIn(EventStore &events, const QString &room_id, bool decrypt)
 {
         for (auto it = events.size() - 1; it >= 0; --it) {
-                auto event = events.get(it, decryptDescription);
+                auto event = events.get(it, decrypt);
                 if (!event)
                         continue;
 
                 if (std::visit([](const auto &e) -> bool { return isYourJoin(e); }, *event)) {
                         auto time   = mtx::accessors::origin_server_ts(*event);
                         uint64_t ts = time.toMSecsSinceEpoch();
-                        auto description =
-                          DescInfo{QString::fromStdString(mtx::accessors::event_id(*event)),
-                                   QString::fromStdString(http::client()->user_id().to_string()),
-                                   tr("You joined this room."),
-                                   utils::descriptiveTime(time),
-                                   ts,
-                                   time};
-                        if (description != lastMessage_) {
-                                lastMessage_ = description;
-                                emit lastMessageChanged();
-                        }
-                        return;
+                        return DescInfo{
+                          QString::fromStdString(mtx::accessors::event_id(*event)),
+                          QString::fromStdString(http::client()->user_id().to_string()),
+                          TimelineModel::tr("You joined this room."),
+                          utils::descriptiveTime(time),
+                          ts,
+                          time};
                 }
                 if (!std::visit([](const auto &e) -> bool { return isMessage(e); }, *event))
                         continue;
 
-                auto description = utils::getMessageDescription(
+                return utils::getMessageDescription(
                   *event,
                   QString::fromStdString(http::client()->user_id().to_string()),
-                  cache::displayName(room_id_,
+                  cache::displayName(room_id,
                                      QString::fromStdString(mtx::accessors::sender(*event))));
-                if (description != lastMessage_) {
-                        lastMessage_ = description;
-                        emit lastMessageChanged();
-                }
-                return;
         }
+
+        return std::nullopt;
+}
+
+void
+TimelineModel::updateLastMessage()
+{
+        auto description = lastMessageIn(events, room_id_, decryptDescription);
+        if (description && *description != lastMessage_) {
+                lastMessage_ = *description;
+                emit lastMessageChanged();
+        }
+}
+
+DescInfo
+TimelineModel::lastMessageOf(const QString &room_id, bool decrypt)
+{
+        EventStore events(room_id.toStdString(), nullptr);
+
+        DescInfo description{};
+        description.timestamp = 0;
+        return lastMessageIn(events, room_id, decrypt).value_or(description);
 }
 
 void
@@ -1544,6 +1571,29 @@ TimelineModel::scrollTimerEvent()
         }
 }
 
+QStringList
+TimelineModel::searchMessages(QString query) const
+{
+        QStringList ids;
+        if (query.trimmed().isEmpty())
+                return ids;
+
+        QElapsedTimer timer;
+        timer.start();
+
+        auto results =
+          cache::client()->searchMessages(query.toStdString(), room_id_.toStdString(), 50);
+
+        nhlog::ui()->debug("searching messages in {} took {}ms, {} results",
+                           room_id_.toStdString(),
+                           timer.elapsed(),
+                           results.size());
+
+        for (const auto &result : results)
+                ids.push_back(QString::fromStdString(result.event_id));
+        return ids;
+}
+
 void
 TimelineModel::copyLinkToEvent(QString eventId) const
 {
@@ -32,6 +32,7 @@ struct Messages;
 struct ClaimKeys;
 }
 struct RelatedInfo;
+class UsersModel;
 
 namespace qml_mtx_events {
 Q_NAMESPACE
@@ -250,6 +251,9 @@ public:
         Q_INVOKABLE bool saveMedia(QString eventId) const;
         Q_INVOKABLE void showEvent(QString eventId);
         Q_INVOKABLE void copyLinkToEvent(QString eventId) const;
+        //! Event ids of the newest messages of the room matching the query. Empty, if the message
+        //! search index is disabled.
+        Q_INVOKABLE QStringList searchMessages(QString query) const;
         void cacheMedia(QString eventId, std::function<void(const QString filename)> callback);
         Q_INVOKABLE void sendReset()
         {
@@ -267,6 +271,8 @@ public:
         }
 
         void updateLastMessage();
+        //! The last message of a room, without loading a timeline for it.
+        static DescInfo lastMessageOf(const QString &room_id, bool decrypt);
         void sync(const mtx::responses::JoinedRoom &room);
         void addEvents(const mtx::responses::Timeline &events);
         void syncState(const mtx::responses::State &state);
@@ -327,6 +333,8 @@ public slots:
         QString roomTopic() const;
         InputBar *input() { return &input_; }
         Permissions *permissions() { return &permissions_; }
+        //! The members of this room, loaded on first use and then kept up to date.
+        UsersModel *usersModel();
         QString roomAvatarUrl() const;
         QString roomId() const { return room_id_; }
 
@@ -392,6 +400,7 @@ private:
 
         InputBar input_{this};
         Permissions permissions_;
+        UsersModel *usersModel_ = nullptr;
 
         QTimer showEventTimer{this};
         QString eventIdToShow;
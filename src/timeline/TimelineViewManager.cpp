@@ -86,6 +86,17 @@ removeReplyFallback(mtx::events::Event<T> &e)
                 }
         }
 }
+
+//! The emoji never change at runtime, so all emoji completers share one search index.
+std::shared_ptr<const CompletionProxyModel::SearchIndex>
+emojiSearchIndex()
+{
+        static const auto index = [] {
+                emoji::EmojiModel model;
+                return CompletionProxyModel::buildSearchIndex(&model);
+        }();
+        return index;
+}
 }
 
 void
@@ -132,6 +143,7 @@ TimelineViewManager::userStatus(QString id) const
 TimelineViewManager::TimelineViewManager(CallManager *callManager, ChatPage *parent)
   : QObject(parent)
   , imgProvider(new MxcImageProvider())
+  , avatarProvider(new MxcImageProvider(true))
   , colorImgProvider(new ColorImageProvider())
   , blurhashProvider(new BlurhashProvider())
   , callManager_(callManager)
@@ -275,6 +287,7 @@ TimelineViewManager::TimelineViewManager(CallManager *callManager, ChatPage *par
         container->setMinimumSize(200, 200);
         updateColorPalette();
         view->engine()->addImageProvider("MxcImage", imgProvider);
+        view->engine()->addImageProvider("MxcAvatar", avatarProvider);
         view->engine()->addImageProvider("colorimage", colorImgProvider);
         view->engine()->addImageProvider("blurhash", blurhashProvider);
         view->setSource(QUrl("qrc:///qml/Root.qml"));
@@ -297,6 +310,9 @@ TimelineViewManager::TimelineViewManager(CallManager *callManager, ChatPage *par
                                 message.content,
                                 QString::fromStdString(message.sender),
                                 event_id)) {
+                                  // The flow keeps a pointer to the timeline.
+                                  if (model)
+                                          rooms_->keepRoomLoaded(model->roomId(), flow.data());
                                   dvList[event_id] = flow;
                                   emit newDeviceVerificationRequest(flow.data());
                           }
@@ -362,6 +378,7 @@ void
 TimelineViewManager::openRoomSettings(QString room_id)
 {
         RoomSettings *settings = new RoomSettings(room_id, this);
+        rooms_->keepRoomLoaded(room_id, settings);
         connect(rooms_->getRoomById(room_id).data(),
                 &TimelineModel::roomAvatarUrlChanged,
                 settings,
@@ -482,6 +499,7 @@ TimelineViewManager::verifyUser(QString userid)
                                         auto flow =
                                           DeviceVerificationFlow::InitiateUserVerification(
                                             this, model.data(), userid);
+                                        rooms_->keepRoomLoaded(model->roomId(), flow.data());
                                         connect(model.data(),
                                                 &TimelineModel::updateFlowEventId,
                                                 this,
@@ -524,7 +542,7 @@ void
 TimelineViewManager::updateReadReceipts(const QString &room_id,
                                         const std::vector<QString> &event_ids)
 {
-        if (auto room = rooms_->getRoomById(room_id)) {
+        if (auto room = rooms_->getLoadedRoomById(room_id)) {
                 room->markEventsAsRead(event_ids);
         }
 }
@@ -532,8 +550,22 @@ TimelineViewManager::updateReadReceipts(const QString &room_id,
 void
 TimelineViewManager::receivedSessionKey(const std::string &room_id, const std::string &session_id)
 {
-        if (auto room = rooms_->getRoomById(QString::fromStdString(room_id))) {
+        if (auto room = rooms_->getLoadedRoomById(QString::fromStdString(room_id))) {
                 room->receivedSessionKey(session_id);
+        } else {
+                rooms_->receivedSessionKeys(QString::fromStdString(room_id), {session_id});
+        }
+}
+
+void
+TimelineViewManager::receivedSessionKeys(const std::string &room_id,
+                                         const std::vector<std::string> &session_ids)
+{
+        if (auto room = rooms_->getLoadedRoomById(QString::fromStdString(room_id))) {
+                for (const auto &session_id : session_ids)
+                        room->receivedSessionKey(session_id);
+        } else {
+                rooms_->receivedSessionKeys(QString::fromStdString(room_id), session_ids);
         }
 }
 
@@ -597,18 +629,29 @@ QObject *
 TimelineViewManager::completerFor(QString completerName, QString roomId)
 {
         if (completerName == "user") {
+                // Joined rooms keep their members in memory, so opening the completer is cheap.
+                if (auto room = rooms_->getRoomById(roomId)) {
+                        auto userModel = room->usersModel();
+                        auto proxy     = new CompletionProxyModel(
+                          userModel, [userModel]() { return userModel->searchIndex(); });
+                        // The completer uses the members of the timeline.
+                        rooms_->keepRoomLoaded(roomId, proxy);
+                        return proxy;
+                }
+
                 auto userModel = new UsersModel(roomId.toStdString());
                 auto proxy     = new CompletionProxyModel(userModel);
                 userModel->setParent(proxy);
                 return proxy;
         } else if (completerName == "emoji") {
                 auto emojiModel = new emoji::EmojiModel();
-                auto proxy      = new CompletionProxyModel(emojiModel);
+                auto proxy      = new CompletionProxyModel(emojiModel, emojiSearchIndex);
                 emojiModel->setParent(proxy);
                 return proxy;
         } else if (completerName == "allemoji") {
                 auto emojiModel = new emoji::EmojiModel();
-                auto proxy = new CompletionProxyModel(emojiModel, 1, static_cast<size_t>(-1) / 4);
+                auto proxy      = new CompletionProxyModel(
+                  emojiModel, emojiSearchIndex, 1, static_cast<size_t>(-1) / 4);
                 emojiModel->setParent(proxy);
                 return proxy;
         } else if (completerName == "room") {
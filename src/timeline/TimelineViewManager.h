@@ -97,6 +97,8 @@ signals:
 public slots:
         void updateReadReceipts(const QString &room_id, const std::vector<QString> &event_ids);
         void receivedSessionKey(const std::string &room_id, const std::string &session_id);
+        void receivedSessionKeys(const std::string &room_id,
+                                 const std::vector<std::string> &session_ids);
         void initializeRoomlist();
         void chatFocusChanged(bool focused)
         {
@@ -135,6 +137,7 @@ private:
         QWidget *container;
 
         MxcImageProvider *imgProvider;
+        MxcImageProvider *avatarProvider;
         ColorImageProvider *colorImgProvider;
         BlurhashProvider *blurhashProvider;
 